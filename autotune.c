@@ -0,0 +1,411 @@
+/**
+ * @file autotune.c
+ * @brief Picks the fastest transpose variant for each matrix shape
+ *
+ * trans.c registers a family of blocked transposes with
+ * registerTuningFunctions(): every tile shape from 4x4 to 16x16, walked
+ * along A, along B, either of those with the diagonal deferred, or staged
+ * through tmp, plus trans_recursive(). For each shape on the command line
+ * this program traces every candidate with tracegen-ct -T, simulates the
+ * trace under the test cache and the Haswell L1 cache, and keeps the
+ * correct candidate with the fewest cycles.
+ *
+ * The winners are written as transpose_tuned(), which transpose_submit()
+ * calls, into a copy of trans.c, replacing whatever lies between the
+ * DISPATCH_BEGIN and DISPATCH_END lines there. Keeping it in trans.c means
+ * the handin cannot pair a trans.c with a dispatch tuned for another one.
+ * Shapes that were not tuned go to trans_recursive(). The copy goes to
+ * TUNED_FILE unless -o names another file, so the handin source is only
+ * rewritten on request; copy it over trans.c and rebuild test-trans and
+ * tracegen-ct to use it.
+ */
+
+#define _POSIX_C_SOURCE 200809L /* rename, popen */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h> // for WEXITSTATUS
+
+#include "cachelab.h"
+#include "csim.h"
+
+#define CMD_BUFSIZE 334
+#define FILENAME_BUFSIZE 255
+
+/* Trace file each candidate is traced into */
+#define TRACE_FILE "trace.tune"
+
+/* The source holding the candidates, and where its tuned copy goes */
+#define TRANS_FILE "trans.c"
+#define TUNED_FILE "trans-tuned.c"
+
+/* The lines of trans.c that enclose the generated dispatch */
+#define DISPATCH_BEGIN "/* BEGIN ./autotune dispatch, do not edit */\n"
+#define DISPATCH_END "/* END ./autotune dispatch */\n"
+
+/** @brief Shapes tuned when none are given on the command line */
+static const char *default_shapes[] = {
+    "32x32", "64x64", "128x128", "1024x1024", "63x65",
+    "57x57", "61x67", "6x60",    "137x1",     "1x137",
+};
+
+/** @brief The fastest candidate found for one shape */
+typedef struct {
+    size_t M;
+    size_t N;
+    int funcid;
+    unsigned long cycles[2]; /* test cache, Haswell L1 cache */
+} tuned_t;
+
+/* Globals set on the command line */
+static bool verbose = false;
+static bool rank_haswell = false;
+
+/**
+ * @brief Calculates the number of clock cycles for the statistics
+ */
+static unsigned long get_clock_cycles(const csim_stats_t *stats) {
+    return HIT_CYCLES * stats->hits + MISS_CYCLES * stats->misses;
+}
+
+/**
+ * @brief Parse a shape of the form MxN.
+ *
+ * @return True if the shape is valid, and false otherwise
+ */
+static bool parse_shape(const char *shape, size_t *M, size_t *N) {
+    char *end;
+    unsigned long m = strtoul(shape, &end, 10);
+    if (end == shape || *end != 'x') {
+        return false;
+    }
+    const char *rest = end + 1;
+    unsigned long n = strtoul(rest, &end, 10);
+    if (end == rest || *end != '\0') {
+        return false;
+    }
+    if (m == 0 || m > MAXN || n == 0 || n > MAXN) {
+        return false;
+    }
+    *M = m;
+    *N = n;
+    return true;
+}
+
+/**
+ * @brief Trace one candidate on an M by N matrix into TRACE_FILE.
+ *
+ * tracegen-ct writes text, which goes through a pipe into traceconv, so
+ * TRACE_FILE is a binary trace encoded as the records arrive.
+ *
+ * @return True if tracegen-ct ran and validated the transpose
+ */
+static bool generate_trace(size_t M, size_t N, int i) {
+    FILE *conv_in = popen("./traceconv - " TRACE_FILE " 2>/dev/null", "w");
+    if (conv_in == NULL) {
+        printf("Failed to run traceconv: %s\n", strerror(errno));
+        exit(1);
+    }
+    /* Let tracegen-ct inherit the write end of the pipe */
+    int fd = fileno(conv_in);
+    (void)fcntl(fd, F_SETFD, 0);
+
+    char cmd[CMD_BUFSIZE];
+    snprintf(cmd, sizeof(cmd),
+             "CONTECH_TRACE=/dev/fd/%d ./tracegen-ct -T -M %zu -N %zu -F %d "
+             "2>/dev/null",
+             fd, M, N, i);
+    int status = system(cmd);
+    int conv_status = pclose(conv_in);
+    if (status < 0) {
+        printf("Failed to run tracegen-ct: %s\n", strerror(errno));
+        exit(1);
+    }
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 127) {
+        printf("Failed to run tracegen-ct. Run make tracegen-ct first.\n");
+        exit(1);
+    }
+    if (conv_status < 0 || !WIFEXITED(conv_status) ||
+        WEXITSTATUS(conv_status) != 0) {
+        printf("Failed to encode the trace. Run make traceconv first.\n");
+        exit(1);
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/**
+ * @brief Simulate TRACE_FILE on a cache of 2^s sets of E lines of 2^b bytes.
+ *
+ * @return True if the trace was simulated
+ */
+static bool simulate_trace(int s, int E, int b, unsigned long *cycles) {
+    csim_t *sim = csim_create(s, E, b, NULL);
+    if (sim == NULL) {
+        printf("Cache simulator error.  Could not create a cache (s=%d, E=%d, "
+               "b=%d)\n",
+               s, E, b);
+        exit(1);
+    }
+    bool success = csim_simulate_file(sim, TRACE_FILE);
+    csim_stats_t stats;
+    success = csim_get_stats(sim, &stats) && success;
+    csim_destroy(sim);
+    *cycles = get_clock_cycles(&stats);
+    return success;
+}
+
+/**
+ * @brief Evaluate every candidate on one shape and keep the fastest.
+ *
+ * Candidates are ranked by cycles on the test cache, ties broken by the
+ * Haswell L1 cache, or the other way round with -l.
+ *
+ * @return True if some candidate was correct
+ */
+static bool tune_shape(size_t M, size_t N, tuned_t *best) {
+    int first = rank_haswell ? 1 : 0;
+    best->M = M;
+    best->N = N;
+    best->funcid = -1;
+
+    printf("%zux%zu:\n", M, N);
+    for (int i = 0; i < func_counter; i++) {
+        unsigned long cycles[2];
+        if (!generate_trace(M, N, i)) {
+            if (verbose) {
+                printf("  %-24s failed validation\n",
+                       func_list[i].description);
+            }
+            continue;
+        }
+        if (!simulate_trace(TEST_LOG_SET, TEST_ASSOC, TEST_LOG_BLOCK,
+                            &cycles[0]) ||
+            !simulate_trace(HASWELL_L1_SET, HASWELL_L1_ASSOC,
+                            HASWELL_L1_BLOCK, &cycles[1])) {
+            printf("Cache simulator error.  Could not simulate %s\n",
+                   TRACE_FILE);
+            exit(1);
+        }
+        if (verbose) {
+            printf("  %-24s %12lu %12lu\n", func_list[i].description,
+                   cycles[0], cycles[1]);
+        }
+
+        if (best->funcid < 0 || cycles[first] < best->cycles[first] ||
+            (cycles[first] == best->cycles[first] &&
+             cycles[1 - first] < best->cycles[1 - first])) {
+            best->funcid = i;
+            best->cycles[0] = cycles[0];
+            best->cycles[1] = cycles[1];
+        }
+    }
+    remove(TRACE_FILE);
+
+    if (best->funcid < 0) {
+        printf("  no candidate is correct\n");
+        return false;
+    }
+    printf("  best: %s, %lu cycles (test), %lu cycles (Haswell L1)\n",
+           func_list[best->funcid].description, best->cycles[0],
+           best->cycles[1]);
+    return true;
+}
+
+/**
+ * @brief Read all of the file at path into a string.
+ *
+ * @return The contents, to be freed by the caller, or NULL on error
+ */
+static char *read_file(const char *path) {
+    FILE *in = fopen(path, "r");
+    if (in == NULL) {
+        return NULL;
+    }
+    size_t size = 0;
+    size_t cap = 4096;
+    char *text = malloc(cap);
+    while (text != NULL) {
+        size += fread(text + size, 1, cap - size - 1, in);
+        if (size < cap - 1) {
+            break;
+        }
+        cap *= 2;
+        char *grown = realloc(text, cap);
+        if (grown == NULL) {
+            free(text);
+        }
+        text = grown;
+    }
+    if (text != NULL && ferror(in)) {
+        free(text);
+        text = NULL;
+    }
+    fclose(in);
+    if (text != NULL) {
+        text[size] = '\0';
+    }
+    return text;
+}
+
+/**
+ * @brief Copy the file at in_path to path, with transpose_tuned()
+ *        replaced by the one for the tuned shapes.
+ *
+ * Everything outside the DISPATCH_BEGIN and DISPATCH_END lines is kept.
+ *
+ * @return True if the file was written
+ */
+static bool write_dispatch(const char *in_path, const char *path,
+                           const tuned_t *tuned, int n) {
+    char *text = read_file(in_path);
+    if (text == NULL) {
+        return false;
+    }
+    char *begin = strstr(text, DISPATCH_BEGIN);
+    char *end = begin == NULL ? NULL : strstr(begin, DISPATCH_END);
+    if (end == NULL) {
+        printf("Error: %s has no %.*s and %.*s lines\n", in_path,
+               (int)strlen(DISPATCH_BEGIN) - 1, DISPATCH_BEGIN,
+               (int)strlen(DISPATCH_END) - 1, DISPATCH_END);
+        free(text);
+        return false;
+    }
+    begin += strlen(DISPATCH_BEGIN);
+
+    char tmp_name[FILENAME_BUFSIZE];
+    snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", path);
+    FILE *out = fopen(tmp_name, "w");
+    if (out == NULL) {
+        free(text);
+        return false;
+    }
+
+    fwrite(text, 1, (size_t)(begin - text), out);
+    fprintf(out,
+            "/**\n"
+            " * @brief Calls the fastest candidate measured for M by N.\n"
+            " *\n"
+            " * Cycles are for the test cache (s=%d, E=%d, b=%d) and the "
+            "Haswell L1\n"
+            " * cache (s=%d, E=%d, b=%d), ranked by the %s.\n"
+            " */\n",
+            TEST_LOG_SET, TEST_ASSOC, TEST_LOG_BLOCK, HASWELL_L1_SET,
+            HASWELL_L1_ASSOC, HASWELL_L1_BLOCK,
+            rank_haswell ? "Haswell L1 cache" : "test cache");
+    fprintf(out, "static void transpose_tuned(size_t M, size_t N, double "
+                 "A[N][M],\n"
+                 "                            double B[M][N], double "
+                 "tmp[TMPCOUNT]) {\n");
+    for (int k = 0; k < n; k++) {
+        fprintf(out, "    %sif (M == %zu && N == %zu) {\n", k ? "} else " : "",
+                tuned[k].M, tuned[k].N);
+        fprintf(out, "        /* %lu, %lu cycles */\n", tuned[k].cycles[0],
+                tuned[k].cycles[1]);
+        fprintf(out, "        %s(M, N, A, B, tmp);\n",
+                func_list[tuned[k].funcid].description);
+    }
+    fprintf(out, "    } else {\n"
+                 "        trans_recursive(M, N, A, B, tmp);\n"
+                 "    }\n"
+                 "}\n");
+    fputs(end, out);
+    free(text);
+
+    if (fclose(out) != 0 || rename(tmp_name, path) != 0) {
+        remove(tmp_name);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Print usage info
+ */
+static void usage(char *argv[]) {
+    printf("Usage: %s [-h] [-v] [-l] [-o <file>] [<M>x<N> ...]\n", argv[0]);
+    printf("Options:\n");
+    printf("  -h          Print this help message.\n");
+    printf("  -v          Print the cycles of every candidate.\n");
+    printf("  -l          Rank by the large (Haswell L1) cache.\n");
+    printf("  -o <file>   File to write the tuned %s to (default %s).\n",
+           TRANS_FILE, TUNED_FILE);
+    printf("Shapes are M columns by N rows of A, at most %d each.\n", MAXN);
+    printf("Example: %s -v 32x32 63x65\n", argv[0]);
+}
+
+/**
+ * @brief Main routine
+ */
+int main(int argc, char *argv[]) {
+    const char *out_path = TUNED_FILE;
+    int c;
+
+    while ((c = getopt(argc, argv, "hvlo:")) != -1) {
+        switch (c) {
+        case 'v':
+            verbose = true;
+            break;
+        case 'l':
+            rank_haswell = true;
+            break;
+        case 'o':
+            out_path = optarg;
+            break;
+        case 'h':
+            usage(argv);
+            exit(0);
+        default:
+            usage(argv);
+            exit(1);
+        }
+    }
+
+    const char **shapes = (const char **)&argv[optind];
+    int n = argc - optind;
+    if (n == 0) {
+        shapes = default_shapes;
+        n = (int)(sizeof(default_shapes) / sizeof(default_shapes[0]));
+    }
+
+    tuned_t *tuned = calloc((size_t)n, sizeof(tuned_t));
+    if (tuned == NULL) {
+        printf("Error: out of memory\n");
+        exit(1);
+    }
+    for (int k = 0; k < n; k++) {
+        if (!parse_shape(shapes[k], &tuned[k].M, &tuned[k].N)) {
+            printf("Error: invalid shape %s\n", shapes[k]);
+            usage(argv);
+            exit(1);
+        }
+        for (int j = 0; j < k; j++) {
+            if (tuned[j].M == tuned[k].M && tuned[j].N == tuned[k].N) {
+                printf("Error: shape %s given twice\n", shapes[k]);
+                exit(1);
+            }
+        }
+    }
+
+    registerTuningFunctions();
+    for (int k = 0; k < n; k++) {
+        if (!tune_shape(tuned[k].M, tuned[k].N, &tuned[k])) {
+            exit(1);
+        }
+    }
+
+    if (!write_dispatch(TRANS_FILE, out_path, tuned, n)) {
+        printf("Error: failed to write %s\n", out_path);
+        exit(1);
+    }
+    printf("Wrote %s\n", out_path);
+    if (strcmp(out_path, TRANS_FILE) != 0) {
+        printf("Copy it over %s and rebuild to use it.\n", TRANS_FILE);
+    }
+    free(tuned);
+    return 0;
+}
@@ -0,0 +1,272 @@
+/**
+ * @file bench-trans.c
+ * @brief Times the registered transpose functions natively
+ *
+ * test-trans scores a transpose by simulating its memory trace. This
+ * program instead runs every function of registerFunctions(), which
+ * includes the SSE2 and AVX2 transposes, and the multithreaded one of
+ * registerParallelFunctions() on the real machine, over a range of
+ * matrix sizes, and reports how fast each one moves data: the bytes of A
+ * read plus the bytes of B written, divided by the best wall-clock time of
+ * several runs. Each result is also checked against correctTrans(), and a
+ * function that gets a size wrong is reported instead of timed.
+ *
+ * The multithreaded transpose is never traced, scored or handed in;
+ * test-trans -P only checks its results.
+ *
+ * Every function writes into a freshly mapped B, so its first, untimed
+ * run is the one that touches B's pages. The thread pool is restarted
+ * before it, so the multithreaded transpose runs it on the static split of
+ * trans-par.c and each page lands on the NUMA node of the thread whose run
+ * of tiles covers it.
+ *
+ * With -t, only the multithreaded transpose of trans-par.c is timed, with
+ * 1, 2, 4, ... threads up to one per online CPU, and its speedup over one
+ * thread is reported.
+ *
+ * It is linked with trans.c, trans-simd.c and trans-par.c compiled with
+ * -O3 and without the is_transpose() asserts; see bench-trans in the
+ * Makefile.
+ */
+
+#define _POSIX_C_SOURCE 200809L /* clock_gettime, posix_memalign */
+#define _DEFAULT_SOURCE         /* MAP_ANONYMOUS */
+
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cachelab.h"
+
+/** @brief Sizes timed when none are given on the command line */
+static const char *default_shapes[] = {
+    "32x32",     "64x64",     "128x128", "256x256",
+    "512x512",   "1024x1024", "63x65",   "1000x1003",
+    "2048x2048", "4096x1024", "1024x4096",
+};
+
+/** @brief Sizes timed with -t when none are given */
+static const char *scaling_shapes[] = {
+    "1024x1024", "2048x2048", "4096x4096", "4096x1024",
+    "1024x4096", "4096x2048", "3000x4000",
+};
+
+/* Globals set on the command line */
+static int reps = 5;
+static bool scaling = false;
+
+/* Threads for the multithreaded transpose, 0 for one per online CPU */
+static int threads = 0;
+
+/**
+ * @brief Parse a shape of the form MxN.
+ *
+ * @return True if the shape is valid, and false otherwise
+ */
+static bool parse_shape(const char *shape, size_t *M, size_t *N) {
+    char *end;
+    unsigned long m = strtoul(shape, &end, 10);
+    if (end == shape || *end != 'x') {
+        return false;
+    }
+    const char *rest = end + 1;
+    unsigned long n = strtoul(rest, &end, 10);
+    if (end == rest || *end != '\0') {
+        return false;
+    }
+    if (m == 0 || m > MAXN || n == 0 || n > MAXN) {
+        return false;
+    }
+    *M = m;
+    *N = n;
+    return true;
+}
+
+/**
+ * @brief Seconds on the monotonic clock
+ */
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+/**
+ * @brief Allocate a cache-line aligned matrix of count doubles.
+ */
+static double *alloc_matrix(size_t count) {
+    void *p;
+    if (posix_memalign(&p, 64, count * sizeof(double)) != 0) {
+        printf("Error: out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+/**
+ * @brief Time function i on A, writing a freshly mapped, zeroed B.
+ *
+ * @return The best time of reps runs in seconds, or -1 if the first run
+ *         did not produce target
+ */
+static double time_function(int i, size_t M, size_t N, double A[N][M],
+                            double target[M][N], double tmp[TMPCOUNT]) {
+    size_t size = M * N * sizeof(double);
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        printf("Error: out of memory\n");
+        exit(1);
+    }
+    double(*B)[N] = (double(*)[N])map;
+
+    /* First run: fault in B on a new pool and check the result */
+    setTransThreads(threads);
+    (*func_list[i].func_ptr)(M, N, A, B, tmp);
+    double best = -1;
+    if (memcmp(B, target, size) == 0) {
+        for (int r = 0; r < reps; r++) {
+            double start = now();
+            (*func_list[i].func_ptr)(M, N, A, B, tmp);
+            double elapsed = now() - start;
+            if (best < 0 || elapsed < best) {
+                best = elapsed;
+            }
+        }
+    }
+    munmap(map, size);
+    return best;
+}
+
+/**
+ * @brief Time every registered function on an M by N matrix A and print
+ *        one line per function, or with -t one line per thread count.
+ */
+static void bench_shape(size_t M, size_t N) {
+    double(*A)[M] = (double(*)[M])alloc_matrix(M * N);
+    double(*target)[N] = (double(*)[N])alloc_matrix(M * N);
+    double *tmp = alloc_matrix(TMPCOUNT);
+
+    initMatrix(M, N, A, target);
+    correctTrans(M, N, A, target);
+    double bytes = 2.0 * (double)(M * N * sizeof(double));
+
+    printf("\n%zux%zu (%.1f MB moved per run):\n", M, N, bytes / 1e6);
+    if (scaling) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        double base = -1;
+        for (long t = 1;; t = t * 2 < cpus ? t * 2 : cpus) {
+            threads = (int)t;
+            double best = time_function(0, M, N, A, target, tmp);
+            if (best < 0) {
+                printf("  %3ld threads: incorrect\n", t);
+                break;
+            }
+            if (base < 0) {
+                base = best;
+            }
+            printf("  %3ld threads %10.1f us %8.2f GB/s %6.2fx\n", t,
+                   best * 1e6, bytes / best / 1e9, base / best);
+            if (t >= cpus) {
+                break;
+            }
+        }
+    } else {
+        for (int i = 0; i < func_counter; i++) {
+            double best = time_function(i, M, N, A, target, tmp);
+            if (best < 0) {
+                printf("  %-40s incorrect\n", func_list[i].description);
+                continue;
+            }
+            printf("  %-40s %10.1f us %8.2f GB/s\n", func_list[i].description,
+                   best * 1e6, bytes / best / 1e9);
+        }
+    }
+
+    free(A);
+    free(target);
+    free(tmp);
+}
+
+/**
+ * @brief Print usage info
+ */
+static void usage(char *argv[]) {
+    printf("Usage: %s [-h] [-t] [-r <reps>] [<M>x<N> ...]\n", argv[0]);
+    printf("Options:\n");
+    printf("  -h          Print this help message.\n");
+    printf("  -t          Time the multithreaded transpose on 1 to all "
+           "CPUs.\n");
+    printf("  -r <reps>   Timed runs per function and size, best kept "
+           "(default 5).\n");
+    printf("Shapes are M columns by N rows of A, at most %d each.\n", MAXN);
+    printf("Example: %s -r 20 1024x1024 63x65\n", argv[0]);
+}
+
+/**
+ * @brief Main routine
+ */
+int main(int argc, char *argv[]) {
+    int c;
+
+    while ((c = getopt(argc, argv, "htr:")) != -1) {
+        switch (c) {
+        case 't':
+            scaling = true;
+            break;
+        case 'r':
+            reps = atoi(optarg);
+            if (reps < 1) {
+                printf("Error: reps must be at least 1\n");
+                exit(1);
+            }
+            break;
+        case 'h':
+            usage(argv);
+            exit(0);
+        default:
+            usage(argv);
+            exit(1);
+        }
+    }
+
+    const char **shapes = (const char **)&argv[optind];
+    int n = argc - optind;
+    if (n == 0 && scaling) {
+        shapes = scaling_shapes;
+        n = (int)(sizeof(scaling_shapes) / sizeof(scaling_shapes[0]));
+    } else if (n == 0) {
+        shapes = default_shapes;
+        n = (int)(sizeof(default_shapes) / sizeof(default_shapes[0]));
+    }
+
+    size_t *dims = calloc(2 * (size_t)n, sizeof(size_t));
+    if (dims == NULL) {
+        printf("Error: out of memory\n");
+        exit(1);
+    }
+    for (int k = 0; k < n; k++) {
+        if (!parse_shape(shapes[k], &dims[2 * k], &dims[2 * k + 1])) {
+            printf("Error: invalid shape %s\n", shapes[k]);
+            usage(argv);
+            exit(1);
+        }
+    }
+
+    if (scaling) {
+        registerParallelFunctions();
+    } else {
+        registerFunctions();
+        registerParallelFunctions();
+    }
+    for (int k = 0; k < n; k++) {
+        bench_shape(dims[2 * k], dims[2 * k + 1]);
+    }
+    free(dims);
+    return 0;
+}
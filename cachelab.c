@@ -4,6 +4,7 @@
  */
 #include <assert.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
@@ -40,6 +41,40 @@ void printSummary(const csim_stats_t *stats) {
     fclose(output_fp);
 }
 
+/**
+ * @brief Store a summary of several cache simulations over one trace.
+ *
+ * Prints one labelled line per simulation and stores one row per
+ * simulation, in the same order, so loadSummary() reads the first one.
+ *
+ * @param[in] stats  The simulation statistics to be stored
+ * @param[in] labels A label for each row, e.g. the cache geometry
+ * @param[in] n      Number of simulations
+ */
+void printSummaries(const csim_stats_t *stats, const char *const *labels,
+                    size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        printf("%s hits:%ld misses:%ld evictions:%ld dirty_bytes_in_cache:%ld "
+               "dirty_bytes_evicted:%ld\n",
+               labels[i], stats[i].hits, stats[i].misses, stats[i].evictions,
+               stats[i].dirty_bytes, stats[i].dirty_evictions);
+    }
+
+    FILE *output_fp = fopen(".csim_results", "w");
+    if (output_fp == NULL) {
+        fprintf(stderr, "Error: failed to open results file: %s\n",
+                strerror(errno));
+        return;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        fprintf(output_fp, "%ld %ld %ld %ld %ld\n", stats[i].hits,
+                stats[i].misses, stats[i].evictions, stats[i].dirty_bytes,
+                stats[i].dirty_evictions);
+    }
+    fclose(output_fp);
+}
+
 /**
  * @brief Load the stored summary of the cache simulation statistics.
  *
@@ -67,6 +102,545 @@ bool loadSummary(csim_stats_t *stats) {
     return true;
 }
 
+/**
+ * @brief Write the counters of one csim_stats_t as JSON members.
+ */
+static void writeStatsMembers(FILE *out, const csim_stats_t *stats) {
+    fprintf(out,
+            "\"hits\": %lu, \"misses\": %lu, \"evictions\": %lu, "
+            "\"dirty_bytes_in_cache\": %lu, \"dirty_bytes_evicted\": %lu, "
+            "\"memory_bytes_read\": %lu, \"memory_bytes_written\": %lu, "
+            "\"prefetch_issued\": %lu, \"prefetch_useful\": %lu, "
+            "\"prefetch_late\": %lu, \"prefetch_polluting\": %lu, "
+            "\"prefetch_evictions\": %lu",
+            stats->hits, stats->misses, stats->evictions, stats->dirty_bytes,
+            stats->dirty_evictions, stats->mem_read_bytes,
+            stats->mem_write_bytes, stats->pf_issued, stats->pf_useful,
+            stats->pf_late, stats->pf_polluting, stats->pf_evictions);
+}
+
+/**
+ * @brief Write the statistics of several simulations as JSON.
+ *
+ * The output is one object with a "caches" array holding, for each
+ * simulation, its label, its totals and its interval series:
+ *
+ *   {"caches": [{"label": "s:5 E:1 b:5",
+ *                "total": {"hits": ..., ...},
+ *                "intervals": [{"start": 0, "accesses": ..., ...}]}]}
+ *
+ * @param[in] out           Stream to write to
+ * @param[in] stats         Totals of each simulation
+ * @param[in] labels        A label for each simulation
+ * @param[in] n             Number of simulations
+ * @param[in] intervals     num_intervals intervals for each simulation
+ * @param[in] num_intervals Number of intervals, 0 for none
+ *
+ * @return True if the output was written, false otherwise
+ */
+bool writeStatsJSON(FILE *out, const csim_stats_t *stats,
+                    const char *const *labels, size_t n,
+                    const csim_interval_t *const *intervals,
+                    size_t num_intervals) {
+    fprintf(out, "{\"caches\": [");
+    for (size_t i = 0; i < n; i++) {
+        fprintf(out, "%s\n  {\"label\": \"%s\",\n   \"total\": {",
+                i == 0 ? "" : ",", labels[i]);
+        writeStatsMembers(out, &stats[i]);
+        fprintf(out, "},\n   \"intervals\": [");
+        for (size_t j = 0; j < num_intervals; j++) {
+            const csim_interval_t *interval = &intervals[i][j];
+            fprintf(out, "%s\n    {\"start\": %lu, \"accesses\": %lu, ",
+                    j == 0 ? "" : ",", interval->start, interval->accesses);
+            writeStatsMembers(out, &interval->stats);
+            fprintf(out, "}");
+        }
+        fprintf(out, "]}");
+    }
+    fprintf(out, "\n]}\n");
+    return fflush(out) == 0 && !ferror(out);
+}
+
+/**
+ * @brief Write the statistics of several simulations as CSV.
+ *
+ * One header row, then for each simulation a row per interval, numbered
+ * from 0, followed by a row with interval "total" for its totals.
+ *
+ * @param[in] out           Stream to write to
+ * @param[in] stats         Totals of each simulation
+ * @param[in] labels        A label for each simulation
+ * @param[in] n             Number of simulations
+ * @param[in] intervals     num_intervals intervals for each simulation
+ * @param[in] num_intervals Number of intervals, 0 for none
+ *
+ * @return True if the output was written, false otherwise
+ */
+bool writeStatsCSV(FILE *out, const csim_stats_t *stats,
+                   const char *const *labels, size_t n,
+                   const csim_interval_t *const *intervals,
+                   size_t num_intervals) {
+    fprintf(out, "cache,interval,start,accesses,hits,misses,evictions,"
+                 "dirty_bytes_in_cache,dirty_bytes_evicted,"
+                 "memory_bytes_read,memory_bytes_written,prefetch_issued,"
+                 "prefetch_useful,prefetch_late,prefetch_polluting,"
+                 "prefetch_evictions\n");
+    for (size_t i = 0; i < n; i++) {
+        for (size_t j = 0; j < num_intervals; j++) {
+            const csim_interval_t *interval = &intervals[i][j];
+            const csim_stats_t *st = &interval->stats;
+            fprintf(out,
+                    "\"%s\",%zu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,"
+                    "%lu,%lu,%lu\n",
+                    labels[i], j, interval->start, interval->accesses,
+                    st->hits, st->misses, st->evictions, st->dirty_bytes,
+                    st->dirty_evictions, st->mem_read_bytes,
+                    st->mem_write_bytes, st->pf_issued, st->pf_useful,
+                    st->pf_late, st->pf_polluting, st->pf_evictions);
+        }
+        fprintf(out,
+                "\"%s\",total,0,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,"
+                "%lu,%lu\n",
+                labels[i], stats[i].hits + stats[i].misses, stats[i].hits,
+                stats[i].misses, stats[i].evictions, stats[i].dirty_bytes,
+                stats[i].dirty_evictions, stats[i].mem_read_bytes,
+                stats[i].mem_write_bytes, stats[i].pf_issued,
+                stats[i].pf_useful, stats[i].pf_late, stats[i].pf_polluting,
+                stats[i].pf_evictions);
+    }
+    return fflush(out) == 0 && !ferror(out);
+}
+
+/**
+ * @brief Fill in a binary trace header.
+ *
+ * @param[out] header The header bytes
+ * @param[in]  count  Number of records, or TRACE_COUNT_UNKNOWN
+ */
+void encodeTraceHeader(unsigned char header[TRACE_HEADER_SIZE],
+                       uint64_t count) {
+    memset(header, 0, TRACE_HEADER_SIZE);
+    memcpy(header, TRACE_MAGIC, 4);
+    header[4] = TRACE_VERSION;
+    for (int i = 0; i < 8; i++) {
+        header[8 + i] = (unsigned char)(count >> (8 * i));
+    }
+}
+
+/**
+ * @brief Check for a binary trace header and read its record count.
+ *
+ * @param[in]  buf   Start of the trace
+ * @param[in]  len   Number of bytes available at buf
+ * @param[out] count Record count from the header, may be NULL
+ *
+ * @return True if buf starts with a binary trace header we can read
+ */
+bool decodeTraceHeader(const unsigned char *buf, size_t len, uint64_t *count) {
+    if (len < TRACE_HEADER_SIZE || memcmp(buf, TRACE_MAGIC, 4) != 0 ||
+        buf[4] != TRACE_VERSION) {
+        return false;
+    }
+    if (count != NULL) {
+        *count = 0;
+        for (int i = 0; i < 8; i++) {
+            *count |= (uint64_t)buf[8 + i] << (8 * i);
+        }
+    }
+    return true;
+}
+
+/** @brief Append an unsigned LEB128 varint, returning its length. */
+static size_t putVarint(unsigned char *buf, uint64_t value) {
+    size_t n = 0;
+    while (value >= 0x80) {
+        buf[n++] = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    buf[n++] = (unsigned char)value;
+    return n;
+}
+
+/** @brief Read an unsigned LEB128 varint; 0 if incomplete, -1 if bad. */
+static long getVarint(const unsigned char *buf, const unsigned char *end,
+                      uint64_t *value) {
+    uint64_t v = 0;
+    for (long n = 0; n < 10; n++) {
+        if (buf + n >= end) {
+            return 0;
+        }
+        v |= (uint64_t)(buf[n] & 0x7f) << (7 * n);
+        if ((buf[n] & 0x80) == 0) {
+            *value = v;
+            return n + 1;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Move stride rank of stream to the front, or with rank
+ *        TRACE_STRIDES push delta in front, and advance the stream to
+ *        address.
+ */
+static void codeStream(trace_coder_t *coder, unsigned int stream,
+                       unsigned int rank, uint64_t delta, uint64_t address) {
+    uint64_t *stride = coder->stride[stream];
+    if (rank < TRACE_STRIDES) {
+        delta = stride[rank];
+    } else {
+        rank = TRACE_STRIDES - 1;
+    }
+    for (; rank > 0; rank--) {
+        stride[rank] = stride[rank - 1];
+    }
+    stride[0] = delta;
+    coder->last[stream] = address;
+    coder->used[stream] = ++coder->records;
+}
+
+/**
+ * @brief Encode one record into the binary trace format.
+ *
+ * @param[out]    buf   Destination, at least TRACE_RECORD_MAX bytes
+ * @param[in,out] coder Stream state, updated
+ * @param[in]     rec   The record to encode
+ *
+ * @return The number of bytes written to buf
+ */
+size_t encodeTraceRecord(unsigned char buf[TRACE_RECORD_MAX],
+                         trace_coder_t *coder, const trace_record_t *rec) {
+    unsigned int op;
+    switch (rec->op) {
+    case 'L':
+        op = 0;
+        break;
+    case 'S':
+        op = 1;
+        break;
+    case 'M':
+        op = 2;
+        break;
+    default:
+        op = 3;
+        break;
+    }
+    unsigned int size;
+    switch (rec->size) {
+    case 1:
+        size = 0;
+        break;
+    case 4:
+        size = 1;
+        break;
+    case 8:
+        size = 2;
+        break;
+    default:
+        size = 3;
+        break;
+    }
+
+    /* a stream that predicts the address, else the nearest one */
+    uint64_t address = rec->address;
+    unsigned int stream = 0;
+    unsigned int rank = TRACE_STRIDES;
+    uint64_t nearest = UINT64_MAX;
+    for (unsigned int i = 0; i < TRACE_STREAMS && rank == TRACE_STRIDES;
+         i++) {
+        uint64_t delta = address - coder->last[i];
+        uint64_t distance = delta >> 63 ? 0 - delta : delta;
+        for (unsigned int r = 0; r < TRACE_STRIDES; r++) {
+            if (delta == coder->stride[i][r]) {
+                stream = i;
+                rank = r;
+                break;
+            }
+        }
+        if (distance < nearest) {
+            stream = i;
+            nearest = distance;
+        }
+    }
+    if (rank == TRACE_STRIDES && nearest > TRACE_NEAR) {
+        for (unsigned int i = 0; i < TRACE_STREAMS; i++) {
+            if (coder->used[i] < coder->used[stream]) {
+                stream = i;
+            }
+        }
+    }
+
+    size_t n = 1;
+    buf[0] = (unsigned char)(op | size << 2 | stream << 4 | rank << 6);
+    if (op == 3) {
+        buf[n++] = (unsigned char)rec->op;
+    }
+    if (size == 3) {
+        n += putVarint(buf + n, rec->size);
+    }
+    uint64_t delta = address - coder->last[stream];
+    if (rank == TRACE_STRIDES) {
+        /* zigzag the delta so small negative strides stay short */
+        n += putVarint(buf + n, (delta << 1) ^ (0 - (delta >> 63)));
+    }
+    codeStream(coder, stream, rank, delta, address);
+    return n;
+}
+
+/**
+ * @brief Decode one record from the binary trace format.
+ *
+ * @param[in]     buf   Start of the record
+ * @param[in]     end   End of the available bytes
+ * @param[in,out] coder Stream state, updated
+ * @param[out]    rec   The decoded record
+ *
+ * @return Bytes consumed, 0 if the record is cut off by end, -1 if the
+ *         bytes are not a valid record
+ */
+long decodeTraceRecord(const unsigned char *buf, const unsigned char *end,
+                       trace_coder_t *coder, trace_record_t *rec) {
+    static const char ops[3] = {'L', 'S', 'M'};
+    static const unsigned int sizes[3] = {1, 4, 8};
+    const unsigned char *p = buf;
+    uint64_t v;
+    long n;
+
+    if (p >= end) {
+        return 0;
+    }
+    unsigned int head = *p++;
+    unsigned int stream = head >> 4 & 3;
+    unsigned int rank = head >> 6;
+    if ((head & 3) == 3) {
+        if (p >= end) {
+            return 0;
+        }
+        rec->op = (char)*p++;
+    } else {
+        rec->op = ops[head & 3];
+    }
+    if ((head >> 2 & 3) == 3) {
+        if ((n = getVarint(p, end, &v)) <= 0) {
+            return n;
+        }
+        if (v > UINT_MAX) {
+            return -1;
+        }
+        p += n;
+        rec->size = (unsigned int)v;
+    } else {
+        rec->size = sizes[head >> 2 & 3];
+    }
+
+    uint64_t delta = 0;
+    if (rank == TRACE_STRIDES) {
+        if ((n = getVarint(p, end, &v)) <= 0) {
+            return n;
+        }
+        p += n;
+        delta = (v >> 1) ^ (0 - (v & 1));
+    } else {
+        delta = coder->stride[stream][rank];
+    }
+    uint64_t address = coder->last[stream] + delta;
+    codeStream(coder, stream, rank, delta, address);
+    rec->address = (unsigned long)address;
+    return p - buf;
+}
+
+/* hex digit value + 1, or 0 for characters that are not hex digits */
+static const unsigned char hexDigit[256] = {
+    ['0'] = 1,  ['1'] = 2,  ['2'] = 3,  ['3'] = 4,  ['4'] = 5,  ['5'] = 6,
+    ['6'] = 7,  ['7'] = 8,  ['8'] = 9,  ['9'] = 10, ['a'] = 11, ['b'] = 12,
+    ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16, ['A'] = 11, ['B'] = 12,
+    ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+};
+
+/**
+ * @brief Parse one text record of the form " op address,size", with a
+ *        hex address and a decimal size, as csim reads them.
+ *
+ * @param[in]  p     Start of the text
+ * @param[in]  end   End of the available text
+ * @param[in]  final True if no more text follows end
+ * @param[out] rec   The parsed record
+ *
+ * @return Bytes consumed, up to the end of the record; 0 if [p, end)
+ *         holds no complete record, only whitespace or, unless final, a
+ *         line without its newline; -1 if the text is not a record
+ */
+long parseTraceRecord(const char *p, const char *end, bool final,
+                      trace_record_t *rec) {
+    const char *start = p;
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r' ||
+                       *p == '\v' || *p == '\f')) {
+        p++;
+    }
+    if (p == end || (!final && memchr(p, '\n', (size_t)(end - p)) == NULL)) {
+        return 0;
+    }
+    rec->op = *p++;
+    while (p < end && (*p == ' ' || *p == '\t')) {
+        p++;
+    }
+    if (end - p > 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X') &&
+        hexDigit[(unsigned char)p[2]]) {
+        p += 2;
+    }
+
+    const char *digits = p;
+    unsigned long address = 0;
+    unsigned int d;
+    while (p < end && (d = hexDigit[(unsigned char)*p]) != 0) {
+        address = (address << 4) | (d - 1);
+        p++;
+    }
+    if (p == digits || p == end || *p != ',') {
+        return -1;
+    }
+    p++;
+
+    digits = p;
+    unsigned int size = 0;
+    while (p < end && (d = (unsigned int)(*p - '0')) <= 9) {
+        size = size * 10 + d;
+        p++;
+    }
+    if (p == digits) {
+        return -1;
+    }
+    rec->address = address;
+    rec->size = size;
+    return p - start;
+}
+
+/**
+ * @brief Convert a text trace stream to a binary trace stream.
+ *
+ * The text is read in blocks and parsed in place, and the records of each
+ * block are encoded as it arrives, so in may be a pipe that a tracer is
+ * still writing. If out is seekable the header is rewritten
+ * with the final record count, otherwise it keeps TRACE_COUNT_UNKNOWN.
+ *
+ * @param[in]  in    Text trace, one "op address,size" record per line
+ * @param[out] out   Binary trace
+ * @param[out] count Number of records converted, may be NULL
+ *
+ * @return True if the operation was successful, false otherwise
+ */
+bool convertTraceToBinary(FILE *in, FILE *out, uint64_t *count) {
+    unsigned char buf[TRACE_RECORD_MAX > TRACE_HEADER_SIZE ? TRACE_RECORD_MAX
+                                                           : TRACE_HEADER_SIZE];
+    char text[4096];
+    trace_coder_t coder;
+    uint64_t records = 0;
+    trace_record_t rec;
+    size_t have = 0;
+    bool final = false;
+
+    memset(&coder, 0, sizeof(coder));
+    encodeTraceHeader(buf, TRACE_COUNT_UNKNOWN);
+    if (fwrite(buf, 1, TRACE_HEADER_SIZE, out) != TRACE_HEADER_SIZE) {
+        return false;
+    }
+    while (!final) {
+        have += fread(text + have, 1, sizeof(text) - have, in);
+        final = feof(in) || ferror(in);
+        size_t pos = 0;
+        long n;
+        while ((n = parseTraceRecord(text + pos, text + have, final, &rec)) >
+               0) {
+            size_t len = encodeTraceRecord(buf, &coder, &rec);
+            if (fwrite(buf, 1, len, out) != len) {
+                return false;
+            }
+            pos += (size_t)n;
+            records++;
+        }
+        if (n < 0 || ferror(in) || (pos == 0 && have == sizeof(text))) {
+            fprintf(stderr, "Error: malformed text trace after %lu records\n",
+                    (unsigned long)records);
+            return false;
+        }
+        have -= pos;
+        memmove(text, text + pos, have);
+    }
+
+    if (fseek(out, 0, SEEK_SET) == 0) {
+        encodeTraceHeader(buf, records);
+        if (fwrite(buf, 1, TRACE_HEADER_SIZE, out) != TRACE_HEADER_SIZE) {
+            return false;
+        }
+        (void)fseek(out, 0, SEEK_END);
+    }
+    if (count != NULL) {
+        *count = records;
+    }
+    return fflush(out) == 0;
+}
+
+/**
+ * @brief Convert a binary trace stream to a text trace stream.
+ *
+ * @param[in]  in    Binary trace
+ * @param[out] out   Text trace
+ * @param[out] count Number of records converted, may be NULL
+ *
+ * @return True if the operation was successful, false otherwise
+ */
+bool convertTraceToText(FILE *in, FILE *out, uint64_t *count) {
+    unsigned char buf[4096];
+    trace_coder_t coder;
+    uint64_t records = 0;
+    uint64_t expected;
+    trace_record_t rec;
+
+    size_t have = fread(buf, 1, TRACE_HEADER_SIZE, in);
+    if (!decodeTraceHeader(buf, have, &expected)) {
+        fprintf(stderr, "Error: not a binary trace\n");
+        return false;
+    }
+
+    memset(&coder, 0, sizeof(coder));
+    have = 0;
+    for (;;) {
+        size_t got = fread(buf + have, 1, sizeof(buf) - have, in);
+        have += got;
+        size_t pos = 0;
+        long n;
+        while ((n = decodeTraceRecord(buf + pos, buf + have, &coder, &rec)) >
+               0) {
+            fprintf(out, "%c %lx,%u\n", rec.op, rec.address, rec.size);
+            pos += (size_t)n;
+            records++;
+        }
+        if (n < 0) {
+            fprintf(stderr, "Error: bad record after %lu records\n",
+                    (unsigned long)records);
+            return false;
+        }
+        have -= pos;
+        memmove(buf, buf + pos, have);
+        if (got == 0) {
+            break;
+        }
+    }
+    if (have != 0 || ferror(in)) {
+        fprintf(stderr, "Error: truncated binary trace\n");
+        return false;
+    }
+    if (expected != TRACE_COUNT_UNKNOWN && expected != records) {
+        fprintf(stderr, "Error: header promised %lu records, found %lu\n",
+                (unsigned long)expected, (unsigned long)records);
+        return false;
+    }
+    if (count != NULL) {
+        *count = records;
+    }
+    return fflush(out) == 0;
+}
+
 /**
  * @brief Initialize the given matrices
  */
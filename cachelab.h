@@ -7,6 +7,8 @@
 #define CACHELAB_TOOLS_H
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 
 /**
@@ -18,14 +20,153 @@ typedef struct {
     unsigned long evictions;       /* number of evictions */
     unsigned long dirty_bytes;     /* number of dirty bytes in cache at end */
     unsigned long dirty_evictions; /* number of evictions of dirty lines */
+    unsigned long mem_read_bytes;  /* bytes read from memory (line fills) */
+    unsigned long mem_write_bytes; /* bytes written to memory */
+    unsigned long pf_issued;       /* prefetch fills */
+    unsigned long pf_useful;       /* prefetched lines used in time, hits */
+    unsigned long pf_late;         /* used too early, counted as misses */
+    unsigned long pf_polluting;    /* prefetch victims missed again */
+    unsigned long pf_evictions;    /* lines evicted by prefetch fills */
 } csim_stats_t;
 
 /** @brief Store a summary of the cache simulation statistics. */
 void printSummary(const csim_stats_t *stats);
 
+/** @brief Store a summary of several simulations, one row per cache. */
+void printSummaries(const csim_stats_t *stats, const char *const *labels,
+                    size_t n);
+
 /* @brief Load the stored summary of the cache simulation statistics. */
 bool loadSummary(csim_stats_t *stats);
 
+/**
+ * @brief Statistics of one interval of a trace
+ *
+ * hits, misses, evictions, dirty_evictions, the memory traffic and the
+ * prefetch counters count the interval only; dirty_bytes is the number of
+ * dirty bytes in the cache at its end.
+ */
+typedef struct {
+    unsigned long start;    /* accesses before the interval */
+    unsigned long accesses; /* accesses in the interval */
+    csim_stats_t stats;     /* what the interval's accesses did */
+} csim_interval_t;
+
+/** @brief Write totals and interval series of several caches as JSON. */
+bool writeStatsJSON(FILE *out, const csim_stats_t *stats,
+                    const char *const *labels, size_t n,
+                    const csim_interval_t *const *intervals,
+                    size_t num_intervals);
+
+/** @brief Write totals and interval series of several caches as CSV. */
+bool writeStatsCSV(FILE *out, const csim_stats_t *stats,
+                   const char *const *labels, size_t n,
+                   const csim_interval_t *const *intervals,
+                   size_t num_intervals);
+
+/*
+ * Binary trace format
+ *
+ * A binary trace starts with a TRACE_HEADER_SIZE byte header: the four
+ * bytes of TRACE_MAGIC, a version byte, three zero bytes and the record
+ * count as a little-endian 64-bit integer (TRACE_COUNT_UNKNOWN when the
+ * writer could not seek back to fill it in).
+ *
+ * Addresses are predicted from TRACE_STREAMS streams, each holding the
+ * address of the last record coded in it and its TRACE_STRIDES most
+ * recently used strides, most recent first. A transpose interleaves a
+ * walk along A with a walk down B, and a loop body interleaves a few such
+ * walks, so most records land on a stride of one of the streams and take
+ * a single byte.
+ *
+ * Each record is a head byte:
+ *   bits 0-1  op: 0 = 'L', 1 = 'S', 2 = 'M', 3 = raw op byte follows
+ *   bits 2-3  size: 0 = 1, 1 = 4, 2 = 8, 3 = a varint holding it follows
+ *   bits 4-5  stream
+ *   bits 6-7  address: 0 to TRACE_STRIDES - 1 = the stream's last address
+ *             plus its stride of that rank, 3 = a varint follows holding
+ *             the zigzag-encoded difference from the stream's last address
+ * followed by the op byte, the size varint and the difference varint that
+ * it calls for, in that order, as unsigned LEB128 varints. A stride that
+ * is used moves to the front of its stream, and a new difference is pushed
+ * in front as a stride, dropping the oldest. Every stream starts at
+ * address 0 with zero strides.
+ *
+ * Which stream a record goes to is the encoder's choice: the first one
+ * whose prediction matches, else the one whose last address is nearest,
+ * or the least recently used one when even that is more than TRACE_NEAR
+ * bytes away.
+ */
+
+/** @brief Magic bytes at the start of a binary trace */
+#define TRACE_MAGIC "CLBT"
+
+/** @brief Binary trace format version */
+#define TRACE_VERSION 2
+
+/** @brief Size of the binary trace header in bytes */
+#define TRACE_HEADER_SIZE 16
+
+/** @brief Record count stored when the count is not known */
+#define TRACE_COUNT_UNKNOWN UINT64_MAX
+
+/** @brief Largest encoded size of one binary trace record */
+#define TRACE_RECORD_MAX 17
+
+/** @brief Address streams of the binary trace format */
+#define TRACE_STREAMS 4
+
+/** @brief Strides remembered per stream */
+#define TRACE_STRIDES 3
+
+/** @brief Farthest an address may be from a stream to join it */
+#define TRACE_NEAR 4096
+
+/**
+ * @brief One decoded trace record
+ */
+typedef struct {
+    char op;               /* operation identifier, e.g. 'L' or 'S' */
+    unsigned int size;     /* access size in bytes */
+    unsigned long address; /* address accessed */
+} trace_record_t;
+
+/**
+ * @brief The stream state shared by an encoder and a decoder; a zeroed
+ *        one is the state at the start of a trace.
+ */
+typedef struct {
+    uint64_t last[TRACE_STREAMS];                  /* last address coded */
+    uint64_t stride[TRACE_STREAMS][TRACE_STRIDES]; /* most recent first */
+    uint64_t used[TRACE_STREAMS];                  /* records when last coded */
+    uint64_t records;                              /* records coded so far */
+} trace_coder_t;
+
+/** @brief Fill in a binary trace header. */
+void encodeTraceHeader(unsigned char header[TRACE_HEADER_SIZE],
+                       uint64_t count);
+
+/** @brief Check for a binary trace header and read its record count. */
+bool decodeTraceHeader(const unsigned char *buf, size_t len, uint64_t *count);
+
+/** @brief Encode one record, returning the number of bytes written. */
+size_t encodeTraceRecord(unsigned char buf[TRACE_RECORD_MAX],
+                         trace_coder_t *coder, const trace_record_t *rec);
+
+/** @brief Decode one record; 0 if [buf, end) is incomplete, -1 if bad. */
+long decodeTraceRecord(const unsigned char *buf, const unsigned char *end,
+                       trace_coder_t *coder, trace_record_t *rec);
+
+/** @brief Parse one text record; 0 if [p, end) is incomplete, -1 if bad. */
+long parseTraceRecord(const char *p, const char *end, bool final,
+                      trace_record_t *rec);
+
+/** @brief Convert a text trace stream to a binary trace stream. */
+bool convertTraceToBinary(FILE *in, FILE *out, uint64_t *count);
+
+/** @brief Convert a binary trace stream to a text trace stream. */
+bool convertTraceToText(FILE *in, FILE *out, uint64_t *count);
+
 /* Grading parameters for transpose */
 
 /** @brief Number of clock cycles for hit */
@@ -81,8 +222,19 @@ typedef struct trans_func {
 extern trans_func_t func_list[MAX_TRANS_FUNCS];
 extern int func_counter;
 
-/* External function defined in trans.c */
+/* External functions defined in trans.c */
 extern void registerFunctions(void);
+extern void registerTuningFunctions(void);
+extern void transposeRange(size_t M, size_t N, double A[N][M], double B[M][N],
+                           double tmp[TMPCOUNT], size_t i0, size_t i1,
+                           size_t j0, size_t j1);
+
+/* External function defined in trans-simd.c */
+extern void registerSimdFunctions(void);
+
+/* External functions defined in trans-par.c */
+extern void registerParallelFunctions(void);
+extern void setTransThreads(int threads);
 
 /** @brief Fills a matrix with data */
 void initMatrix(size_t M, size_t N, double A[N][M], double B[M][N]);
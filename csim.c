@@ -2,81 +2,643 @@
  * @ File Name: csim.c
  * @ Author: Xianwei Zou
  * @ AndrewID: xianweiz
- * @ Version: 1.1.0
+ * @ Version: 1.2.0
  * @ Description: Simulate the behavior of a cache
  */
 
+#define _POSIX_C_SOURCE 200809L /* posix_memalign */
+
 #include "cachelab.h" /* contains printSummary() */
+#include "csim.h"
+#include <fcntl.h>
 #include <getopt.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h> /* contains getopt() */
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CSIM_X86 1
+#endif
+
 #define MACHINEBITS 64
 
+/* number of ways compared by one tag-match vector step */
+#define TAG_LANES 4
+
+/* number of ways covered by one word of the valid / dirty bitmaps */
+#define WORD_WAYS 64
+
+/* end-of-list marker for the LRU recency lists */
+#define LRU_NIL UINT32_MAX
+
+/* read() buffer size when the trace cannot be mapped (pipes, FIFOs) */
+#define READ_CHUNK (1 << 20)
+
+/* largest re-reference prediction value of the 2-bit RRIP policies */
+#define RRPV_MAX 3
+
+/* BRRIP inserts at RRPV_MAX - 1 once every BRRIP_EPSILON fills */
+#define BRRIP_EPSILON 32
+
+/* most geometries one run can simulate */
+#define MAX_CACHES 64
+
+/* trace records decoded before they are handed to the caches */
+#define BATCH_SIZE 4096
+
+/* target size of one lazily allocated page of sets */
+#define SET_PAGE_BYTES (64 * 1024)
+
+/* largest block whose bytes a -W write-combining buffer tracks */
+#define WCBUF_MAX_BLOCK 4096
+
+/* demand accesses a prefetch fill takes to arrive: a miss over a hit */
+#define PREFETCH_LATENCY (MISS_CYCLES / HIT_CYCLES)
+
+/* regions, of 2^STRIDE_REGION bytes, in the stride prefetcher's table */
+#define STRIDE_ENTRIES 64
+#define STRIDE_REGION 12
+
+/* streams the stream prefetcher follows, and how far a miss may jump */
+#define STREAM_ENTRIES 16
+#define STREAM_WINDOW 16
+
+/* prefetch victims remembered to detect pollution */
+#define POLLUTION_ENTRIES 4096
+
+/* groups the -S sampled sets are dealt into */
+#define SAMPLE_GROUPS 32
+
 char traceFile[200]; /* trace file path*/
 int s;               /* s: S=2^s is the set number */
 int E;               /* E: num of lines in each set */
 int b;               /* b: B=2^b is the size of each block in bytes */
 int verbose = 0;
+int num_threads = 1; /* threads the caches or sets are spread across */
+bool shard_sets = false; /* -j splits the sets of one cache */
+bool stack_mode = false; /* -m: report every E up to -E in one pass */
+bool classify = false;   /* -c: split misses into the 3Cs */
+
+/* write policy of every cache, set with -w, -n and -W */
+bool write_through = false;     /* -w through, rather than write-back */
+bool no_write_allocate = false; /* -n: store misses bypass the cache */
+unsigned long write_buffer = 0; /* -W: write-combining buffer entries */
+bool write_opts = false;        /* one of them was given: print traffic */
+
+/* hardware prefetchers, selected with -p */
+typedef enum {
+    PREFETCH_NONE,
+    PREFETCH_NEXT,
+    PREFETCH_STRIDE,
+    PREFETCH_STREAM,
+} prefetch_t;
+
+static const char *const prefetch_names[] = {
+    [PREFETCH_NONE] = "none",
+    [PREFETCH_NEXT] = "next",
+    [PREFETCH_STRIDE] = "stride",
+    [PREFETCH_STREAM] = "stream",
+};
+
+prefetch_t prefetch = PREFETCH_NONE; /* prefetcher of every cache */
+unsigned long prefetch_degree = 0;   /* -P: blocks per prefetch, 0 default */
+
+/* statistical sampling; see simulate_sampled() and window_skip() */
+unsigned long sample_sets = 0;     /* -S: simulate 1 in this many sets */
+unsigned long sample_warm = 0;     /* -T: accesses warming each window */
+unsigned long sample_detail = 0;   /* -T: accesses measured per window */
+unsigned long sample_period = 0;   /* -T: accesses per window, 0 for none */
+unsigned long sample_accesses = 0; /* -T: loads and stores in the trace */
+unsigned long window_pos = 0;      /* -T: position in the current period */
+
+/* replacement policies, selected with -r */
+typedef enum {
+    POLICY_LRU,
+    POLICY_FIFO,
+    POLICY_RANDOM,
+    POLICY_PLRU,
+    POLICY_SRRIP,
+    POLICY_BRRIP,
+    POLICY_LFU,
+} policy_t;
+
+/* returns a bitmask of the ways in tag[0..n) (n <= 64) that equal key */
+typedef uint64_t (*tag_match_fn)(const unsigned long *tag, unsigned long n,
+                                 unsigned long key);
 
-/* structure for a cache line */
+/* one decoded trace record */
 typedef struct {
-    int valid;
-    int dirty;
-    unsigned long tag;
-    int LRU_time_stamp;
-} CacheLine;
+    unsigned long address;
+    unsigned int size; /* bytes accessed */
+    char op;
+} access_t;
+
+/*
+ * a run of consecutive accesses to one block; see find_runs()
+ *
+ * Only the first access can miss: the others find the block just
+ * touched, so they are hits that leave an LRU set as it was, and a store
+ * among them only sets the dirty bit.
+ */
+typedef struct {
+    unsigned long address; /* address of the first access */
+    uint32_t count;        /* accesses in the run */
+    char op;               /* op of the first access, 'L' or 'S' */
+    bool store;            /* a later access in the run is a store */
+} run_t;
+
+/* receives each record the trace readers decode; see feed_trace() */
+typedef void (*record_fn)(void *ctx, char op, unsigned long address,
+                          unsigned int size);
+
+/* where feed_trace() is in a trace, kept in -C checkpoints */
+typedef struct {
+    uint64_t offset;     /* bytes of the trace consumed */
+    trace_coder_t coder; /* binary decoder state after offset */
+    int binary;          /* 1 for a binary trace, 0 for text, -1 unknown */
+} trace_pos_t;
+
+/* how feed_trace() ended */
+typedef enum {
+    TRACE_OK,
+    TRACE_CORRUPT,    /* a binary trace is truncated or corrupt */
+    TRACE_READ_ERROR, /* read() failed */
+    TRACE_LONG_LINE,  /* a text record is longer than READ_CHUNK */
+    TRACE_NO_MEMORY,  /* the read buffer could not be allocated */
+    TRACE_SHORT,      /* the trace ends before the starting offset */
+} trace_status_t;
 
-/* structure for a cache */
+struct Cache;
+
+/* the -c shadow of a cache; see shadow_new() */
+typedef struct shadow shadow_t;
+
+/* the -W write-combining buffer of a cache; see wcbuf_new() */
+typedef struct wcbuf wcbuf_t;
+
+/* the -p prefetcher of a cache; see prefetcher_new() */
+typedef struct prefetcher prefetcher_t;
+
+/* the -S set sample of a cache; see sample_new() */
+typedef struct sample sample_t;
+
+/* simulates n runs on a cache; see select_kernel() */
+typedef void (*kernel_fn)(struct Cache *cache, const run_t *run, int n);
+
+/*
+ * structure for a page of sets
+ *
+ * The sets of a cache are allocated in pages of page_sets consecutive
+ * sets, each page one flat allocation laid out as a structure of arrays.
+ * Set i of a page owns tag[i * stride .. i * stride + E) and the bitmap
+ * words valid[i * words .. (i + 1) * words), and likewise for dirty.
+ * stride is E rounded up to TAG_LANES so the vector tag match never
+ * straddles two sets; the padding ways are never valid.
+ *
+ * LRU order is kept as an intrusive doubly linked list per set, threaded
+ * through lru_prev / lru_next (indexed like tag) from lru_head (most
+ * recently used) to lru_tail (the victim). Touching a line and choosing a
+ * victim are both O(1), and recency is a list position rather than a
+ * counter, so it cannot overflow on long traces. FIFO reuses the same
+ * lists but only reorders them on fills.
+ *
+ * The other policies keep their state in the same allocation: repl_line
+ * holds one counter per line (RRPV for SRRIP/BRRIP, use count for LFU),
+ * indexed like tag, and repl_tree holds the tree-PLRU node bits of each
+ * set, indexed like valid. Arrays a policy does not use are not allocated.
+ *
+ * With -p, pf_mark marks the lines filled by the prefetcher and not
+ * yet used, indexed like valid, and pf_time holds the prefetcher clock
+ * of each line's fill, indexed like tag.
+ */
 typedef struct {
-    int S; /* Set number */
-    int E; /* num of lines in each set */
-    int B; /* block size */
-    CacheLine **set;
+    unsigned long *tag;  /* packed tags, page_sets * stride */
+    uint64_t *valid;     /* valid bitmap, page_sets * words */
+    uint64_t *dirty;     /* dirty bitmap, page_sets * words */
+    uint32_t *lru_prev;  /* next more recently used way, page_sets * stride */
+    uint32_t *lru_next;  /* next less recently used way, page_sets * stride */
+    uint32_t *lru_head;  /* most recently used way, page_sets */
+    uint32_t *lru_tail;  /* least recently used way, page_sets */
+    uint32_t *repl_line; /* per-line policy counter, page_sets * stride */
+    uint64_t *repl_tree; /* tree-PLRU node bits, page_sets * words */
+    uint64_t *pf_mark;   /* unused prefetch bitmap, page_sets * words */
+    uint64_t *pf_time;   /* prefetch fill clock, page_sets * stride */
+} set_page_t;
+
+/*
+ * structure for a cache
+ *
+ * pages is a directory of S / page_sets page pointers, all NULL until the
+ * first access to one of the page's sets allocates it, so the memory a
+ * cache uses follows the sets the trace touches rather than S * E. The
+ * set shards of -j are whole pages, so a page is only ever allocated and
+ * used by one thread.
+ */
+typedef struct Cache {
+    int s;                   /* log2 of the set number */
+    int b;                   /* log2 of the block size */
+    int page_shift;          /* log2 of page_sets */
+    unsigned long S;         /* Set number */
+    unsigned long E;         /* num of lines in each set */
+    unsigned long B;         /* block size */
+    unsigned long stride;    /* tag slots per set (E padded to TAG_LANES) */
+    unsigned long words;     /* bitmap words per set */
+    unsigned long page_sets; /* sets per page */
+    set_page_t **pages;      /* page directory, NULL until touched */
+    tag_match_fn match;      /* tag-match kernel chosen for this CPU */
+    kernel_fn kernel;        /* specialized batch kernel, or NULL */
+    shadow_t *shadow;        /* -c miss classifier, or NULL */
+    bool write_through;      /* stores also go to memory; lines stay clean */
+    bool no_write_allocate;  /* a store miss goes to memory, not the cache */
+    wcbuf_t *wcbuf;          /* -W write-combining buffer, or NULL */
+    prefetcher_t *pf;        /* -p prefetcher, or NULL */
+    sample_t *sample;        /* -S set sample, or NULL */
+    bool verbose;            /* -v: print the outcome of every access */
+    policy_t policy;         /* replacement policy */
+    uint64_t rng_state;      /* xorshift64* state for random and BRRIP */
+    set_page_t *spare;       /* libcsim: stands in for pages not allocated */
+    bool out_of_memory;      /* a page could not be allocated */
+    /* store num of hits, miss, eviction miss, dirty bits and dirty
+     * evictions */
+    csim_stats_t stats;
 } Cache;
 
-Cache *cache = NULL;
+set_page_t *alloc_page(Cache *cache, unsigned long index);
+
+/* the page holding a set, allocated on first touch */
+static inline set_page_t *set_page(Cache *cache, unsigned long set) {
+    unsigned long index = set >> cache->page_shift;
+    set_page_t *page = cache->pages[index];
+    return page != NULL ? page : alloc_page(cache, index);
+}
+
+/* the position of a set within its page */
+static inline unsigned long page_set(const Cache *cache, unsigned long set) {
+    return set & (cache->page_sets - 1);
+}
+
+/* the per-set slices of the page arrays */
+static inline unsigned long *set_tag(Cache *cache, unsigned long set) {
+    return set_page(cache, set)->tag + page_set(cache, set) * cache->stride;
+}
+
+static inline uint64_t *set_valid(Cache *cache, unsigned long set) {
+    return set_page(cache, set)->valid + page_set(cache, set) * cache->words;
+}
+
+static inline uint64_t *set_dirty(Cache *cache, unsigned long set) {
+    return set_page(cache, set)->dirty + page_set(cache, set) * cache->words;
+}
+
+static inline uint32_t *set_repl_line(Cache *cache, unsigned long set) {
+    return set_page(cache, set)->repl_line +
+           page_set(cache, set) * cache->stride;
+}
+
+static inline uint64_t *set_repl_tree(Cache *cache, unsigned long set) {
+    return set_page(cache, set)->repl_tree +
+           page_set(cache, set) * cache->words;
+}
+
+static inline uint64_t *set_pf_mark(Cache *cache, unsigned long set) {
+    return set_page(cache, set)->pf_mark +
+           page_set(cache, set) * cache->words;
+}
+
+static inline uint64_t *set_pf_time(Cache *cache, unsigned long set) {
+    return set_page(cache, set)->pf_time +
+           page_set(cache, set) * cache->stride;
+}
+
+/*
+ * structure for a replacement policy
+ *
+ * hit and fill update the policy state after a hit or after a line is
+ * filled on a miss (NULL if the policy ignores that event), and victim
+ * picks the way to replace. The flags say which per-policy arrays
+ * malloc_cache() has to carve out next to the tags.
+ */
+typedef struct {
+    const char *name;
+    int (*hit)(Cache *cache, int idx, unsigned long set_bits);
+    int (*fill)(Cache *cache, int idx, unsigned long set_bits);
+    int (*victim)(Cache *cache, unsigned long set_bits);
+    bool lists;      /* uses the lru_prev / lru_next recency lists */
+    bool line_state; /* uses one repl_line counter per line */
+    bool tree;       /* uses the repl_tree bitmap per set */
+} replacement_policy_t;
+
+/* geometries requested on the command line, one cache each */
+struct {
+    int s, E, b;
+} geometry[MAX_CACHES];
+int num_caches = 0;
+
+policy_t policy = POLICY_LRU; /* replacement policy for every cache */
+
+/* inclusion policies between the levels of a -L hierarchy */
+typedef enum {
+    INCLUSION_NINE,
+    INCLUSION_INCLUSIVE,
+    INCLUSION_EXCLUSIVE,
+} inclusion_t;
+
+static const char *const inclusion_names[] = {
+    [INCLUSION_NINE] = "nine",
+    [INCLUSION_INCLUSIVE] = "inclusive",
+    [INCLUSION_EXCLUSIVE] = "exclusive",
+};
 
-/* store num of hits, miss, eviction miss, dirty bits and dirty evictions */
-csim_stats_t cache_stats = {0, 0, 0, 0, 0};
+/* levels added below L1 with -L, in order */
+struct {
+    int s, E, b;
+} level_geometry[MAX_CACHES - 1];
+int num_levels = 0;
+bool hierarchy = false; /* caches[] are the levels L1, L2, ... */
+inclusion_t inclusion = INCLUSION_NINE;
+
+Cache *caches[MAX_CACHES];
+
+/* records decoded from the trace but not yet simulated */
+access_t batch[BATCH_SIZE];
+int batch_len = 0;
+
+/*
+ * Interval statistics (-i, -o)
+ *
+ * Every `interval` accesses the batch is flushed and each cache's
+ * counters are compared with the previous snapshot, appending one
+ * csim_interval_t per cache. The hot path never looks at intervals: a
+ * boundary just ends the batch early, and the kernels only write their
+ * counters back at the end of a batch.
+ */
+unsigned long interval = 0;          /* accesses per interval, 0 for none */
+unsigned long interval_accesses = 0; /* accesses in the current interval */
+unsigned long total_accesses = 0;    /* accesses in finished intervals */
+csim_interval_t *intervals[MAX_CACHES];
+size_t num_intervals = 0;
+size_t cap_intervals = 0;
+csim_stats_t last_snapshot[MAX_CACHES];
+const char *stats_file = NULL; /* -o: machine-readable output, - is stdout */
+bool stats_csv = false;        /* -f csv rather than json */
+
+/* checkpoints; see write_checkpoint() */
+const char *checkpoint_file = NULL; /* -C: save the state at the end */
+const char *resume_file = NULL;     /* -R: start from a saved state */
+trace_pos_t trace_pos = {.binary = -1}; /* how far readTrace() has read */
+uint64_t trace_tail = 0;            /* trace_tail_hash() at trace_pos */
 
 int getCli(int argc, char **argv, int *s, int *E, int *b, char *traceFile);
 int readTrace(void);
-int malloc_cache(void);
-int free_cache(void);
-int load_op(unsigned long set_bits, unsigned long tag_bits);
-int store_op(unsigned long set_bits, unsigned long tag_bits);
-int find_max_LRU(unsigned long set_bits);
-int eviction_effect(int idx, unsigned long set_bits);
-int update_bits(int idx, unsigned long set_bits, unsigned long tag_bits);
-int update_time(int idx, unsigned long set_bits);
+int simulate_access(Cache *cache, char op, unsigned long address,
+                    unsigned int size);
+int select_kernel(Cache *cache);
+Cache *malloc_cache(int s, int E, int b, policy_t policy, int shards);
+int free_cache(Cache *cache);
+int queue_access(char op, unsigned long address, unsigned int size);
+int run_batch(void);
+int end_interval(void);
+int write_stats(const csim_stats_t *stats, const char *const *labels);
+int start_workers(void);
+int stop_workers(void);
+long find_line(Cache *cache, unsigned long set_bits, unsigned long tag_bits);
+int load_op(Cache *cache, unsigned long set_bits, unsigned long tag_bits);
+int store_op(Cache *cache, unsigned long set_bits, unsigned long tag_bits);
+int find_LRU(Cache *cache, unsigned long set_bits);
+int eviction_effect(Cache *cache, int idx, unsigned long set_bits);
+bool write_back(Cache *cache, int idx, unsigned long set_bits);
+int update_bits(Cache *cache, int idx, unsigned long set_bits,
+                unsigned long tag_bits);
+int update_LRU(Cache *cache, int idx, unsigned long set_bits);
+int find_invalid(Cache *cache, unsigned long set_bits);
+int random_victim(Cache *cache, unsigned long set_bits);
+int plru_touch(Cache *cache, int idx, unsigned long set_bits);
+int plru_victim(Cache *cache, unsigned long set_bits);
+int rrip_hit(Cache *cache, int idx, unsigned long set_bits);
+int srrip_fill(Cache *cache, int idx, unsigned long set_bits);
+int brrip_fill(Cache *cache, int idx, unsigned long set_bits);
+int rrip_victim(Cache *cache, unsigned long set_bits);
+int lfu_hit(Cache *cache, int idx, unsigned long set_bits);
+int lfu_fill(Cache *cache, int idx, unsigned long set_bits);
+int lfu_victim(Cache *cache, unsigned long set_bits);
+shadow_t *shadow_new(const Cache *cache);
+int shadow_free(shadow_t *shadow);
+int shadow_print(const shadow_t *shadow, const char *label);
+int shadow_access(shadow_t *shadow, bool missed, unsigned long address);
+wcbuf_t *wcbuf_new(const Cache *cache, unsigned long entries);
+int wcbuf_free(wcbuf_t *wcbuf);
+int write_memory(Cache *cache, unsigned long address, unsigned int size);
+int fill_traffic(Cache *cache, unsigned long block);
+int wcbuf_drain(Cache *cache);
+prefetcher_t *prefetcher_new(prefetch_t kind, unsigned long degree);
+int prefetcher_free(prefetcher_t *prefetcher);
+bool prefetch_hit(Cache *cache, int idx, unsigned long set_bits);
+int prefetch_train(Cache *cache, unsigned long address, bool missed,
+                   bool first_use);
+sample_t *sample_new(const Cache *cache, unsigned long n);
+int sample_free(sample_t *sample);
+int simulate_sampled(Cache *cache, const access_t *acc, int n,
+                     access_t *scratch, run_t *run);
+bool window_skip(char op);
+int window_close(void);
+unsigned long extrapolate(int c, double ci[3]);
+uint64_t trace_tail_hash(int fd, const trace_pos_t *pos);
+int write_checkpoint(const char *path);
+int read_checkpoint(const char *path);
+int hierarchy_access(char op, unsigned long address);
+int stack_init(int s, int b, int emax);
+int stack_access(char op, unsigned long address);
+int stack_report(void);
 int print_help(void);
 
+/* the policies, indexed by policy_t */
+static const replacement_policy_t policies[] = {
+    [POLICY_LRU] = {"lru", update_LRU, update_LRU, find_LRU, true, false,
+                    false},
+    [POLICY_FIFO] = {"fifo", NULL, update_LRU, find_LRU, true, false, false},
+    [POLICY_RANDOM] = {"random", NULL, NULL, random_victim, false, false,
+                       false},
+    [POLICY_PLRU] = {"plru", plru_touch, plru_touch, plru_victim, false,
+                     false, true},
+    [POLICY_SRRIP] = {"srrip", rrip_hit, srrip_fill, rrip_victim, false, true,
+                      false},
+    [POLICY_BRRIP] = {"brrip", rrip_hit, brrip_fill, rrip_victim, false, true,
+                      false},
+    [POLICY_LFU] = {"lfu", lfu_hit, lfu_fill, lfu_victim, false, true, false},
+};
+
+#define NUM_POLICIES (sizeof(policies) / sizeof(policies[0]))
+
+/*
+ * The policy hooks called from load_op / store_op. LRU is tested first
+ * and called directly, so the default policy never goes through a
+ * function pointer.
+ */
+static inline void policy_hit(Cache *cache, int idx, unsigned long set_bits) {
+    if (cache->policy == POLICY_LRU) {
+        update_LRU(cache, idx, set_bits);
+    } else if (policies[cache->policy].hit != NULL) {
+        policies[cache->policy].hit(cache, idx, set_bits);
+    }
+}
+
+static inline void policy_fill(Cache *cache, int idx, unsigned long set_bits) {
+    if (cache->policy == POLICY_LRU) {
+        update_LRU(cache, idx, set_bits);
+    } else if (policies[cache->policy].fill != NULL) {
+        policies[cache->policy].fill(cache, idx, set_bits);
+    }
+}
+
+static inline int find_victim(Cache *cache, unsigned long set_bits) {
+    if (cache->policy == POLICY_LRU) {
+        return find_LRU(cache, set_bits);
+    }
+    return policies[cache->policy].victim(cache, set_bits);
+}
+
+#ifndef CSIM_LIB
 int main(int argc, char **argv) {
+    int i;
+
     /* set the parameter s E b t from the command line input */
     getCli(argc, argv, &s, &E, &b, traceFile);
 
-    /* initialize the cache */
-    malloc_cache();
+    /* -m replaces the caches with one stack-distance pass */
+    if (stack_mode) {
+        stack_init(s, b, E);
+        readTrace();
+        run_batch();
+        stack_report();
+        return 0;
+    }
 
-    /* read the trace file from traceFile */
-    readTrace();
+    /* initialize one cache per geometry */
+    for (i = 0; i < num_caches; i++) {
+        caches[i] = malloc_cache(geometry[i].s, geometry[i].E, geometry[i].b,
+                                 policy, num_threads);
+        if (caches[i] == NULL) {
+            printf("failed to allocate the cache\n");
+            exit(1);
+        }
+        caches[i]->verbose = verbose;
+        if (classify) {
+            caches[i]->shadow = shadow_new(caches[i]);
+        }
+        caches[i]->write_through = write_through;
+        caches[i]->no_write_allocate = no_write_allocate;
+        if (write_buffer != 0) {
+            caches[i]->wcbuf = wcbuf_new(caches[i], write_buffer);
+        }
+        if (prefetch != PREFETCH_NONE) {
+            caches[i]->pf = prefetcher_new(prefetch, prefetch_degree);
+        }
+        if (sample_sets != 0) {
+            caches[i]->sample = sample_new(caches[i], sample_sets);
+        }
+        select_kernel(caches[i]);
+    }
 
-    /* calculate the dirty bytes in cache in the end */
-    cache_stats.dirty_bytes = (unsigned long)cache->B * cache_stats.dirty_bytes;
-    /* dirty bytes evicted in the process */
-    cache_stats.dirty_evictions =
-        (unsigned long)cache->B * cache_stats.dirty_evictions;
+    /* carry on from where an earlier run stopped */
+    if (resume_file != NULL) {
+        read_checkpoint(resume_file);
+    }
+
+    /* read the trace file from traceFile, feeding every cache */
+    start_workers();
+    readTrace();
+    run_batch();
+    for (i = 0; i < num_caches; i++) {
+        wcbuf_drain(caches[i]);
+    }
+    end_interval();
+    stop_workers();
+    if (checkpoint_file != NULL) {
+        write_checkpoint(checkpoint_file);
+    }
 
-    /* free the cache */
-    free_cache();
+    csim_stats_t stats[MAX_CACHES];
+    char label_buf[MAX_CACHES][64];
+    const char *labels[MAX_CACHES];
+    double ci[MAX_CACHES][3];
+    unsigned long samples[MAX_CACHES];
+    for (i = 0; i < num_caches; i++) {
+        Cache *cache = caches[i];
+        /* scale what -S or -T simulated up to the whole trace */
+        if (sample_sets != 0 || sample_period != 0) {
+            samples[i] = extrapolate(i, ci[i]);
+        }
+        /* calculate the dirty bytes in cache in the end */
+        cache->stats.dirty_bytes = cache->B * cache->stats.dirty_bytes;
+        /* dirty bytes evicted in the process */
+        cache->stats.dirty_evictions = cache->B * cache->stats.dirty_evictions;
+        stats[i] = cache->stats;
+        if (hierarchy) {
+            snprintf(label_buf[i], sizeof(label_buf[i]), "L%d s:%d E:%d b:%d",
+                     i + 1, geometry[i].s, geometry[i].E, geometry[i].b);
+        } else {
+            snprintf(label_buf[i], sizeof(label_buf[i]), "s:%d E:%d b:%d",
+                     geometry[i].s, geometry[i].E, geometry[i].b);
+        }
+        labels[i] = label_buf[i];
+    }
 
     /* print summary about hit miss eviction */
-    printSummary(&cache_stats);
+    if (num_caches == 1) {
+        printSummary(&stats[0]);
+    } else {
+        printSummaries(stats, labels, (size_t)num_caches);
+    }
+    if (stats_file != NULL) {
+        write_stats(stats, labels);
+    }
+    /* the memory traffic of each write policy */
+    for (i = 0; write_opts && i < num_caches; i++) {
+        printf("%s%smemory_bytes_read:%lu memory_bytes_written:%lu\n",
+               num_caches == 1 ? "" : labels[i], num_caches == 1 ? "" : " ",
+               stats[i].mem_read_bytes, stats[i].mem_write_bytes);
+    }
+    /* how far the sampled estimates can be trusted */
+    for (i = 0; (sample_sets != 0 || sample_period != 0) && i < num_caches;
+         i++) {
+        printf("%s%s", num_caches == 1 ? "" : labels[i],
+               num_caches == 1 ? "" : " ");
+        if (samples[i] < 2) {
+            printf("one sample, no confidence interval\n");
+            continue;
+        }
+        printf("95%% confidence from %lu samples: hits:+-%.0f "
+               "misses:+-%.0f evictions:+-%.0f\n",
+               samples[i], ci[i][0], ci[i][1], ci[i][2]);
+    }
+    /* and what the prefetchers did */
+    for (i = 0; prefetch != PREFETCH_NONE && i < num_caches; i++) {
+        printf("%s%sprefetch_issued:%lu prefetch_useful:%lu "
+               "prefetch_late:%lu prefetch_polluting:%lu "
+               "prefetch_evictions:%lu\n",
+               num_caches == 1 ? "" : labels[i], num_caches == 1 ? "" : " ",
+               stats[i].pf_issued, stats[i].pf_useful, stats[i].pf_late,
+               stats[i].pf_polluting, stats[i].pf_evictions);
+    }
+
+    for (i = 0; i < num_caches; i++) {
+        /* and how the misses split up */
+        if (caches[i]->shadow != NULL) {
+            shadow_print(caches[i]->shadow, num_caches == 1 ? NULL : labels[i]);
+        }
+        /* free the cache */
+        free_cache(caches[i]);
+    }
     return 0;
 }
+#endif /* CSIM_LIB */
 
 /**
  * Description:
@@ -87,16 +649,66 @@ int main(int argc, char **argv) {
  */
 int getCli(int argc, char **argv, int *s, int *E, int *b, char *traceFile) {
     int opt;
-    while (-1 != (opt = getopt(argc, argv, "vs:E:b:t:"))) {
+    unsigned long i;
+    bool single = false; /* -s, -E or -b given */
+    const char *optstring = "hvmcns:E:b:t:r:G:j:L:I:i:o:f:w:W:p:P:S:T:C:R:";
+    while (-1 != (opt = getopt(argc, argv, optstring))) {
         switch (opt) {
         case 's':
             *s = atoi(optarg); /* convert s from string to int */
+            single = true;
             break;
         case 'E':
             *E = atoi(optarg); /* convert E from string to int */
+            single = true;
             break;
         case 'b':
             *b = atoi(optarg); /* convert b from string to int */
+            single = true;
+            break;
+        case 'G':
+            if (num_caches == MAX_CACHES) {
+                printf("at most %d geometries\n", MAX_CACHES);
+                exit(1);
+            }
+            if (sscanf(optarg, "%d,%d,%d", &geometry[num_caches].s,
+                       &geometry[num_caches].E,
+                       &geometry[num_caches].b) != 3) {
+                printf("geometry must be s,E,b, not \"%s\"\n", optarg);
+                exit(1);
+            }
+            num_caches++;
+            break;
+        case 'L':
+            if (num_levels == MAX_CACHES - 1) {
+                printf("at most %d levels\n", MAX_CACHES);
+                exit(1);
+            }
+            if (sscanf(optarg, "%d,%d,%d", &level_geometry[num_levels].s,
+                       &level_geometry[num_levels].E,
+                       &level_geometry[num_levels].b) != 3) {
+                printf("level must be s,E,b, not \"%s\"\n", optarg);
+                exit(1);
+            }
+            num_levels++;
+            break;
+        case 'I':
+            for (i = 0; i <= INCLUSION_EXCLUSIVE; i++) {
+                if (strcmp(optarg, inclusion_names[i]) == 0) {
+                    inclusion = (inclusion_t)i;
+                    break;
+                }
+            }
+            if (i > INCLUSION_EXCLUSIVE) {
+                printf("unknown inclusion policy \"%s\"\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'j':
+            num_threads = atoi(optarg);
+            if (num_threads < 1) {
+                num_threads = 1;
+            }
             break;
         case 't':
             strcpy(traceFile, optarg); /* copy the trace file path to t */
@@ -104,274 +716,3537 @@ int getCli(int argc, char **argv, int *s, int *E, int *b, char *traceFile) {
         case 'v':
             verbose = 1;
             break;
+        case 'm':
+            stack_mode = true;
+            break;
+        case 'c':
+            classify = true;
+            break;
+        case 'w':
+            if (strcmp(optarg, "through") == 0) {
+                write_through = true;
+            } else if (strcmp(optarg, "back") == 0) {
+                write_through = false;
+            } else {
+                printf("write policy must be back or through, not \"%s\"\n",
+                       optarg);
+                exit(1);
+            }
+            write_opts = true;
+            break;
+        case 'n':
+            no_write_allocate = true;
+            write_opts = true;
+            break;
+        case 'W':
+            write_buffer = strtoul(optarg, NULL, 0);
+            write_opts = true;
+            break;
+        case 'p':
+            for (i = 0; i <= PREFETCH_STREAM; i++) {
+                if (strcmp(optarg, prefetch_names[i]) == 0) {
+                    prefetch = (prefetch_t)i;
+                    break;
+                }
+            }
+            if (i > PREFETCH_STREAM) {
+                printf("unknown prefetcher \"%s\"\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'P':
+            prefetch_degree = strtoul(optarg, NULL, 0);
+            break;
+        case 'S':
+            sample_sets = strtoul(optarg, NULL, 0);
+            break;
+        case 'T':
+            if (sscanf(optarg, "%lu,%lu,%lu", &sample_warm, &sample_detail,
+                       &sample_period) != 3 ||
+                sample_detail == 0 ||
+                sample_warm + sample_detail > sample_period) {
+                printf("-T must be warm,detail,period with detail > 0 and "
+                       "warm + detail <= period, not \"%s\"\n",
+                       optarg);
+                exit(1);
+            }
+            break;
+        case 'C':
+            checkpoint_file = optarg;
+            break;
+        case 'R':
+            resume_file = optarg;
+            break;
+        case 'i':
+            interval = strtoul(optarg, NULL, 0);
+            break;
+        case 'o':
+            stats_file = optarg;
+            break;
+        case 'f':
+            if (strcmp(optarg, "csv") == 0) {
+                stats_csv = true;
+            } else if (strcmp(optarg, "json") == 0) {
+                stats_csv = false;
+            } else {
+                printf("output format must be json or csv, not \"%s\"\n",
+                       optarg);
+                exit(1);
+            }
+            break;
+        case 'r':
+            for (i = 0; i < NUM_POLICIES; i++) {
+                if (strcmp(optarg, policies[i].name) == 0) {
+                    policy = (policy_t)i;
+                    break;
+                }
+            }
+            if (i == NUM_POLICIES) {
+                printf("unknown replacement policy \"%s\"\n", optarg);
+                exit(1);
+            }
+            break;
         case 'h':
             print_help();
-            break;
+            exit(0);
         default:
             printf("wrong argument\n");
             break;
         }
     }
-    return 0;
-}
 
-/**
- * Description:
- *     Initialize parameter S, E, B for the cache,
- *     and use malloc to create space for cache and each cache line.
- */
-int malloc_cache(void) {
-    cache = (Cache *)malloc(sizeof(Cache));
-    if (s == 0) {
-        cache->S = 1;
-    } else {
-        cache->S = (1 << s); /* S = 2^s */
+    /* -s/-E/-b describe one more geometry, and are the default one */
+    if (single || num_caches == 0) {
+        if (num_caches == MAX_CACHES) {
+            printf("at most %d geometries\n", MAX_CACHES);
+            exit(1);
+        }
+        geometry[num_caches].s = *s;
+        geometry[num_caches].E = *E;
+        geometry[num_caches].b = *b;
+        num_caches++;
     }
-    cache->E = E;
-    if (b == 0) {
-        cache->B = 1;
-    } else {
-        cache->B = (1 << b); /* B = 2^b */
+    /* -L turns the one geometry into L1 and stacks the levels below it */
+    if (num_levels > 0) {
+        if (num_caches != 1 || stack_mode) {
+            printf("-L cannot be combined with -G or -m\n");
+            exit(1);
+        }
+        for (i = 0; i < (unsigned long)num_levels; i++) {
+            if (level_geometry[i].b != geometry[0].b) {
+                printf("every level must use the same block size\n");
+                exit(1);
+            }
+            geometry[num_caches].s = level_geometry[i].s;
+            geometry[num_caches].E = level_geometry[i].E;
+            geometry[num_caches].b = level_geometry[i].b;
+            num_caches++;
+        }
+        hierarchy = true;
+        num_threads = 1;
     }
-    cache->set =
-        (CacheLine **)malloc(sizeof(CacheLine *) * (unsigned long)(cache->S));
-
-    int i, j;
-    for (i = 0; i < (cache->S); i++) {
-        cache->set[i] =
-            (CacheLine *)malloc(sizeof(CacheLine) * (unsigned long)(cache->E));
-        for (j = 0; j < (cache->E); j++) {
-            cache->set[i][j].valid = 0;
-            cache->set[i][j].dirty = 0;
-            cache->set[i][j].tag = 0;
-            cache->set[i][j].LRU_time_stamp = 0;
+    for (i = 0; i < (unsigned long)num_caches; i++) {
+        if (geometry[i].s < 0 || geometry[i].b < 0 || geometry[i].E < 1 ||
+            geometry[i].s + geometry[i].b >= MACHINEBITS) {
+            printf("invalid geometry s=%d E=%d b=%d\n", geometry[i].s,
+                   geometry[i].E, geometry[i].b);
+            exit(1);
+        }
+        if ((unsigned long)geometry[i].E >= LRU_NIL) {
+            printf("E must be less than %lu\n", (unsigned long)LRU_NIL);
+            exit(1);
+        }
+        if (policies[policy].tree &&
+            (geometry[i].E & (geometry[i].E - 1)) != 0) {
+            printf("the %s policy needs E to be a power of two\n",
+                   policies[policy].name);
+            exit(1);
         }
     }
-    return 0;
-}
-
-/**
- * Description:
- *     Read and execute each line of instruction from the trace file,
- *     and update bits in cache.
- */
-int readTrace(void) {
-    FILE *pFile;
-    char opIdentifier;
-    unsigned long address; /* unsigned long: 8 bytes */
-    int size;
-
-    pFile = fopen(traceFile, "r");
-    if (pFile == NULL) {
-        printf("\"%s\" does not exit in the directory\n", traceFile);
+    if (stack_mode && (interval != 0 || stats_file != NULL)) {
+        printf("-i and -o cannot be combined with -m\n");
         exit(1);
     }
-
-    while (fscanf(pFile, " %c %lx,%d", &opIdentifier, &address, &size) > 0) {
-        /* get tag field length */
-        int t = MACHINEBITS - s - b;
-        /* get opcode set bits and tag bytes */
-        unsigned long tag_bits = address >> (b + s);
-        unsigned long set_bits;
-        if (s == 0) {
-            set_bits = 0;
-        } else {
-            set_bits = ((address << t) >> (t + b));
-        }
-        /* For Load operation */
-        if (opIdentifier == 'L') {
-            load_op(set_bits, tag_bits);
+    if (classify && (stack_mode || hierarchy)) {
+        printf("-c cannot be combined with -m or -L\n");
+        exit(1);
+    }
+    if (write_opts && (stack_mode || hierarchy)) {
+        printf("-w, -n and -W cannot be combined with -m or -L\n");
+        exit(1);
+    }
+    if (write_buffer != 0) {
+        if (!write_through && !no_write_allocate) {
+            printf("-W needs -w through or -n\n");
+            exit(1);
         }
-        /* For Store operation */
-        if (opIdentifier == 'S') {
-            store_op(set_bits, tag_bits);
+        for (i = 0; i < (unsigned long)num_caches; i++) {
+            if (1UL << geometry[i].b > WCBUF_MAX_BLOCK) {
+                printf("-W needs blocks of at most %d bytes\n",
+                       WCBUF_MAX_BLOCK);
+                exit(1);
+            }
         }
     }
-
-    fclose(pFile);
-    return 0;
-}
-
-/**
- * @brief Operations to cache when the opcode is Load.
- * @param set_bits set bits in the memory address
- * @param tag_bits tag bits of the memory address
- */
-int load_op(unsigned long set_bits, unsigned long tag_bits) {
-    /* set selection and line match*/
-    int i;
-    bool hit_flag = false;
-    for (i = 0; i < cache->E; i++) {
-        /* Hit: when the set bits and the valid bits both match */
-        if ((cache->set[set_bits][i].tag == tag_bits) &&
-            (cache->set[set_bits][i].valid == 1)) {
-            /* count this hit */
-            cache_stats.hits++;
-            if (verbose)
-                printf("Hit\n");
-            /* update time, valid bit and tag bit */
-            update_time(i, set_bits);
-            hit_flag = true;
-        }
+    if (prefetch != PREFETCH_NONE && (stack_mode || hierarchy)) {
+        printf("-p cannot be combined with -m or -L\n");
+        exit(1);
     }
-
-    /* Miss: when hits nothing in the cache */
-    if (hit_flag == false) {
-        /* count the miss */
-        cache_stats.misses++;
-        if (verbose)
-            printf("Miss\n");
-        /* find the cache line has the least LRU number */
-        int max_idx = find_max_LRU(set_bits);
-
-        /* Eviction miss when the cache set is full,
-         * which means the line has the max LRU has valid bit = 1
-         */
-        eviction_effect(max_idx, set_bits);
-
-        /* update time, valid bit and tag bit */
-        update_bits(max_idx, set_bits, tag_bits);
-        update_time(max_idx, set_bits);
+    if (sample_sets == 1) {
+        sample_sets = 0;
     }
-    return 0;
-}
-
-/**
- * @brief Operations to cache when the opcode is Store.
- * @param set_bits set bits in the memory address
- * @param tag_bits tag bits of the memory address
- */
-int store_op(unsigned long set_bits, unsigned long tag_bits) {
-    /* set selection and line match*/
-    int i;
-    bool hit_flag = false;
-    for (i = 0; i < cache->E; i++) {
-        /* Hit: when the set bits and the valid bits both match */
-        if ((cache->set[set_bits][i].tag == tag_bits) &&
-            (cache->set[set_bits][i].valid == 1)) {
-            /* count this hit */
-            cache_stats.hits++;
-            if (verbose)
-                printf("Hit\n");
-            /* update time, valid bit and tag bit */
-            update_time(i, set_bits);
-            /* set the dirty bit */
-            if (cache->set[set_bits][i].dirty == 0) {
-                cache->set[set_bits][i].dirty = 1;
-                cache_stats.dirty_bytes++;
+    if ((sample_sets != 0 || sample_period != 0) &&
+        (stack_mode || hierarchy || classify || interval != 0)) {
+        printf("-S and -T cannot be combined with -m, -L, -c or -i\n");
+        exit(1);
+    }
+    if (sample_sets != 0) {
+        if (sample_period != 0 || prefetch != PREFETCH_NONE ||
+            write_buffer != 0) {
+            printf("-S cannot be combined with -T, -p or -W\n");
+            exit(1);
+        }
+        if ((sample_sets & (sample_sets - 1)) != 0) {
+            printf("-S must be a power of two\n");
+            exit(1);
+        }
+        for (i = 0; i < (unsigned long)num_caches; i++) {
+            if (sample_sets > 1UL << geometry[i].s >> 1) {
+                printf("-S %lu leaves fewer than two of the %lu sets\n",
+                       sample_sets, 1UL << geometry[i].s);
+                exit(1);
             }
-            hit_flag = true;
         }
     }
-
-    /* Miss: when hits nothing in the cache */
-    if (hit_flag == false) {
-        /* count the miss */
-        cache_stats.misses++;
-        if (verbose)
-            printf("Miss\n");
-
-        /* find the cache line has the least LRU number */
-        int max_idx = find_max_LRU(set_bits);
-
-        /* Eviction miss when the cache set is full,
-         * which means the line has the max LRU has valid bit = 1
-         */
-        eviction_effect(max_idx, set_bits);
-
-        /* update time, valid bit and tag bit */
-        update_bits(max_idx, set_bits, tag_bits);
-        update_time(max_idx, set_bits);
-
-        /* set the dirty bits after write */
-        cache->set[set_bits][max_idx].dirty = 1;
-        cache_stats.dirty_bytes++;
+    if ((checkpoint_file != NULL || resume_file != NULL) &&
+        (stack_mode || hierarchy || classify || prefetch != PREFETCH_NONE ||
+         write_buffer != 0 || sample_sets != 0 || sample_period != 0)) {
+        printf("-C and -R cannot be combined with -m, -L, -c, -p, -W, -S "
+               "or -T\n");
+        exit(1);
     }
-    return 0;
-}
-
-/**
- * @brief Change bits and count dirty bytes after determing if
- *      eviction miss happens
- * @param idx index of the set
- * @param set_bits set bits in the memory address
- */
-int eviction_effect(int idx, unsigned long set_bits) {
-    /* if eviction happens */
-    if (cache->set[set_bits][idx].valid == 1) {
-        cache_stats.evictions++;
-        if (verbose)
-            printf("Evictions\n\n");
-        if (cache->set[set_bits][idx].dirty == 1) {
-            cache_stats.dirty_evictions++;
-            cache->set[set_bits][idx].dirty = 0;
-            cache_stats.dirty_bytes--;
+    if (prefetch_degree != 0 && prefetch == PREFETCH_NONE) {
+        printf("-P needs -p\n");
+        exit(1);
+    }
+    if (prefetch_degree == 0) {
+        prefetch_degree = prefetch == PREFETCH_STREAM ? 4 : 1;
+    }
+    if (stack_mode && (num_caches != 1 || policy != POLICY_LRU)) {
+        printf("-m needs one geometry and the lru policy\n");
+        exit(1);
+    }
+    /* with one cache, -j splits its sets between the threads instead;
+     * random and BRRIP draw on one random sequence for all sets, -v
+     * prints in trace order and the -c shadow, -W buffer, -p
+     * prefetchers and -S group counts span all sets, so those stay
+     * serial */
+    shard_sets = num_caches == 1 && num_threads > 1 && !stack_mode &&
+                 !hierarchy && !verbose && !classify && write_buffer == 0 &&
+                 prefetch == PREFETCH_NONE && sample_sets == 0 &&
+                 policy != POLICY_RANDOM && policy != POLICY_BRRIP;
+    if (num_threads > MAX_CACHES) {
+        num_threads = MAX_CACHES;
+    }
+    if (stack_mode) {
+        num_threads = 1;
+    } else if (shard_sets) {
+        if ((unsigned long)num_threads > 1UL << geometry[0].s) {
+            num_threads = (int)(1UL << geometry[0].s);
         }
+        shard_sets = num_threads > 1;
+    } else if (num_threads > num_caches) {
+        num_threads = num_caches;
     }
     return 0;
 }
 
 /**
- * @brief After each hit or miss,
- *      update the time in LRU time stamp.
- * @param idx index of the set
- * @param set_bits set bits in the memory address
+ * @brief Portable tag match, one way per step.
  */
-int update_time(int idx, unsigned long set_bits) {
-    int i;
-    for (i = 0; i < cache->E; i++) {
-        /* increase all time */
-        cache->set[set_bits][i].LRU_time_stamp++;
+static uint64_t match_scalar(const unsigned long *tag, unsigned long n,
+                             unsigned long key) {
+    uint64_t mask = 0;
+    unsigned long i;
+    for (i = 0; i < n; i++) {
+        mask |= (uint64_t)(tag[i] == key) << i;
     }
-    /* only set the most recent hit time to 0 */
-    cache->set[set_bits][idx].LRU_time_stamp = 0;
-    return 0;
+    return mask;
 }
 
+#ifdef CSIM_X86
 /**
- * @brief Update the bits in each cache line after miss
+ * @brief SSE2 tag match, two ways per compare.
  *
- * @param idx index of the set
- * @param set_bits set bits in the memory address
- * @param tag_bits tag bits in the memory address
+ * SSE2 has no 64-bit equality, so compare the 32-bit halves and AND each
+ * half with its swapped neighbour. n must be a multiple of TAG_LANES.
  */
-int update_bits(int idx, unsigned long set_bits, unsigned long tag_bits) {
-    cache->set[set_bits][idx].valid = 1;
-    cache->set[set_bits][idx].tag = tag_bits;
-    return 0;
+static uint64_t match_sse2(const unsigned long *tag, unsigned long n,
+                           unsigned long key) {
+    __m128i k = _mm_set1_epi64x((long long)key);
+    uint64_t mask = 0;
+    unsigned long i;
+    for (i = 0; i < n; i += 4) {
+        __m128i e0 = _mm_cmpeq_epi32(
+            _mm_loadu_si128((const __m128i *)(tag + i)), k);
+        __m128i e1 = _mm_cmpeq_epi32(
+            _mm_loadu_si128((const __m128i *)(tag + i + 2)), k);
+        e0 = _mm_and_si128(e0, _mm_shuffle_epi32(e0, 0xb1));
+        e1 = _mm_and_si128(e1, _mm_shuffle_epi32(e1, 0xb1));
+        unsigned bits = (unsigned)_mm_movemask_pd(_mm_castsi128_pd(e0)) |
+                        (unsigned)_mm_movemask_pd(_mm_castsi128_pd(e1)) << 2;
+        mask |= (uint64_t)bits << i;
+    }
+    return mask;
 }
 
 /**
- * @brief Given the set number, return the setline index of the line,
- * that has the minimum LRU value.
+ * @brief AVX2 tag match, four ways per compare, eight per iteration.
  *
- * @param set_bits set bits in the memory address
+ * n must be a multiple of TAG_LANES.
  */
-int find_max_LRU(unsigned long set_bits) {
-    int i;
-    int max_LRU = 0;
-    int max_idx = 0;
-    for (i = 0; i < cache->E; i++) {
-        if (cache->set[set_bits][i].LRU_time_stamp > max_LRU) {
-            max_idx = i;
-            max_LRU = cache->set[set_bits][i].LRU_time_stamp;
-        }
+__attribute__((target("avx2"))) static uint64_t
+match_avx2(const unsigned long *tag, unsigned long n, unsigned long key) {
+    __m256i k = _mm256_set1_epi64x((long long)key);
+    uint64_t mask = 0;
+    unsigned long i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i e0 = _mm256_cmpeq_epi64(
+            _mm256_loadu_si256((const __m256i *)(tag + i)), k);
+        __m256i e1 = _mm256_cmpeq_epi64(
+            _mm256_loadu_si256((const __m256i *)(tag + i + 4)), k);
+        unsigned bits =
+            (unsigned)_mm256_movemask_pd(_mm256_castsi256_pd(e0)) |
+            (unsigned)_mm256_movemask_pd(_mm256_castsi256_pd(e1)) << 4;
+        mask |= (uint64_t)bits << i;
+    }
+    if (i < n) {
+        __m256i e0 = _mm256_cmpeq_epi64(
+            _mm256_loadu_si256((const __m256i *)(tag + i)), k);
+        unsigned bits = (unsigned)_mm256_movemask_pd(_mm256_castsi256_pd(e0));
+        mask |= (uint64_t)bits << i;
     }
-    return max_idx;
+    return mask;
 }
+#endif
 
 /**
  * Description:
- *     free cache line, cache set and cache space.
- *     created by malloc in malloc_cache() function
+ *     Initialize parameter S, E, B for a cache and its empty page
+ *     directory. The sets themselves are allocated by alloc_page() the
+ *     first time they are touched. The geometry and policy must already
+ *     be valid; see getCli() and csim_create().
+ * @param policy replacement policy of the cache
+ * @param shards pages to keep at least, for the -j set shards
+ * @return the new cache, or NULL if it could not be allocated
  */
-int free_cache(void) {
+Cache *malloc_cache(int s, int E, int b, policy_t policy, int shards) {
+    Cache *cache = (Cache *)calloc(1, sizeof(Cache));
+    if (cache == NULL) {
+        return NULL;
+    }
+    cache->s = s;
+    cache->b = b;
+    cache->policy = policy;
+    cache->rng_state = 0x9e3779b97f4a7c15ULL;
+    cache->S = 1UL << s; /* S = 2^s */
+    cache->E = (unsigned long)E;
+    cache->B = 1UL << b; /* B = 2^b */
+    cache->words = (cache->E + WORD_WAYS - 1) / WORD_WAYS;
+    if (cache->E < TAG_LANES) {
+        cache->stride = cache->E;
+    } else {
+        cache->stride = (cache->E + TAG_LANES - 1) / TAG_LANES * TAG_LANES;
+    }
+
+    /* as many sets per page as fit in SET_PAGE_BYTES, a power of two;
+     * set_size counts every array, whether or not the policy uses it */
+    size_t set_size =
+        cache->stride * (sizeof(unsigned long) + sizeof(uint64_t) +
+                         3 * sizeof(uint32_t)) +
+        4 * cache->words * sizeof(uint64_t) + 2 * sizeof(uint32_t);
+    /* but keep a page for each -j set shard */
+    while (cache->page_shift < s &&
+           (set_size << (cache->page_shift + 1)) <= SET_PAGE_BYTES &&
+           cache->S >> (cache->page_shift + 1) >= (unsigned long)shards) {
+        cache->page_shift++;
+    }
+    cache->page_sets = 1UL << cache->page_shift;
+    cache->pages = (set_page_t **)calloc(cache->S >> cache->page_shift,
+                                         sizeof(set_page_t *));
+    if (cache->pages == NULL) {
+        free(cache);
+        return NULL;
+    }
+
+    /* pick the widest tag-match kernel the CPU supports */
+    cache->match = match_scalar;
+#ifdef CSIM_X86
+    if (cache->E >= TAG_LANES) {
+        cache->match = match_sse2;
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            cache->match = match_avx2;
+        }
+    }
+#endif
+    select_kernel(cache);
+    return cache;
+}
+
+/**
+ * @brief The bytes of the arrays of one page, which follow its header.
+ */
+static size_t page_data_size(const Cache *cache) {
+    unsigned long sets = cache->page_sets;
+    size_t lines = sets * cache->stride;
+    size_t bitmap_size = sets * cache->words * sizeof(uint64_t);
+    const replacement_policy_t *repl = &policies[cache->policy];
+    size_t size = lines * sizeof(unsigned long) + 2 * bitmap_size;
+    if (repl->lists) {
+        size += 2 * lines * sizeof(uint32_t) + 2 * sets * sizeof(uint32_t);
+    }
+    if (repl->line_state) {
+        size += lines * sizeof(uint32_t);
+    }
+    if (repl->tree) {
+        size += bitmap_size;
+    }
+    if (cache->pf != NULL) {
+        size += bitmap_size + lines * sizeof(uint64_t);
+    }
+    return size;
+}
+
+/**
+ * @brief Carve the tag array, bitmaps and policy state of one page of
+ *        sets out of one zeroed allocation.
+ * @return the page, or NULL if it could not be allocated
+ */
+static set_page_t *new_page(const Cache *cache) {
+    unsigned long sets = cache->page_sets;
+    size_t lines = sets * cache->stride;
+    size_t tag_size = lines * sizeof(unsigned long);
+    size_t bitmap_size = sets * cache->words * sizeof(uint64_t);
+    const replacement_policy_t *repl = &policies[cache->policy];
+    size_t link_size = repl->lists ? lines * sizeof(uint32_t) : 0;
+    size_t end_size = repl->lists ? sets * sizeof(uint32_t) : 0;
+    size_t tree_size = repl->tree ? bitmap_size : 0;
+    bool pf = cache->pf != NULL;
+    size_t mark_size = pf ? bitmap_size : 0;
+    size_t pf_time_size = pf ? lines * sizeof(uint64_t) : 0;
+    size_t head_size = (sizeof(set_page_t) + 63) / 64 * 64;
+    size_t total = head_size + page_data_size(cache);
+    void *mem;
+
+    if (posix_memalign(&mem, 64, total) != 0) {
+        return NULL;
+    }
+    memset(mem, 0, total);
+
+    set_page_t *page = (set_page_t *)mem;
+    char *p = (char *)mem + head_size;
+    page->tag = (unsigned long *)p;
+    p += tag_size;
+    page->valid = (uint64_t *)p;
+    p += bitmap_size;
+    page->dirty = (uint64_t *)p;
+    p += bitmap_size;
+    page->repl_tree = repl->tree ? (uint64_t *)p : NULL;
+    p += tree_size;
+    page->pf_mark = pf ? (uint64_t *)p : NULL;
+    p += mark_size;
+    page->pf_time = pf ? (uint64_t *)p : NULL;
+    p += pf_time_size;
+    page->lru_prev = (uint32_t *)p;
+    p += link_size;
+    page->lru_next = (uint32_t *)p;
+    p += link_size;
+    page->lru_head = (uint32_t *)p;
+    p += end_size;
+    page->lru_tail = (uint32_t *)p;
+    p += end_size;
+    page->repl_line = repl->line_state ? (uint32_t *)p : NULL;
+
+    /* chain every set from way E-1 (MRU) down to way 0 (LRU), so empty
+     * lines are filled in index order before anything is evicted */
+    unsigned long i, j;
+    for (i = 0; repl->lists && i < sets; i++) {
+        uint32_t *prev = page->lru_prev + i * cache->stride;
+        uint32_t *next = page->lru_next + i * cache->stride;
+        for (j = 0; j < cache->E; j++) {
+            prev[j] = j + 1 < cache->E ? (uint32_t)(j + 1) : LRU_NIL;
+            next[j] = j > 0 ? (uint32_t)(j - 1) : LRU_NIL;
+        }
+        page->lru_head[i] = (uint32_t)(cache->E - 1);
+        page->lru_tail[i] = 0;
+    }
+    return page;
+}
+
+/**
+ * Description:
+ *     Allocate page index of a cache the first time one of its sets is
+ *     touched.
+ *
+ *     If that fails, csim exits, but a libcsim cache carries on with its
+ *     spare page in place of the missing one and reports running out of
+ *     memory through the API instead.
+ * @param index page number, set >> page_shift
+ * @return the page now installed in the directory
+ */
+set_page_t *alloc_page(Cache *cache, unsigned long index) {
+    set_page_t *page = new_page(cache);
+    if (page == NULL) {
+        if (cache->spare != NULL) {
+            cache->out_of_memory = true;
+            return cache->spare;
+        }
+        printf("failed to allocate a page of the cache\n");
+        exit(1);
+    }
+    cache->pages[index] = page;
+    return page;
+}
+
+/**
+ * @brief Add one decoded record to the batch, simulating the batch
+ *      once it is full.
+ * @param op operation identifier from the trace, 'L' or 'S'
+ * @param address the memory address accessed
+ */
+int queue_access(char op, unsigned long address, unsigned int size) {
+    if (sample_period != 0 && window_skip(op)) {
+        return 0;
+    }
+    batch[batch_len].address = address;
+    batch[batch_len].size = size;
+    batch[batch_len].op = op;
+    if (++batch_len == BATCH_SIZE) {
+        run_batch();
+    }
+    if (interval != 0 && (op == 'L' || op == 'S') &&
+        ++interval_accesses == interval) {
+        end_interval();
+    }
+    if (sample_period != 0 && window_pos == sample_period) {
+        window_close();
+    }
+    return 0;
+}
+
+/* hex digit value + 1, or 0 for characters that are not hex digits */
+static const unsigned char hex_digit[256] = {
+    ['0'] = 1,  ['1'] = 2,  ['2'] = 3,  ['3'] = 4,  ['4'] = 5,  ['5'] = 6,
+    ['6'] = 7,  ['7'] = 8,  ['8'] = 9,  ['9'] = 10, ['a'] = 11, ['b'] = 12,
+    ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16, ['A'] = 11, ['B'] = 12,
+    ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+};
+
+/**
+ * @brief Parse the text records in [p, end), passing each to emit.
+ *
+ * Records have the form " op address,size" with a hex address and a
+ * decimal size. The bytes are parsed in place and never copied. Parsing
+ * stops at the first malformed record, as fscanf() did.
+ *
+ * @param final true if no more bytes follow end; otherwise only complete
+ *        lines are parsed and the rest is left for the next call
+ * @return where parsing stopped, or NULL on a malformed record
+ */
+static inline __attribute__((always_inline)) const char *
+parse_trace(const char *p, const char *end, bool final, record_fn emit,
+            void *ctx) {
+    if (!final) {
+        const char *last = end;
+        while (last > p && last[-1] != '\n') {
+            last--;
+        }
+        end = last;
+    }
+    for (;;) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' ||
+                           *p == '\r' || *p == '\v' || *p == '\f')) {
+            p++;
+        }
+        if (p == end) {
+            return p;
+        }
+        char op = *p++;
+        while (p < end && (*p == ' ' || *p == '\t')) {
+            p++;
+        }
+        if (end - p > 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X') &&
+            hex_digit[(unsigned char)p[2]]) {
+            p += 2;
+        }
+
+        const char *digits = p;
+        unsigned long address = 0;
+        unsigned d;
+        while (p < end && (d = hex_digit[(unsigned char)*p]) != 0) {
+            address = (address << 4) | (d - 1);
+            p++;
+        }
+        if (p == digits || p == end || *p != ',') {
+            return NULL;
+        }
+        p++;
+
+        digits = p;
+        unsigned size = 0;
+        while (p < end && (d = (unsigned)(*p - '0')) <= 9) {
+            size = size * 10 + d;
+            p++;
+        }
+        if (p == digits) {
+            return NULL;
+        }
+
+        emit(ctx, op, address, size);
+    }
+}
+
+/**
+ * @brief Decode the binary records in [p, end), passing each to emit.
+ *
+ * @param coder the decoder's stream state, carried from record to record
+ * @return where decoding stopped (at a record cut off by end),
+ *         or NULL on a corrupt record
+ */
+static inline __attribute__((always_inline)) const char *
+parse_binary_trace(const char *p, const char *end, trace_coder_t *coder,
+                   record_fn emit, void *ctx) {
+    const unsigned char *q = (const unsigned char *)p;
+    const unsigned char *qend = (const unsigned char *)end;
+    trace_record_t rec;
+    long n;
+    while ((n = decodeTraceRecord(q, qend, coder, &rec)) > 0) {
+        emit(ctx, rec.op, rec.address, rec.size);
+        q += n;
+    }
+    return n < 0 ? NULL : (const char *)q;
+}
+
+/**
+ * @brief Decode a trace from fd, passing each record to emit.
+ *
+ * Both the text format and the binary format from cachelab.h are
+ * accepted; a binary trace is recognised by its header.
+ *
+ * Regular files are mapped and parsed in place. Anything that cannot be
+ * mapped (stdin, pipes, FIFOs, empty files) is read in READ_CHUNK pieces,
+ * parsing every complete record and carrying a partial last record over
+ * to the next read, so a stream of any length is decoded in bounded
+ * memory as it is produced.
+ *
+ * Decoding starts at pos, which is moved to the end of the trace, so a
+ * later call can pick up whatever has been appended since. A fresh
+ * position is all zeros with binary = -1.
+ *
+ * @param resumable a later call will continue from pos. A text trace's
+ *        last line is then only parsed once its '\n' is there, since the
+ *        rest may still be on its way, and pos stops just past the last
+ *        '\n'. Otherwise an unterminated last line is parsed as well.
+ *
+ * Nothing here touches the globals, so the command line and any number
+ * of libcsim simulations can decode traces at the same time.
+ */
+static inline __attribute__((always_inline)) trace_status_t
+feed_trace(int fd, trace_pos_t *pos, bool resumable, record_fn emit,
+           void *ctx) {
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        size_t len = (size_t)st.st_size;
+        if (pos->offset > len) {
+            return TRACE_SHORT;
+        }
+        void *map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            const char *start = (const char *)map;
+            const char *end = start + len;
+            trace_status_t status = TRACE_OK;
+            (void)posix_madvise(map, len, POSIX_MADV_SEQUENTIAL);
+            if (pos->binary < 0) {
+                pos->binary =
+                    decodeTraceHeader((const unsigned char *)start, len, NULL);
+            }
+            const char *from = start + pos->offset;
+            const char *stop = end;
+            if (pos->binary) {
+                if (pos->offset == 0) {
+                    from += TRACE_HEADER_SIZE;
+                }
+                if (parse_binary_trace(from, end, &pos->coder, emit, ctx) !=
+                    end) {
+                    status = TRACE_CORRUPT;
+                }
+            } else {
+                stop = parse_trace(from, end, !resumable, emit, ctx);
+            }
+            munmap(map, len);
+            pos->offset = stop != NULL ? (uint64_t)(stop - start) : len;
+            return status;
+        }
+    }
+
+    char *buf = (char *)malloc(READ_CHUNK);
+    if (buf == NULL) {
+        return TRACE_NO_MEMORY;
+    }
+    /* skip what an earlier run consumed, by reading it if fd is a pipe */
+    uint64_t offset = pos->offset;
+    ssize_t got;
+    if (offset > 0 && lseek(fd, (off_t)offset, SEEK_SET) < 0) {
+        uint64_t skipped = 0;
+        while (skipped < offset) {
+            uint64_t want = offset - skipped;
+            got = read(fd, buf, want < READ_CHUNK ? want : READ_CHUNK);
+            if (got <= 0) {
+                free(buf);
+                return got < 0 ? TRACE_READ_ERROR : TRACE_SHORT;
+            }
+            skipped += (uint64_t)got;
+        }
+    }
+    size_t have = 0; /* bytes of an unfinished record kept from last read */
+    do {
+        got = read(fd, buf + have, READ_CHUNK - have);
+        if (got < 0) {
+            free(buf);
+            return TRACE_READ_ERROR;
+        }
+        offset += (uint64_t)got;
+        size_t len = have + (size_t)got;
+        const char *start = buf;
+        if (pos->binary < 0) {
+            if (len < TRACE_HEADER_SIZE && got > 0) {
+                have = len;
+                continue;
+            }
+            pos->binary = decodeTraceHeader((unsigned char *)buf, len, NULL);
+            if (pos->binary) {
+                start += TRACE_HEADER_SIZE;
+            }
+        }
+        const char *stop =
+            pos->binary
+                ? parse_binary_trace(start, buf + len, &pos->coder, emit, ctx)
+                : parse_trace(start, buf + len, got == 0 && !resumable,
+                              emit, ctx);
+        if (stop == NULL) {
+            if (pos->binary) {
+                free(buf);
+                return TRACE_CORRUPT;
+            }
+            break;
+        }
+        have = (size_t)(buf + len - stop);
+        if (have == READ_CHUNK) {
+            free(buf);
+            return TRACE_LONG_LINE;
+        }
+        memmove(buf, stop, have);
+    } while (got > 0);
+    free(buf);
+    pos->offset = offset - have;
+    return pos->binary > 0 && have > 0 ? TRACE_CORRUPT : TRACE_OK;
+}
+
+/* passes a decoded record to queue_access() */
+static void queue_record(void *ctx, char op, unsigned long address,
+                         unsigned int size) {
+    queue_access(op, address, size);
+}
+
+/**
+ * Description:
+ *     Read and execute each line of instruction from the trace file,
+ *     -t - for stdin, and update bits in cache.
+ */
+int readTrace(void) {
+    int fd = strcmp(traceFile, "-") == 0 ? STDIN_FILENO
+                                          : open(traceFile, O_RDONLY);
+    if (fd < 0) {
+        printf("\"%s\" does not exit in the directory\n", traceFile);
+        exit(1);
+    }
+
+    /* a resumed trace must still start with what the checkpoint read */
+    if (trace_tail != 0) {
+        uint64_t tail = trace_tail_hash(fd, &trace_pos);
+        if (tail != 0 && tail != trace_tail) {
+            printf("\"%s\" is not the trace the checkpoint was made from\n",
+                   traceFile);
+            exit(1);
+        }
+    }
+    switch (feed_trace(fd, &trace_pos, checkpoint_file != NULL, queue_record,
+                       NULL)) {
+    case TRACE_CORRUPT:
+        printf("binary trace is truncated or corrupt\n");
+        break;
+    case TRACE_READ_ERROR:
+        printf("failed to read \"%s\"\n", traceFile);
+        exit(1);
+    case TRACE_LONG_LINE:
+        printf("trace line longer than %d bytes\n", READ_CHUNK);
+        exit(1);
+    case TRACE_NO_MEMORY:
+        printf("failed to allocate the trace buffer\n");
+        exit(1);
+    case TRACE_SHORT:
+        printf("\"%s\" is shorter than the checkpoint\n", traceFile);
+        exit(1);
+    case TRACE_OK:
+        break;
+    }
+    trace_tail = trace_tail_hash(fd, &trace_pos);
+    close(fd);
+    return 0;
+}
+
+/* worker threads, and the barriers that hand batches to them */
+pthread_t workers[MAX_CACHES];
+pthread_barrier_t batch_ready;
+pthread_barrier_t batch_done;
+bool trace_done = false;
+
+/*
+ * Set sharding: when -j is given for a single cache, thread id owns the
+ * contiguous range of set pages whose index times num_threads, shifted
+ * down by the number of page bits, is id. run_batch() routes each record
+ * to its owner's queue, in trace order, and each thread simulates on its
+ * own copy of the Cache descriptor: the lines are shared, but each page
+ * is touched by one thread only, and the copies keep separate statistics
+ * that main() adds up. Every set sees the same accesses in the same order
+ * as the serial path, so the results are identical.
+ */
+access_t shard_queue[MAX_CACHES][BATCH_SIZE];
+int shard_len[MAX_CACHES];
+Cache shard_view[MAX_CACHES];
+
+/* the runs each thread finds in its share of a batch */
+run_t thread_runs[MAX_CACHES][BATCH_SIZE];
+
+/* the -S sampled accesses of a batch, sorted by group, per thread */
+access_t thread_sampled[MAX_CACHES][BATCH_SIZE];
+
+/**
+ * @brief The counters of cache c so far, including any set shards.
+ */
+static csim_stats_t current_stats(int c) {
+    csim_stats_t stats = caches[c]->stats;
+    int i;
+    for (i = 0; shard_sets && i < num_threads; i++) {
+        stats.hits += shard_view[i].stats.hits;
+        stats.misses += shard_view[i].stats.misses;
+        stats.evictions += shard_view[i].stats.evictions;
+        stats.dirty_bytes += shard_view[i].stats.dirty_bytes;
+        stats.dirty_evictions += shard_view[i].stats.dirty_evictions;
+        stats.mem_read_bytes += shard_view[i].stats.mem_read_bytes;
+        stats.mem_write_bytes += shard_view[i].stats.mem_write_bytes;
+        stats.pf_issued += shard_view[i].stats.pf_issued;
+        stats.pf_useful += shard_view[i].stats.pf_useful;
+        stats.pf_late += shard_view[i].stats.pf_late;
+        stats.pf_polluting += shard_view[i].stats.pf_polluting;
+        stats.pf_evictions += shard_view[i].stats.pf_evictions;
+    }
+    return stats;
+}
+
+/**
+ * @brief Collapse the loads and stores in acc[0..n) into runs of
+ *        consecutive accesses to the same 2^b-byte block.
+ *
+ * Sequential and small-stride streams, such as the rows a transpose
+ * walks, touch each block several times in a row, and every access after
+ * the first is a hit that changes nothing but perhaps the dirty bit. A
+ * run lets the simulator look the block up once and count the rest in
+ * one step. Other ops are dropped, as simulate_access() ignores them.
+ *
+ * @return the number of runs written to run
+ */
+static int find_runs(const access_t *acc, int n, int b, run_t *run) {
+    unsigned long block = 0;
+    uint32_t j = 0; /* loads and stores so far */
+    int i, m = 0;
+    for (i = 0; i < n; i++) {
+        char op = acc[i].op;
+        if (op != 'L' && op != 'S') {
+            continue;
+        }
+        /* Whether a run continues depends on the trace and would be a
+         * branch that mispredicts, so this is written without one: the
+         * access is always stored as the start of run m, which only
+         * becomes a run when m moves past it, and count holds the index
+         * of the run's first access until the end. */
+        bool fresh = m == 0 || acc[i].address >> b != block;
+        block = acc[i].address >> b;
+        run[m].address = acc[i].address;
+        run[m].count = j++;
+        run[m].op = op;
+        run[m].store = false;
+        m += fresh;
+        run[m - 1].store |= !fresh && op == 'S';
+    }
+    for (i = 0; i < m; i++) {
+        run[i].count = (i + 1 < m ? run[i + 1].count : j) - run[i].count;
+    }
+    return m;
+}
+
+/**
+ * @brief Simulate one run with the generic path.
+ *
+ * The first access may miss and the second may change the policy state
+ * of the line it hits (RRIP promotes it), but from then on every hit
+ * repeats the one before, so the rest are only counted. A store anywhere
+ * after the first access is made the second access. Runs are only used
+ * with write-back and write-allocate, where access sizes do not matter.
+ */
+static void simulate_run(Cache *cache, const run_t *run) {
+    simulate_access(cache, run->op, run->address, 0);
+    if (run->count > 1) {
+        simulate_access(cache, run->store ? 'S' : 'L', run->address, 0);
+        cache->stats.hits += run->count - 2;
+    }
+}
+
+/**
+ * @brief Simulate n records on one cache, as runs where possible.
+ *
+ * -v prints every access, an LFU hit bumps the use count every time,
+ * write-through and no-write-allocate send each store's bytes to memory,
+ * and a prefetcher trains on every access, so those take the records one
+ * by one.
+ *
+ * @param run scratch space for n runs
+ */
+static void simulate_records(Cache *cache, const access_t *acc, int n,
+                             run_t *run) {
+    int i;
+    if (cache->verbose || cache->policy == POLICY_LFU || cache->write_through ||
+        cache->no_write_allocate || cache->pf != NULL) {
+        for (i = 0; i < n; i++) {
+            simulate_access(cache, acc[i].op, acc[i].address, acc[i].size);
+        }
+        return;
+    }
+    int m = find_runs(acc, n, cache->b, run);
+    if (cache->kernel != NULL) {
+        cache->kernel(cache, run, m);
+        return;
+    }
+    for (i = 0; i < m; i++) {
+        simulate_run(cache, &run[i]);
+    }
+}
+
+/**
+ * @brief Feed the current batch to every cache owned by one thread.
+ *
+ * Thread id owns caches id, id + num_threads, ..., so no two threads
+ * ever touch the same cache.
+ */
+static void simulate_batch(int id) {
+    int c, i;
+    if (shard_sets) {
+        simulate_records(&shard_view[id], shard_queue[id], shard_len[id],
+                         thread_runs[id]);
+        return;
+    }
+    if (stack_mode) {
+        for (i = 0; i < batch_len; i++) {
+            stack_access(batch[i].op, batch[i].address);
+        }
+        return;
+    }
+    if (hierarchy) {
+        for (i = 0; i < batch_len; i++) {
+            hierarchy_access(batch[i].op, batch[i].address);
+        }
+        return;
+    }
+    for (c = id; c < num_caches; c += num_threads) {
+        Cache *cache = caches[c];
+        if (cache->shadow != NULL) {
+            for (i = 0; i < batch_len; i++) {
+                unsigned long misses = cache->stats.misses;
+                if (batch[i].op != 'L' && batch[i].op != 'S') {
+                    continue;
+                }
+                simulate_access(cache, batch[i].op, batch[i].address,
+                                batch[i].size);
+                shadow_access(cache->shadow, cache->stats.misses != misses,
+                              batch[i].address);
+            }
+            continue;
+        }
+        if (cache->sample != NULL) {
+            simulate_sampled(cache, batch, batch_len, thread_sampled[id],
+                             thread_runs[id]);
+            continue;
+        }
+        simulate_records(cache, batch, batch_len, thread_runs[id]);
+    }
+}
+
+/**
+ * @brief Worker thread: simulate each batch the main thread publishes.
+ */
+static void *worker_main(void *arg) {
+    int id = (int)(long)arg;
+    for (;;) {
+        pthread_barrier_wait(&batch_ready);
+        if (trace_done) {
+            return NULL;
+        }
+        simulate_batch(id);
+        pthread_barrier_wait(&batch_done);
+    }
+}
+
+/**
+ * Description:
+ *     Simulate every queued record on every cache and empty the batch.
+ *     With -j the caches, or the sets of a single cache, are split
+ *     across the worker threads, and the main thread takes its own share.
+ */
+int run_batch(void) {
+    int i;
+    if (shard_sets) {
+        const Cache *cache = caches[0];
+        for (i = 0; i < num_threads; i++) {
+            shard_len[i] = 0;
+        }
+        for (i = 0; i < batch_len; i++) {
+            unsigned long set = (batch[i].address >> cache->b) & (cache->S - 1);
+            unsigned long page = set >> cache->page_shift;
+            unsigned long id = (page * (unsigned long)num_threads) >>
+                               (cache->s - cache->page_shift);
+            shard_queue[id][shard_len[id]++] = batch[i];
+        }
+    }
+    if (num_threads > 1) {
+        pthread_barrier_wait(&batch_ready);
+        simulate_batch(0);
+        pthread_barrier_wait(&batch_done);
+    } else {
+        simulate_batch(0);
+    }
+    batch_len = 0;
+    return 0;
+}
+
+/**
+ * Description:
+ *     Start the worker threads requested with -j.
+ */
+int start_workers(void) {
+    long i;
+    if (num_threads <= 1) {
+        return 0;
+    }
+    for (i = 0; shard_sets && i < num_threads; i++) {
+        shard_view[i] = *caches[0];
+        memset(&shard_view[i].stats, 0, sizeof(csim_stats_t));
+    }
+    pthread_barrier_init(&batch_ready, NULL, (unsigned)num_threads);
+    pthread_barrier_init(&batch_done, NULL, (unsigned)num_threads);
+    for (i = 1; i < num_threads; i++) {
+        if (pthread_create(&workers[i], NULL, worker_main, (void *)i) != 0) {
+            printf("failed to start worker thread\n");
+            exit(1);
+        }
+    }
+    return 0;
+}
+
+/**
+ * Description:
+ *     Tell the worker threads the trace is finished and wait for them.
+ */
+int stop_workers(void) {
+    int i;
+    if (num_threads <= 1) {
+        return 0;
+    }
+    trace_done = true;
+    pthread_barrier_wait(&batch_ready);
+    for (i = 1; i < num_threads; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    pthread_barrier_destroy(&batch_ready);
+    pthread_barrier_destroy(&batch_done);
+
+    /* add up the statistics the set shards kept */
+    if (shard_sets) {
+        caches[0]->stats = current_stats(0);
+    }
+    return 0;
+}
+
+/**
+ * Description:
+ *     Close the current interval: simulate what is queued, then record
+ *     every cache's counters since the last snapshot. Must run before
+ *     stop_workers() folds the set shards into the caches.
+ */
+int end_interval(void) {
+    int c;
+    if (interval_accesses == 0) {
+        return 0;
+    }
+    if (batch_len > 0) {
+        run_batch();
+    }
+    if (num_intervals == cap_intervals) {
+        cap_intervals = cap_intervals == 0 ? 64 : 2 * cap_intervals;
+        for (c = 0; c < num_caches; c++) {
+            intervals[c] = (csim_interval_t *)realloc(
+                intervals[c], cap_intervals * sizeof(csim_interval_t));
+            if (intervals[c] == NULL) {
+                printf("failed to allocate the interval statistics\n");
+                exit(1);
+            }
+        }
+    }
+    for (c = 0; c < num_caches; c++) {
+        csim_stats_t now = current_stats(c);
+        csim_stats_t *last = &last_snapshot[c];
+        csim_interval_t *out = &intervals[c][num_intervals];
+        unsigned long B = caches[c]->B;
+        out->start = total_accesses;
+        out->accesses = interval_accesses;
+        out->stats.hits = now.hits - last->hits;
+        out->stats.misses = now.misses - last->misses;
+        out->stats.evictions = now.evictions - last->evictions;
+        out->stats.dirty_bytes = B * now.dirty_bytes;
+        out->stats.dirty_evictions =
+            B * (now.dirty_evictions - last->dirty_evictions);
+        out->stats.mem_read_bytes = now.mem_read_bytes - last->mem_read_bytes;
+        out->stats.mem_write_bytes =
+            now.mem_write_bytes - last->mem_write_bytes;
+        out->stats.pf_issued = now.pf_issued - last->pf_issued;
+        out->stats.pf_useful = now.pf_useful - last->pf_useful;
+        out->stats.pf_late = now.pf_late - last->pf_late;
+        out->stats.pf_polluting = now.pf_polluting - last->pf_polluting;
+        out->stats.pf_evictions = now.pf_evictions - last->pf_evictions;
+        *last = now;
+    }
+    num_intervals++;
+    total_accesses += interval_accesses;
+    interval_accesses = 0;
+    return 0;
+}
+
+/**
+ * Description:
+ *     Write the totals and intervals of every cache to the -o file, as
+ *     JSON or, with -f csv, CSV.
+ */
+int write_stats(const csim_stats_t *stats, const char *const *labels) {
+    bool to_stdout = strcmp(stats_file, "-") == 0;
+    FILE *out = to_stdout ? stdout : fopen(stats_file, "w");
+    int c;
+    if (out == NULL) {
+        printf("failed to open \"%s\"\n", stats_file);
+        exit(1);
+    }
+    const csim_interval_t *const *series =
+        (const csim_interval_t *const *)intervals;
+    size_t n = (size_t)num_caches;
+    bool ok =
+        stats_csv
+            ? writeStatsCSV(out, stats, labels, n, series, num_intervals)
+            : writeStatsJSON(out, stats, labels, n, series, num_intervals);
+    if (!to_stdout && fclose(out) != 0) {
+        ok = false;
+    }
+    if (!ok) {
+        printf("failed to write \"%s\"\n", stats_file);
+        exit(1);
+    }
+    for (c = 0; c < num_caches; c++) {
+        free(intervals[c]);
+    }
+    return 0;
+}
+
+/* move a way to the front of one set's LRU list */
+static inline void lru_touch(uint32_t *prev, uint32_t *next, uint32_t *head,
+                             uint32_t *tail, uint32_t way) {
+    if (*head == way) {
+        return;
+    }
+    /* unlink the line; it is not the head, so it has a prev */
+    next[prev[way]] = next[way];
+    if (next[way] == LRU_NIL) {
+        *tail = prev[way];
+    } else {
+        prev[next[way]] = prev[way];
+    }
+    /* push it in front of the old head */
+    prev[way] = LRU_NIL;
+    next[way] = *head;
+    prev[*head] = way;
+    *head = way;
+}
+
+/*
+ * Specialized kernels
+ *
+ * An LRU cache with 1, 2, 4, 8 or 16 ways runs the runs of each batch
+ * (see find_runs()) through a kernel stamped out of lru_kernel() with the
+ * way count as a compile-time constant, looking up each run once. The
+ * tag search is a fixed loop the compiler unrolls (the vector tag match
+ * from 8 ways up), a set's valid and dirty bits are one word, there is no
+ * policy dispatch, and a direct-mapped cache skips the recency list
+ * altogether.
+ * Every geometry is a power-of-two shape, so the set and tag are one
+ * shift and mask with constants hoisted out of the batch loop. The
+ * kernels update the same lines, lists and statistics as load_op() and
+ * store_op(), so either path can run any batch.
+ */
+static inline __attribute__((always_inline)) void
+lru_kernel(Cache *cache, const run_t *run, int n, const unsigned long ways) {
+    const int b = cache->b;
+    const int tag_shift = cache->s + cache->b;
+    const unsigned long set_mask = cache->S - 1;
+    const unsigned long page_mask = cache->page_sets - 1;
+    const int page_shift = cache->page_shift;
+    /* counted in locals, which can live in registers, and added to the
+     * cache's statistics once at the end of the batch */
+    unsigned long hits = 0, misses = 0, evictions = 0, dirty_evictions = 0;
+    unsigned long dirty_bytes = cache->stats.dirty_bytes;
+    int i;
+    unsigned long w;
+
+    for (i = 0; i < n; i++) {
+        unsigned long set = (run[i].address >> b) & set_mask;
+        unsigned long key = run[i].address >> tag_shift;
+        set_page_t *page = cache->pages[set >> page_shift];
+        if (page == NULL) {
+            page = alloc_page(cache, set >> page_shift);
+        }
+        unsigned long local = set & page_mask;
+        unsigned long *tag = page->tag + local * ways;
+        uint64_t *valid = page->valid + local;
+        uint64_t *dirty = page->dirty + local;
+
+        uint64_t hit = 0;
+        if (ways >= 8) {
+            hit = cache->match(tag, ways, key);
+        } else {
+            for (w = 0; w < ways; w++) {
+                hit |= (uint64_t)(tag[w] == key) << w;
+            }
+        }
+        hit &= *valid;
+
+        /* the rest of the run hits the same line */
+        hits += run[i].count - 1;
+        uint32_t way;
+        if (hit != 0) {
+            hits++;
+            way = (uint32_t)__builtin_ctzll(hit);
+        } else {
+            misses++;
+            way = ways == 1 ? 0 : page->lru_tail[local];
+            uint64_t bit = 1ULL << way;
+            if (*valid & bit) {
+                evictions++;
+                if (*dirty & bit) {
+                    dirty_evictions++;
+                    dirty_bytes--;
+                    *dirty &= ~bit;
+                }
+            }
+            *valid |= bit;
+            tag[way] = key;
+        }
+        if (ways > 1) {
+            lru_touch(page->lru_prev + local * ways,
+                      page->lru_next + local * ways, page->lru_head + local,
+                      page->lru_tail + local, way);
+        }
+        if ((run[i].op == 'S' || run[i].store) &&
+            (*dirty & (1ULL << way)) == 0) {
+            *dirty |= 1ULL << way;
+            dirty_bytes++;
+        }
+    }
+    cache->stats.hits += hits;
+    cache->stats.misses += misses;
+    cache->stats.evictions += evictions;
+    cache->stats.dirty_evictions += dirty_evictions;
+    cache->stats.dirty_bytes = dirty_bytes;
+    cache->stats.mem_read_bytes += misses * cache->B;
+    cache->stats.mem_write_bytes += dirty_evictions * cache->B;
+}
+
+#define LRU_KERNEL(WAYS)                                                       \
+    static void lru_kernel_##WAYS(Cache *cache, const run_t *run, int n) {    \
+        lru_kernel(cache, run, n, WAYS);                                       \
+    }
+
+LRU_KERNEL(1)
+LRU_KERNEL(2)
+LRU_KERNEL(4)
+LRU_KERNEL(8)
+LRU_KERNEL(16)
+
+/**
+ * Description:
+ *     Pick the specialized kernel for a cache's geometry and policy, or
+ *     leave kernel NULL for the generic per-access path. -v needs the
+ *     per-access messages, -c the per-access outcome and the write
+ *     policies other than write-back and write-allocate the store sizes,
+ *     so they always take the generic path.
+ */
+int select_kernel(Cache *cache) {
+    cache->kernel = NULL;
+    if (cache->policy != POLICY_LRU || cache->verbose ||
+        cache->shadow != NULL || cache->write_through ||
+        cache->no_write_allocate || cache->pf != NULL) {
+        return 0;
+    }
+    switch (cache->E) {
+    case 1:
+        cache->kernel = lru_kernel_1;
+        break;
+    case 2:
+        cache->kernel = lru_kernel_2;
+        break;
+    case 4:
+        cache->kernel = lru_kernel_4;
+        break;
+    case 8:
+        cache->kernel = lru_kernel_8;
+        break;
+    case 16:
+        cache->kernel = lru_kernel_16;
+        break;
+    default:
+        break;
+    }
+    return 0;
+}
+
+/**
+ * @brief Split an address into set and tag bits and run one access.
+ * @param op operation identifier from the trace, 'L' or 'S'
+ * @param address the memory address accessed
+ * @param size bytes accessed, which only matter to stores sent to memory
+ */
+int simulate_access(Cache *cache, char op, unsigned long address,
+                    unsigned int size) {
+    /* get opcode set bits and tag bytes; S and B are powers of two */
+    unsigned long tag_bits = address >> (cache->b + cache->s);
+    unsigned long set_bits = (address >> cache->b) & (cache->S - 1);
+    unsigned long misses = cache->stats.misses;
+    unsigned long used = cache->stats.pf_useful + cache->stats.pf_late;
+    /* For Load operation */
+    if (op == 'L') {
+        load_op(cache, set_bits, tag_bits);
+    }
+    /* For Store operation */
+    if (op == 'S' && store_op(cache, set_bits, tag_bits)) {
+        write_memory(cache, address, size);
+    }
+    /* let the prefetcher see the demand access */
+    if (cache->pf != NULL && (op == 'L' || op == 'S')) {
+        prefetch_train(cache, address, cache->stats.misses != misses,
+                       cache->stats.pf_useful + cache->stats.pf_late != used);
+    }
+    return 0;
+}
+
+/**
+ * @brief Look up a tag in one set.
+ *
+ * The tag array is searched 64 ways at a time with the vector kernel,
+ * and the match mask is filtered by the valid bitmap.
+ *
+ * @param set_bits set bits in the memory address
+ * @param tag_bits tag bits of the memory address
+ * @return the matching way, or -1 on a miss
+ */
+long find_line(Cache *cache, unsigned long set_bits, unsigned long tag_bits) {
+    const unsigned long *tag = set_tag(cache, set_bits);
+    const uint64_t *valid = set_valid(cache, set_bits);
+    unsigned long w;
+    for (w = 0; w < cache->words; w++) {
+        unsigned long base = w * WORD_WAYS;
+        unsigned long n = cache->stride - base;
+        if (n > WORD_WAYS) {
+            n = WORD_WAYS;
+        }
+        uint64_t hit = cache->match(tag + base, n, tag_bits) & valid[w];
+        if (hit != 0) {
+            return (long)(base + (unsigned long)__builtin_ctzll(hit));
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Operations to cache when the opcode is Load.
+ * @param set_bits set bits in the memory address
+ * @param tag_bits tag bits of the memory address
+ */
+int load_op(Cache *cache, unsigned long set_bits, unsigned long tag_bits) {
+    /* set selection and line match*/
+    long i = find_line(cache, set_bits, tag_bits);
+
+    /* Hit: when the set bits and the valid bits both match */
+    if (i >= 0) {
+        /* count this hit, or a miss if it waits for a late prefetch */
+        bool late = cache->pf != NULL && prefetch_hit(cache, (int)i, set_bits);
+        if (late) {
+            cache->stats.misses++;
+        } else {
+            cache->stats.hits++;
+        }
+        if (cache->verbose)
+            printf(late ? "Miss\n" : "Hit\n");
+        /* let the replacement policy see the hit */
+        policy_hit(cache, (int)i, set_bits);
+        return 0;
+    }
+
+    /* Miss: when hits nothing in the cache */
+    /* count the miss */
+    cache->stats.misses++;
+    if (cache->verbose)
+        printf("Miss\n");
+    /* find the line the replacement policy evicts */
+    int max_idx = find_victim(cache, set_bits);
+
+    /* Eviction miss when the cache set is full,
+     * which means the victim line has valid bit = 1
+     */
+    eviction_effect(cache, max_idx, set_bits);
+
+    /* update valid bit, tag bit and replacement state */
+    update_bits(cache, max_idx, set_bits, tag_bits);
+    policy_fill(cache, max_idx, set_bits);
+    fill_traffic(cache, tag_bits << cache->s | set_bits);
+    return 0;
+}
+
+/**
+ * @brief Operations to cache when the opcode is Store.
+ * @param set_bits set bits in the memory address
+ * @param tag_bits tag bits of the memory address
+ * @return 1 if the write policy also sends the store to memory, else 0
+ */
+int store_op(Cache *cache, unsigned long set_bits, unsigned long tag_bits) {
+    uint64_t *dirty = set_dirty(cache, set_bits);
+
+    /* set selection and line match*/
+    long i = find_line(cache, set_bits, tag_bits);
+
+    /* Hit: when the set bits and the valid bits both match */
+    if (i >= 0) {
+        /* count this hit, or a miss if it waits for a late prefetch */
+        bool late = cache->pf != NULL && prefetch_hit(cache, (int)i, set_bits);
+        if (late) {
+            cache->stats.misses++;
+        } else {
+            cache->stats.hits++;
+        }
+        if (cache->verbose)
+            printf(late ? "Miss\n" : "Hit\n");
+        /* let the replacement policy see the hit */
+        policy_hit(cache, (int)i, set_bits);
+        if (cache->write_through) {
+            return 1;
+        }
+        /* set the dirty bit */
+        uint64_t bit = 1ULL << (i % WORD_WAYS);
+        if ((dirty[i / WORD_WAYS] & bit) == 0) {
+            dirty[i / WORD_WAYS] |= bit;
+            cache->stats.dirty_bytes++;
+        }
+        return 0;
+    }
+
+    /* Miss: when hits nothing in the cache */
+    /* count the miss */
+    cache->stats.misses++;
+    if (cache->verbose)
+        printf("Miss\n");
+    if (cache->no_write_allocate) {
+        return 1;
+    }
+
+    /* find the line the replacement policy evicts */
+    int max_idx = find_victim(cache, set_bits);
+
+    /* Eviction miss when the cache set is full,
+     * which means the victim line has valid bit = 1
+     */
+    eviction_effect(cache, max_idx, set_bits);
+
+    /* update valid bit, tag bit and replacement state */
+    update_bits(cache, max_idx, set_bits, tag_bits);
+    policy_fill(cache, max_idx, set_bits);
+    fill_traffic(cache, tag_bits << cache->s | set_bits);
+    if (cache->write_through) {
+        return 1;
+    }
+
+    /* set the dirty bits after write */
+    dirty[max_idx / WORD_WAYS] |= 1ULL << (max_idx % WORD_WAYS);
+    cache->stats.dirty_bytes++;
+    return 0;
+}
+
+/**
+ * @brief Change bits and count dirty bytes after determing if
+ *      eviction miss happens
+ * @param idx index of the line in the set
+ * @param set_bits set bits in the memory address
+ */
+int eviction_effect(Cache *cache, int idx, unsigned long set_bits) {
+    uint64_t *valid = set_valid(cache, set_bits);
+    uint64_t bit = 1ULL << (idx % WORD_WAYS);
+
+    /* if eviction happens */
+    if (valid[idx / WORD_WAYS] & bit) {
+        cache->stats.evictions++;
+        if (cache->verbose)
+            printf("Evictions\n\n");
+        if (write_back(cache, idx, set_bits)) {
+            cache->stats.dirty_evictions++;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Write line idx back to memory if it is dirty, and clean it.
+ * @param idx index of the line in the set
+ * @param set_bits set bits in the memory address
+ * @return true if the line was dirty
+ */
+bool write_back(Cache *cache, int idx, unsigned long set_bits) {
+    uint64_t *dirty = set_dirty(cache, set_bits);
+    uint64_t bit = 1ULL << (idx % WORD_WAYS);
+
+    if ((dirty[idx / WORD_WAYS] & bit) == 0) {
+        return false;
+    }
+    cache->stats.mem_write_bytes += cache->B;
+    dirty[idx / WORD_WAYS] &= ~bit;
+    cache->stats.dirty_bytes--;
+    return true;
+}
+
+/**
+ * @brief After each hit or miss,
+ *      move the line to the front of its set's LRU list.
+ * @param idx index of the line in the set
+ * @param set_bits set bits in the memory address
+ */
+int update_LRU(Cache *cache, int idx, unsigned long set_bits) {
+    set_page_t *page = set_page(cache, set_bits);
+    unsigned long i = page_set(cache, set_bits);
+    lru_touch(page->lru_prev + i * cache->stride,
+              page->lru_next + i * cache->stride, page->lru_head + i,
+              page->lru_tail + i, (uint32_t)idx);
+    return 0;
+}
+
+/**
+ * @brief Update the bits in each cache line after miss
+ *
+ * @param idx index of the line in the set
+ * @param set_bits set bits in the memory address
+ * @param tag_bits tag bits in the memory address
+ */
+int update_bits(Cache *cache, int idx, unsigned long set_bits,
+                unsigned long tag_bits) {
+    set_valid(cache, set_bits)[idx / WORD_WAYS] |= 1ULL << (idx % WORD_WAYS);
+    set_tag(cache, set_bits)[idx] = tag_bits;
+    /* a new line is a demand fill until prefetch_fill() says otherwise */
+    if (cache->pf != NULL) {
+        set_pf_mark(cache, set_bits)[idx / WORD_WAYS] &=
+            ~(1ULL << (idx % WORD_WAYS));
+    }
+    return 0;
+}
+
+/**
+ * @brief Given the set number, return the setline index of the
+ * least recently used line, which is the tail of the LRU list.
+ *
+ * @param set_bits set bits in the memory address
+ */
+int find_LRU(Cache *cache, unsigned long set_bits) {
+    return (int)set_page(cache, set_bits)
+        ->lru_tail[page_set(cache, set_bits)];
+}
+
+/**
+ * @brief Return the first empty line of a set, or -1 if the set is full.
+ *
+ * Every policy fills empty lines before it evicts anything.
+ *
+ * @param set_bits set bits in the memory address
+ */
+int find_invalid(Cache *cache, unsigned long set_bits) {
+    const uint64_t *valid = set_valid(cache, set_bits);
+    unsigned long w;
+    for (w = 0; w < cache->words; w++) {
+        uint64_t empty = ~valid[w];
+        unsigned long left = cache->E - w * WORD_WAYS;
+        if (left < WORD_WAYS) {
+            empty &= (1ULL << left) - 1;
+        }
+        if (empty != 0) {
+            return (int)(w * WORD_WAYS + (unsigned long)__builtin_ctzll(empty));
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Step the xorshift64* generator.
+ */
+static uint64_t next_random(Cache *cache) {
+    cache->rng_state ^= cache->rng_state >> 12;
+    cache->rng_state ^= cache->rng_state << 25;
+    cache->rng_state ^= cache->rng_state >> 27;
+    return cache->rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+/**
+ * @brief Random replacement: an empty line, else any line.
+ * @param set_bits set bits in the memory address
+ */
+int random_victim(Cache *cache, unsigned long set_bits) {
+    int idx = find_invalid(cache, set_bits);
+    if (idx >= 0) {
+        return idx;
+    }
+    return (int)(next_random(cache) % cache->E);
+}
+
+/**
+ * @brief Tree-PLRU: point every node on the path to the line away from it.
+ *
+ * The tree is a heap over nodes 1..E-1 with way w at leaf E + w. A set
+ * node bit sends the next victim search to the right child.
+ *
+ * @param idx index of the line in the set
+ * @param set_bits set bits in the memory address
+ */
+int plru_touch(Cache *cache, int idx, unsigned long set_bits) {
+    uint64_t *tree = set_repl_tree(cache, set_bits);
+    unsigned long node = cache->E + (unsigned long)idx;
+    while (node > 1) {
+        unsigned long parent = node / 2;
+        uint64_t bit = 1ULL << (parent % WORD_WAYS);
+        if (node == 2 * parent) {
+            tree[parent / WORD_WAYS] |= bit;
+        } else {
+            tree[parent / WORD_WAYS] &= ~bit;
+        }
+        node = parent;
+    }
+    return 0;
+}
+
+/**
+ * @brief Tree-PLRU: an empty line, else follow the node bits to a leaf.
+ * @param set_bits set bits in the memory address
+ */
+int plru_victim(Cache *cache, unsigned long set_bits) {
+    int idx = find_invalid(cache, set_bits);
+    if (idx >= 0) {
+        return idx;
+    }
+    const uint64_t *tree = set_repl_tree(cache, set_bits);
+    unsigned long node = 1;
+    while (node < cache->E) {
+        node = 2 * node + ((tree[node / WORD_WAYS] >> (node % WORD_WAYS)) & 1);
+    }
+    return (int)(node - cache->E);
+}
+
+/**
+ * @brief RRIP: a hit predicts a near re-reference.
+ * @param idx index of the line in the set
+ * @param set_bits set bits in the memory address
+ */
+int rrip_hit(Cache *cache, int idx, unsigned long set_bits) {
+    set_repl_line(cache, set_bits)[idx] = 0;
+    return 0;
+}
+
+/**
+ * @brief SRRIP: insert with a long re-reference prediction.
+ * @param idx index of the line in the set
+ * @param set_bits set bits in the memory address
+ */
+int srrip_fill(Cache *cache, int idx, unsigned long set_bits) {
+    set_repl_line(cache, set_bits)[idx] = RRPV_MAX - 1;
+    return 0;
+}
+
+/**
+ * @brief BRRIP: insert with a distant re-reference prediction, and only
+ *      occasionally with a long one, so scans do not flush the set.
+ * @param idx index of the line in the set
+ * @param set_bits set bits in the memory address
+ */
+int brrip_fill(Cache *cache, int idx, unsigned long set_bits) {
+    uint32_t rrpv =
+        next_random(cache) % BRRIP_EPSILON == 0 ? RRPV_MAX - 1 : RRPV_MAX;
+    set_repl_line(cache, set_bits)[idx] = rrpv;
+    return 0;
+}
+
+/**
+ * @brief RRIP: an empty line, else the first line with a distant
+ *      prediction, ageing the whole set until there is one.
+ * @param set_bits set bits in the memory address
+ */
+int rrip_victim(Cache *cache, unsigned long set_bits) {
+    int idx = find_invalid(cache, set_bits);
+    if (idx >= 0) {
+        return idx;
+    }
+    uint32_t *rrpv = set_repl_line(cache, set_bits);
+    uint32_t oldest = rrpv[0];
+    unsigned long i;
+    idx = 0;
+    for (i = 0; i < cache->E; i++) {
+        if (rrpv[i] == RRPV_MAX) {
+            return (int)i;
+        }
+        if (rrpv[i] > oldest) {
+            oldest = rrpv[i];
+            idx = (int)i;
+        }
+    }
+    /* age every line by the same amount, which leaves idx at RRPV_MAX */
+    for (i = 0; i < cache->E; i++) {
+        rrpv[i] += RRPV_MAX - oldest;
+    }
+    return idx;
+}
+
+/**
+ * @brief LFU: count the hit, saturating the counter.
+ * @param idx index of the line in the set
+ * @param set_bits set bits in the memory address
+ */
+int lfu_hit(Cache *cache, int idx, unsigned long set_bits) {
+    uint32_t *count = set_repl_line(cache, set_bits);
+    if (count[idx] != UINT32_MAX) {
+        count[idx]++;
+    }
+    return 0;
+}
+
+/**
+ * @brief LFU: a new line has been used once.
+ * @param idx index of the line in the set
+ * @param set_bits set bits in the memory address
+ */
+int lfu_fill(Cache *cache, int idx, unsigned long set_bits) {
+    set_repl_line(cache, set_bits)[idx] = 1;
+    return 0;
+}
+
+/**
+ * @brief LFU: an empty line, else the least used line (lowest way on ties).
+ * @param set_bits set bits in the memory address
+ */
+int lfu_victim(Cache *cache, unsigned long set_bits) {
+    int idx = find_invalid(cache, set_bits);
+    if (idx >= 0) {
+        return idx;
+    }
+    const uint32_t *count = set_repl_line(cache, set_bits);
+    unsigned long i;
+    idx = 0;
+    for (i = 1; i < cache->E; i++) {
+        if (count[i] < count[idx]) {
+            idx = (int)i;
+        }
+    }
+    return idx;
+}
+
+/*
+ * Write policies and memory traffic (-w, -n, -W)
+ *
+ * By default a cache is write-back and write-allocate: a store dirties
+ * its line, and memory only sees line fills and dirty evictions, one
+ * block each. With -w through every store is also sent to memory and
+ * lines are never dirty; with -n a store miss is sent to memory without
+ * filling a line. Either way mem_read_bytes counts the fills and
+ * mem_write_bytes the bytes that reach memory.
+ *
+ * Stores sent to memory can go through a write-combining buffer of -W
+ * entries, each holding the bytes written to one block, oldest first. A
+ * store to a block with an entry merges into it; otherwise the oldest
+ * entry is written out to make room. An entry writes only the bytes
+ * stored to it, and it is written out early if its block is filled into
+ * the cache, so the fill reads the merged data.
+ */
+
+struct wcbuf {
+    unsigned long n;      /* entries */
+    unsigned long len;    /* entries in use, oldest first */
+    unsigned long words;  /* mask words per entry */
+    unsigned long *block; /* block number of each entry */
+    uint64_t *mask;       /* bytes written to each entry's block */
+};
+
+/**
+ * @brief Create an empty write-combining buffer of entries blocks.
+ */
+wcbuf_t *wcbuf_new(const Cache *cache, unsigned long entries) {
+    wcbuf_t *wcbuf = (wcbuf_t *)calloc(1, sizeof(wcbuf_t));
+    if (wcbuf == NULL) {
+        printf("failed to allocate the write-combining buffer\n");
+        exit(1);
+    }
+    wcbuf->n = entries;
+    wcbuf->words = (cache->B + 63) / 64;
+    wcbuf->block = (unsigned long *)calloc(entries, sizeof(unsigned long));
+    wcbuf->mask = (uint64_t *)calloc(entries * wcbuf->words, sizeof(uint64_t));
+    if (wcbuf->block == NULL || wcbuf->mask == NULL) {
+        printf("failed to allocate the write-combining buffer\n");
+        exit(1);
+    }
+    return wcbuf;
+}
+
+/**
+ * @brief Free a buffer made by wcbuf_new().
+ */
+int wcbuf_free(wcbuf_t *wcbuf) {
+    free(wcbuf->block);
+    free(wcbuf->mask);
+    free(wcbuf);
+    return 0;
+}
+
+/**
+ * @brief Write entry i of a cache's buffer to memory and remove it.
+ */
+static void wcbuf_flush(Cache *cache, unsigned long i) {
+    wcbuf_t *wcbuf = cache->wcbuf;
+    uint64_t *mask = wcbuf->mask + i * wcbuf->words;
+    unsigned long w;
+    for (w = 0; w < wcbuf->words; w++) {
+        cache->stats.mem_write_bytes += (unsigned long)__builtin_popcountll(
+            mask[w]);
+    }
+    wcbuf->len--;
+    memmove(wcbuf->block + i, wcbuf->block + i + 1,
+            (wcbuf->len - i) * sizeof(unsigned long));
+    memmove(mask, mask + wcbuf->words,
+            (wcbuf->len - i) * wcbuf->words * sizeof(uint64_t));
+}
+
+/**
+ * @brief Send a store of size bytes to memory, through the buffer if
+ *        there is one. Bytes past the end of the block are dropped, as
+ *        every access is simulated as touching one block.
+ * @param address the memory address stored to
+ */
+int write_memory(Cache *cache, unsigned long address, unsigned int size) {
+    unsigned long offset = address & (cache->B - 1);
+    unsigned long end = offset + size < cache->B ? offset + size : cache->B;
+    wcbuf_t *wcbuf = cache->wcbuf;
+    unsigned long i;
+
+    if (wcbuf == NULL) {
+        cache->stats.mem_write_bytes += end - offset;
+        return 0;
+    }
+    unsigned long block = address >> cache->b;
+    for (i = 0; i < wcbuf->len; i++) {
+        if (wcbuf->block[i] == block) {
+            break;
+        }
+    }
+    if (i == wcbuf->len) {
+        if (wcbuf->len == wcbuf->n) {
+            wcbuf_flush(cache, 0);
+            i--;
+        }
+        wcbuf->block[i] = block;
+        memset(wcbuf->mask + i * wcbuf->words, 0,
+               wcbuf->words * sizeof(uint64_t));
+        wcbuf->len++;
+    }
+    uint64_t *mask = wcbuf->mask + i * wcbuf->words;
+    for (; offset < end; offset++) {
+        mask[offset / 64] |= 1ULL << (offset % 64);
+    }
+    return 0;
+}
+
+/**
+ * @brief Count a line fill from memory, writing out any buffered stores
+ *        to the block first.
+ * @param block the block filled, address >> b
+ */
+int fill_traffic(Cache *cache, unsigned long block) {
+    wcbuf_t *wcbuf = cache->wcbuf;
+    unsigned long i;
+    cache->stats.mem_read_bytes += cache->B;
+    if (wcbuf == NULL) {
+        return 0;
+    }
+    for (i = 0; i < wcbuf->len; i++) {
+        if (wcbuf->block[i] == block) {
+            wcbuf_flush(cache, i);
+            break;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Write every buffered store out at the end of the trace.
+ */
+int wcbuf_drain(Cache *cache) {
+    while (cache->wcbuf != NULL && cache->wcbuf->len > 0) {
+        wcbuf_flush(cache, 0);
+    }
+    return 0;
+}
+
+/*
+ * Hardware prefetchers (-p, -P)
+ *
+ * A prefetcher watches the demand accesses of one cache and fills the
+ * blocks it expects them to use next, degree (-P) blocks at a time:
+ *
+ *   next    tagged next-line: a miss, or the first use of a prefetched
+ *           line, prefetches the blocks after it.
+ *   stride  a table of STRIDE_ENTRIES regions of 2^STRIDE_REGION bytes,
+ *           each holding the last address accessed in it and the delta
+ *           from the one before. Traces have no PC, so the table is
+ *           indexed by region rather than by instruction. Once a delta
+ *           repeats, the next addresses along it are prefetched, at
+ *           least a block apart.
+ *   stream  STREAM_ENTRIES trackers, each following the misses and first
+ *           uses that land within STREAM_WINDOW blocks of its last one.
+ *           Two steps in one direction confirm a stream, and from then
+ *           on each step prefetches the blocks ahead of it.
+ *
+ * A prefetch fill is not a demand access, so it counts as neither a hit
+ * nor a miss, but it evicts a line and reads memory like any other fill.
+ * The line is marked until its first demand access, which is useful, or
+ * late if it comes within PREFETCH_LATENCY demand accesses of the fill:
+ * the data would still be on its way, so a late access counts as a miss.
+ * Late prefetches are therefore demand misses as well, and misses
+ * includes pf_late; a useful one is a demand hit. A late access does not
+ * fill or evict anything, so evictions never counts it.
+ * A prefetch is polluting if the line it evicted misses later; victims
+ * are remembered in a direct-mapped table of POLLUTION_ENTRIES blocks,
+ * so one can be forgotten early when two collide.
+ */
+
+/* one region of the stride table */
+typedef struct {
+    unsigned long region; /* region number + 1; 0 marks an empty entry */
+    unsigned long last;   /* last address accessed in the region */
+    long delta;           /* last minus the address before it */
+} stride_entry_t;
+
+/* one stream tracker */
+typedef struct {
+    bool valid;
+    unsigned long last; /* block of the last step */
+    int dir;            /* direction of the last step, 0 before one */
+    bool confirmed;     /* the last two steps went the same way */
+    uint64_t used;      /* clock of the last step, for replacement */
+} stream_entry_t;
+
+struct prefetcher {
+    prefetch_t kind;
+    unsigned long degree; /* blocks per prefetch */
+    uint64_t clock;       /* demand accesses so far */
+    stride_entry_t stride[STRIDE_ENTRIES];
+    stream_entry_t stream[STREAM_ENTRIES];
+    unsigned long victim[POLLUTION_ENTRIES]; /* block + 1, or 0 */
+};
+
+/**
+ * @brief Create a prefetcher of the given kind with empty tables.
+ */
+prefetcher_t *prefetcher_new(prefetch_t kind, unsigned long degree) {
+    prefetcher_t *pf = (prefetcher_t *)calloc(1, sizeof(prefetcher_t));
+    if (pf == NULL) {
+        printf("failed to allocate the prefetcher\n");
+        exit(1);
+    }
+    pf->kind = kind;
+    pf->degree = degree;
+    return pf;
+}
+
+/**
+ * @brief Free a prefetcher made by prefetcher_new().
+ */
+int prefetcher_free(prefetcher_t *pf) {
+    free(pf);
+    return 0;
+}
+
+/**
+ * @brief Account for a demand hit on line idx: if the line was
+ *        prefetched and not used since, count it as useful or late.
+ * @return true if the prefetch was late and the hit counts as a miss
+ */
+bool prefetch_hit(Cache *cache, int idx, unsigned long set_bits) {
+    uint64_t *mark = set_pf_mark(cache, set_bits);
+    uint64_t bit = 1ULL << (idx % WORD_WAYS);
+    if ((mark[idx / WORD_WAYS] & bit) == 0) {
+        return false;
+    }
+    mark[idx / WORD_WAYS] &= ~bit;
+    if (cache->pf->clock - set_pf_time(cache, set_bits)[idx] <
+        PREFETCH_LATENCY) {
+        cache->stats.pf_late++;
+        return true;
+    }
+    cache->stats.pf_useful++;
+    return false;
+}
+
+/**
+ * @brief Fill a block into the cache for the prefetcher, unless it is
+ *        already there.
+ *
+ * Its victim is not a demand eviction: it counts in pf_evictions, not in
+ * evictions or dirty_evictions, though a dirty victim is still written
+ * back to memory.
+ * @param block the block to fetch, address >> b
+ */
+static void prefetch_fill(Cache *cache, unsigned long block) {
+    prefetcher_t *pf = cache->pf;
+    unsigned long set_bits = block & (cache->S - 1);
+    unsigned long tag_bits = block >> cache->s;
+    if (find_line(cache, set_bits, tag_bits) >= 0) {
+        return;
+    }
+    if (cache->verbose)
+        printf("Prefetch\n");
+    int idx = find_victim(cache, set_bits);
+    uint64_t bit = 1ULL << (idx % WORD_WAYS);
+    if (set_valid(cache, set_bits)[idx / WORD_WAYS] & bit) {
+        unsigned long victim =
+            set_tag(cache, set_bits)[idx] << cache->s | set_bits;
+        pf->victim[victim % POLLUTION_ENTRIES] = victim + 1;
+        cache->stats.pf_evictions++;
+        write_back(cache, idx, set_bits);
+    }
+    update_bits(cache, idx, set_bits, tag_bits);
+    policy_fill(cache, idx, set_bits);
+    fill_traffic(cache, block);
+    set_pf_mark(cache, set_bits)[idx / WORD_WAYS] |= bit;
+    set_pf_time(cache, set_bits)[idx] = pf->clock;
+    if (pf->victim[block % POLLUTION_ENTRIES] == block + 1) {
+        pf->victim[block % POLLUTION_ENTRIES] = 0;
+    }
+    cache->stats.pf_issued++;
+}
+
+/**
+ * @brief Prefetch the degree blocks from block + step on, step blocks
+ *        apart.
+ */
+static void prefetch_ahead(Cache *cache, unsigned long block, long step) {
+    unsigned long k;
+    for (k = 1; k <= cache->pf->degree; k++) {
+        prefetch_fill(cache, block + (unsigned long)((long)k * step));
+    }
+}
+
+/**
+ * @brief Train the stride table on an access and prefetch along a
+ *        repeated delta.
+ */
+static void stride_train(Cache *cache, unsigned long address) {
+    unsigned long region = address >> STRIDE_REGION;
+    stride_entry_t *e = &cache->pf->stride[region % STRIDE_ENTRIES];
+    if (e->region != region + 1) {
+        e->region = region + 1;
+        e->last = address;
+        e->delta = 0;
+        return;
+    }
+    long delta = (long)(address - e->last);
+    if (delta == 0) {
+        return;
+    }
+    bool repeated = delta == e->delta;
+    e->delta = delta;
+    e->last = address;
+    if (!repeated) {
+        return;
+    }
+    /* a delta under a block would only prefetch the block itself */
+    long step = delta;
+    if (step > -(long)cache->B && step < (long)cache->B) {
+        step = step > 0 ? (long)cache->B : -(long)cache->B;
+    }
+    unsigned long k;
+    for (k = 1; k <= cache->pf->degree; k++) {
+        prefetch_fill(cache,
+                      (address + (unsigned long)((long)k * step)) >> cache->b);
+    }
+}
+
+/**
+ * @brief Move the stream tracking block, or start a new one, and
+ *        prefetch ahead of a confirmed stream.
+ */
+static void stream_train(Cache *cache, unsigned long block) {
+    prefetcher_t *pf = cache->pf;
+    stream_entry_t *e = NULL;
+    int i;
+    for (i = 0; i < STREAM_ENTRIES; i++) {
+        stream_entry_t *t = &pf->stream[i];
+        if (!t->valid) {
+            continue;
+        }
+        if (t->last == block) {
+            return;
+        }
+        if (block - t->last <= STREAM_WINDOW ||
+            t->last - block <= STREAM_WINDOW) {
+            e = t;
+            break;
+        }
+    }
+    if (e == NULL) {
+        /* replace the tracker that stepped least recently */
+        e = &pf->stream[0];
+        for (i = 1; i < STREAM_ENTRIES && e->valid; i++) {
+            if (!pf->stream[i].valid || pf->stream[i].used < e->used) {
+                e = &pf->stream[i];
+            }
+        }
+        e->valid = true;
+        e->last = block;
+        e->dir = 0;
+        e->confirmed = false;
+        e->used = pf->clock;
+        return;
+    }
+    int dir = block > e->last ? 1 : -1;
+    e->confirmed = dir == e->dir;
+    e->dir = dir;
+    e->last = block;
+    e->used = pf->clock;
+    if (e->confirmed) {
+        prefetch_ahead(cache, block, dir);
+    }
+}
+
+/**
+ * @brief Let the prefetcher see one demand access, after the cache has.
+ * @param missed the access missed, or waited for a late prefetch
+ * @param first_use the access was the first use of a prefetched line
+ */
+int prefetch_train(Cache *cache, unsigned long address, bool missed,
+                   bool first_use) {
+    prefetcher_t *pf = cache->pf;
+    unsigned long block = address >> cache->b;
+    pf->clock++;
+    if (missed && pf->victim[block % POLLUTION_ENTRIES] == block + 1) {
+        pf->victim[block % POLLUTION_ENTRIES] = 0;
+        cache->stats.pf_polluting++;
+    }
+    switch (pf->kind) {
+    case PREFETCH_NEXT:
+        if (missed || first_use) {
+            prefetch_ahead(cache, block, 1);
+        }
+        break;
+    case PREFETCH_STRIDE:
+        stride_train(cache, address);
+        break;
+    case PREFETCH_STREAM:
+        if (missed || first_use) {
+            stream_train(cache, block);
+        }
+        break;
+    default:
+        break;
+    }
+    return 0;
+}
+
+/*
+ * Statistical sampling (-S, -T)
+ *
+ * Set sampling simulates only 1 in -S sets, chosen by sample_index(), and
+ * scales the counts up by -S. Sets are independent of each other, so the
+ * sampled sets see exactly the accesses, and give exactly the counts,
+ * they would in a full run. They are dealt into SAMPLE_GROUPS groups,
+ * and the spread of the group counts gives the confidence interval. Each
+ * batch is sorted by group before it is simulated, so the runs and
+ * kernels still apply and the cost falls with the share of sets kept.
+ *
+ * Time sampling splits the trace into periods of -T accesses and only
+ * measures the last `detail` accesses of each. The `warm` accesses before
+ * them are simulated without being counted, to bring the cache back to a
+ * realistic state, and the rest of the period is skipped. Each window's
+ * counts are one sample of the trace's rate, and the estimate is their
+ * mean times the trace length.
+ *
+ * Either way the intervals are 95% confidence intervals under a normal
+ * approximation, treating the groups or windows as independent samples.
+ * They only describe the sets or windows that were simulated: a trace
+ * whose hits crowd into a few hot sets, such as a stack, can miss them
+ * all with few sampled sets and still report a tight interval.
+ */
+
+struct sample {
+    unsigned long sets;   /* sampled sets, S / -S */
+    unsigned long groups; /* SAMPLE_GROUPS, or sets if fewer */
+    /* hits, misses and evictions of each group */
+    unsigned long count[SAMPLE_GROUPS][3];
+};
+
+/* -T windows finished, and the counters of each cache at the start of
+ * the current one and summed over the finished ones */
+unsigned long windows = 0;
+csim_stats_t window_start[MAX_CACHES];
+csim_stats_t window_sum[MAX_CACHES];
+double window_sq[MAX_CACHES][3]; /* sums of squared hits, misses, evicts */
+
+/**
+ * @brief Set up 1-in-n set sampling for a cache.
+ */
+sample_t *sample_new(const Cache *cache, unsigned long n) {
+    sample_t *sample = (sample_t *)calloc(1, sizeof(sample_t));
+    if (sample == NULL) {
+        printf("failed to allocate the set sample\n");
+        exit(1);
+    }
+    sample->sets = cache->S / n;
+    sample->groups =
+        sample->sets < SAMPLE_GROUPS ? sample->sets : SAMPLE_GROUPS;
+    return sample;
+}
+
+/**
+ * @brief Free a sample made by sample_new().
+ */
+int sample_free(sample_t *sample) {
+    free(sample);
+    return 0;
+}
+
+/**
+ * @brief Scramble a set number into its rank for sampling: a permutation
+ *        of [0, S), so exactly the sets ranked below S / n are sampled.
+ *        Multiplying by an odd number and a xorshift within s bits are
+ *        both invertible; together they spread the sampled sets out.
+ */
+static inline unsigned long sample_index(const Cache *cache,
+                                         unsigned long set) {
+    unsigned long h = (set * 0x9e3779b97f4a7c15UL) & (cache->S - 1);
+    return h ^ (h >> ((cache->s + 1) / 2));
+}
+
+/**
+ * @brief Simulate the accesses of acc[0..n) that fall in sampled sets,
+ *        group by group, and count what each group did.
+ * @param scratch space for n accesses
+ * @param run scratch space for n runs
+ */
+int simulate_sampled(Cache *cache, const access_t *acc, int n,
+                     access_t *scratch, run_t *run) {
+    sample_t *sample = cache->sample;
+    unsigned char group[BATCH_SIZE];
+    int start[SAMPLE_GROUPS + 1] = {0};
+    unsigned long g;
+    int i;
+    for (i = 0; i < n; i++) {
+        unsigned long set = (acc[i].address >> cache->b) & (cache->S - 1);
+        unsigned long index = sample_index(cache, set);
+        group[i] = SAMPLE_GROUPS;
+        if (index < sample->sets && (acc[i].op == 'L' || acc[i].op == 'S')) {
+            group[i] = (unsigned char)(index % sample->groups);
+            start[group[i] + 1]++;
+        }
+    }
+    for (g = 0; g < sample->groups; g++) {
+        start[g + 1] += start[g];
+    }
+    /* deal the accesses out, in trace order within each group */
+    int fill[SAMPLE_GROUPS];
+    memcpy(fill, start, sizeof(fill));
+    for (i = 0; i < n; i++) {
+        if (group[i] < SAMPLE_GROUPS) {
+            scratch[fill[group[i]]++] = acc[i];
+        }
+    }
+    for (g = 0; g < sample->groups; g++) {
+        csim_stats_t before = cache->stats;
+        simulate_records(cache, scratch + start[g], start[g + 1] - start[g],
+                         run);
+        sample->count[g][0] += cache->stats.hits - before.hits;
+        sample->count[g][1] += cache->stats.misses - before.misses;
+        sample->count[g][2] += cache->stats.evictions - before.evictions;
+    }
+    return 0;
+}
+
+/**
+ * @brief Place one access in its -T period, opening the window if the
+ *        access is its first.
+ * @return true if the access falls before the warm-up and is skipped
+ */
+bool window_skip(char op) {
+    int c;
+    if (op != 'L' && op != 'S') {
+        return true;
+    }
+    sample_accesses++;
+    window_pos = window_pos % sample_period + 1;
+    if (window_pos <= sample_period - sample_detail - sample_warm) {
+        return true;
+    }
+    if (window_pos == sample_period - sample_detail + 1) {
+        if (batch_len > 0) {
+            run_batch();
+        }
+        for (c = 0; c < num_caches; c++) {
+            window_start[c] = current_stats(c);
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Close the -T window after its last access is queued, adding
+ *        what each cache did in it to the window sums.
+ */
+int window_close(void) {
+    int c;
+    run_batch();
+    for (c = 0; c < num_caches; c++) {
+        csim_stats_t now = current_stats(c);
+        csim_stats_t *last = &window_start[c];
+        csim_stats_t *sum = &window_sum[c];
+        double d[3] = {(double)(now.hits - last->hits),
+                       (double)(now.misses - last->misses),
+                       (double)(now.evictions - last->evictions)};
+        sum->hits += now.hits - last->hits;
+        sum->misses += now.misses - last->misses;
+        sum->evictions += now.evictions - last->evictions;
+        sum->dirty_evictions += now.dirty_evictions - last->dirty_evictions;
+        sum->mem_read_bytes += now.mem_read_bytes - last->mem_read_bytes;
+        sum->mem_write_bytes += now.mem_write_bytes - last->mem_write_bytes;
+        sum->pf_issued += now.pf_issued - last->pf_issued;
+        sum->pf_useful += now.pf_useful - last->pf_useful;
+        sum->pf_late += now.pf_late - last->pf_late;
+        sum->pf_polluting += now.pf_polluting - last->pf_polluting;
+        sum->pf_evictions += now.pf_evictions - last->pf_evictions;
+        window_sq[c][0] += d[0] * d[0];
+        window_sq[c][1] += d[1] * d[1];
+        window_sq[c][2] += d[2] * d[2];
+    }
+    windows++;
+    return 0;
+}
+
+/* round a scaled count to the nearest integer */
+static unsigned long scale(unsigned long count, double factor) {
+    return (unsigned long)((double)count * factor + 0.5);
+}
+
+/**
+ * Description:
+ *     Replace the counters of cache c with estimates for the whole trace,
+ *     and set ci to the 95% confidence half-widths of its hits, misses
+ *     and evictions. Under -T, dirty_bytes stays what the cache holds at
+ *     the end.
+ * @return the number of samples the estimate rests on
+ */
+unsigned long extrapolate(int c, double ci[3]) {
+    Cache *cache = caches[c];
+    csim_stats_t *stats = &cache->stats;
+    csim_stats_t base = *stats;
+    double factor, sum[3] = {0, 0, 0}, sq[3] = {0, 0, 0};
+    unsigned long k, g;
+    int f;
+    if (cache->sample != NULL) {
+        const sample_t *sample = cache->sample;
+        factor = (double)cache->S / (double)sample->sets;
+        k = sample->groups;
+        for (g = 0; g < k; g++) {
+            for (f = 0; f < 3; f++) {
+                double x = (double)sample->count[g][f];
+                sum[f] += x;
+                sq[f] += x * x;
+            }
+        }
+        stats->dirty_bytes = scale(base.dirty_bytes, factor);
+    } else {
+        if (windows == 0) {
+            printf("the trace ended before the first -T window\n");
+            exit(1);
+        }
+        base = window_sum[c];
+        factor = (double)sample_accesses /
+                 ((double)windows * (double)sample_detail);
+        k = windows;
+        sum[0] = (double)base.hits;
+        sum[1] = (double)base.misses;
+        sum[2] = (double)base.evictions;
+        for (f = 0; f < 3; f++) {
+            sq[f] = window_sq[c][f];
+        }
+    }
+    stats->hits = scale(base.hits, factor);
+    stats->misses = scale(base.misses, factor);
+    stats->evictions = scale(base.evictions, factor);
+    stats->dirty_evictions = scale(base.dirty_evictions, factor);
+    stats->mem_read_bytes = scale(base.mem_read_bytes, factor);
+    stats->mem_write_bytes = scale(base.mem_write_bytes, factor);
+    stats->pf_issued = scale(base.pf_issued, factor);
+    stats->pf_useful = scale(base.pf_useful, factor);
+    stats->pf_late = scale(base.pf_late, factor);
+    stats->pf_polluting = scale(base.pf_polluting, factor);
+    stats->pf_evictions = scale(base.pf_evictions, factor);
+    for (f = 0; f < 3; f++) {
+        double var = k > 1 ? (sq[f] - sum[f] * sum[f] / (double)k) /
+                                 (double)(k - 1)
+                           : 0;
+        ci[f] = 1.96 * factor * sqrt((double)k * (var > 0 ? var : 0));
+    }
+    return k;
+}
+
+/*
+ * 3C miss classification (-c)
+ *
+ * Every cache gets a shadow: a fully associative LRU cache with the same
+ * number of lines, and the set of blocks the trace has touched. A miss in
+ * the real cache is compulsory if its block was never touched before,
+ * a capacity miss if the shadow misses too, and a conflict miss if the
+ * shadow hits, i.e. only the set mapping lost the block.
+ *
+ * Both live in one open-addressing hash table keyed by block number:
+ * a block is in the table once touched, and its entry points at its node
+ * in the shadow's LRU list while it is resident, or holds SHADOW_NIL once
+ * the shadow has evicted it. The table doubles as it fills, and nodes are
+ * allocated as blocks arrive, so memory follows the trace footprint.
+ */
+
+#define SHADOW_NIL UINT32_MAX
+
+/* one touched block */
+typedef struct {
+    unsigned long block; /* block number + 1; 0 marks an empty slot */
+    uint32_t node;       /* its shadow LRU node, or SHADOW_NIL */
+} shadow_entry_t;
+
+struct shadow {
+    int b;                    /* log2 of the block size */
+    unsigned long lines;      /* capacity of the shadow, S * E */
+    shadow_entry_t *table;    /* touched blocks */
+    unsigned long table_mask; /* table size - 1 */
+    unsigned long touched;    /* blocks in table */
+    unsigned long *block;     /* block number of each node */
+    uint32_t *prev, *next;    /* LRU list, head is most recent */
+    uint32_t head, tail;
+    unsigned long num_nodes; /* nodes allocated so far */
+    unsigned long cap_nodes; /* nodes the arrays have room for */
+    unsigned long compulsory, capacity, conflict;
+};
+
+/**
+ * @brief Create the shadow of a cache for -c.
+ */
+shadow_t *shadow_new(const Cache *cache) {
+    shadow_t *shadow = (shadow_t *)calloc(1, sizeof(shadow_t));
+    if (shadow == NULL) {
+        printf("failed to allocate the shadow cache\n");
+        exit(1);
+    }
+    shadow->b = cache->b;
+    shadow->lines = cache->S * cache->E;
+    if (shadow->lines >= SHADOW_NIL) {
+        printf("-c needs fewer than %lu lines\n", (unsigned long)SHADOW_NIL);
+        exit(1);
+    }
+    shadow->table_mask = 1023;
+    shadow->table = (shadow_entry_t *)calloc(shadow->table_mask + 1,
+                                             sizeof(shadow_entry_t));
+    if (shadow->table == NULL) {
+        printf("failed to allocate the shadow cache\n");
+        exit(1);
+    }
+    shadow->head = shadow->tail = SHADOW_NIL;
+    return shadow;
+}
+
+/**
+ * @brief Free a shadow made by shadow_new().
+ */
+int shadow_free(shadow_t *shadow) {
+    free(shadow->table);
+    free(shadow->block);
+    free(shadow->prev);
+    free(shadow->next);
+    free(shadow);
+    return 0;
+}
+
+/**
+ * @brief Print the compulsory, capacity and conflict miss counts.
+ * @param label prefix naming the cache, or NULL
+ */
+int shadow_print(const shadow_t *shadow, const char *label) {
+    if (label != NULL) {
+        printf("%s ", label);
+    }
+    printf("compulsory:%lu capacity:%lu conflict:%lu\n", shadow->compulsory,
+           shadow->capacity, shadow->conflict);
+    return 0;
+}
+
+/** @brief The table slot of a block, or the empty slot it belongs in. */
+static shadow_entry_t *shadow_lookup(shadow_t *shadow, unsigned long block) {
+    unsigned long i =
+        (unsigned long)((block * 0x9e3779b97f4a7c15ULL) >> 17) &
+        shadow->table_mask;
+    while (shadow->table[i].block != 0 && shadow->table[i].block != block + 1) {
+        i = (i + 1) & shadow->table_mask;
+    }
+    return &shadow->table[i];
+}
+
+/** @brief Double the table once it is half full. */
+static void shadow_grow_table(shadow_t *shadow) {
+    shadow_entry_t *old = shadow->table;
+    unsigned long n = shadow->table_mask + 1;
+    unsigned long i;
+    shadow->table_mask = 2 * n - 1;
+    shadow->table = (shadow_entry_t *)calloc(2 * n, sizeof(shadow_entry_t));
+    if (shadow->table == NULL) {
+        printf("failed to grow the shadow cache\n");
+        exit(1);
+    }
+    for (i = 0; i < n; i++) {
+        if (old[i].block != 0) {
+            *shadow_lookup(shadow, old[i].block - 1) = old[i];
+        }
+    }
+    free(old);
+}
+
+/** @brief Take a node off the LRU list. */
+static void shadow_unlink(shadow_t *shadow, uint32_t node) {
+    if (shadow->prev[node] == SHADOW_NIL) {
+        shadow->head = shadow->next[node];
+    } else {
+        shadow->next[shadow->prev[node]] = shadow->next[node];
+    }
+    if (shadow->next[node] == SHADOW_NIL) {
+        shadow->tail = shadow->prev[node];
+    } else {
+        shadow->prev[shadow->next[node]] = shadow->prev[node];
+    }
+}
+
+/** @brief Put a node at the front of the LRU list. */
+static void shadow_push(shadow_t *shadow, uint32_t node) {
+    shadow->prev[node] = SHADOW_NIL;
+    shadow->next[node] = shadow->head;
+    if (shadow->head == SHADOW_NIL) {
+        shadow->tail = node;
+    } else {
+        shadow->prev[shadow->head] = node;
+    }
+    shadow->head = node;
+}
+
+/** @brief A node for a new resident block: a fresh one, or the LRU one. */
+static uint32_t shadow_node(shadow_t *shadow) {
+    if (shadow->num_nodes == shadow->lines) {
+        uint32_t node = shadow->tail;
+        shadow_unlink(shadow, node);
+        shadow_lookup(shadow, shadow->block[node])->node = SHADOW_NIL;
+        return node;
+    }
+    if (shadow->num_nodes == shadow->cap_nodes) {
+        unsigned long cap = 2 * shadow->cap_nodes;
+        if (cap == 0) {
+            cap = 1024;
+        }
+        if (cap > shadow->lines) {
+            cap = shadow->lines;
+        }
+        shadow->block = (unsigned long *)realloc(shadow->block,
+                                                 cap * sizeof(unsigned long));
+        shadow->prev =
+            (uint32_t *)realloc(shadow->prev, cap * sizeof(uint32_t));
+        shadow->next =
+            (uint32_t *)realloc(shadow->next, cap * sizeof(uint32_t));
+        if (shadow->block == NULL || shadow->prev == NULL ||
+            shadow->next == NULL) {
+            printf("failed to grow the shadow cache\n");
+            exit(1);
+        }
+        shadow->cap_nodes = cap;
+    }
+    return (uint32_t)shadow->num_nodes++;
+}
+
+/**
+ * @brief Run one access through a cache's shadow and classify it.
+ * @param missed whether the real cache missed
+ * @param address the memory address accessed
+ */
+int shadow_access(shadow_t *shadow, bool missed, unsigned long address) {
+    unsigned long block = address >> shadow->b;
+    shadow_entry_t *entry = shadow_lookup(shadow, block);
+
+    if (entry->block == 0) {
+        /* first touch: compulsory, whatever the cache did */
+        shadow->compulsory += missed;
+        uint32_t node = shadow_node(shadow);
+        entry = shadow_lookup(shadow, block);
+        entry->block = block + 1;
+        entry->node = node;
+        shadow->block[node] = block;
+        shadow_push(shadow, node);
+        if (2 * ++shadow->touched > shadow->table_mask) {
+            shadow_grow_table(shadow);
+        }
+        return 0;
+    }
+
+    if (entry->node != SHADOW_NIL) {
+        shadow->conflict += missed;
+        shadow_unlink(shadow, entry->node);
+        shadow_push(shadow, entry->node);
+        return 0;
+    }
+
+    shadow->capacity += missed;
+    uint32_t node = shadow_node(shadow);
+    entry = shadow_lookup(shadow, block);
+    entry->node = node;
+    shadow->block[node] = block;
+    shadow_push(shadow, node);
+    return 0;
+}
+
+/*
+ * Cache hierarchy (-L)
+ *
+ * With -L, caches[0] is L1 and each -L adds the next level below it. A
+ * demand access looks the block up level by level, counting a hit or a
+ * miss at each level it reaches, and is then filled into the levels that
+ * missed. Every level uses the same block size, and the per-level
+ * statistics count demand accesses, evictions, and dirty lines written
+ * out of that level (to the next level, or to memory from the last one).
+ *
+ * NINE (non-inclusive non-exclusive) fills every level that missed and
+ * leaves the others alone. Inclusive also fills every level that missed,
+ * and a line evicted from a lower level is invalidated in the levels above
+ * it, so they never hold a block the level below lacks. Exclusive keeps a
+ * block in one level only: it moves up to L1 on a hit, is filled only
+ * into L1 on a miss, and every line a level evicts moves down one level,
+ * so the lower levels act as victim caches.
+ *
+ * Caches are write-back at every level: a dirty line evicted from one
+ * level is written into the next, which allocates it if it is not there.
+ */
+
+/* a line pushed out of a level by a fill */
+typedef struct {
+    unsigned long block; /* block number, address >> b */
+    bool valid;          /* a line was evicted at all */
+    bool dirty;          /* it holds data the next level lacks */
+} victim_t;
+
+/**
+ * @brief Find a block in one level of the hierarchy.
+ * @return the way holding the block, or -1
+ */
+static long level_find(Cache *cache, unsigned long block) {
+    return find_line(cache, block & (cache->S - 1), block >> cache->s);
+}
+
+/**
+ * @brief Mark a resident line dirty.
+ */
+static void level_set_dirty(Cache *cache, unsigned long block, long way) {
+    uint64_t *dirty = set_dirty(cache, block & (cache->S - 1));
+    uint64_t bit = 1ULL << (way % WORD_WAYS);
+    if ((dirty[way / WORD_WAYS] & bit) == 0) {
+        dirty[way / WORD_WAYS] |= bit;
+        cache->stats.dirty_bytes++;
+    }
+}
+
+/**
+ * @brief Drop a block from one level, if it is there.
+ * @return true if the dropped line was dirty
+ */
+static bool level_invalidate(Cache *cache, unsigned long block) {
+    unsigned long set = block & (cache->S - 1);
+    long way = level_find(cache, block);
+    if (way < 0) {
+        return false;
+    }
+    uint64_t bit = 1ULL << (way % WORD_WAYS);
+    uint64_t *valid = set_valid(cache, set) + way / WORD_WAYS;
+    uint64_t *dirty = set_dirty(cache, set) + way / WORD_WAYS;
+    *valid &= ~bit;
+    if (*dirty & bit) {
+        *dirty &= ~bit;
+        cache->stats.dirty_bytes--;
+        return true;
+    }
+    return false;
+}
+
+/**
+ * @brief Fill a block into one level, reporting the line it replaced.
+ *
+ * Lines invalidated by the inclusion policy are reused before the
+ * replacement policy is asked for a victim.
+ */
+static void level_fill(Cache *cache, unsigned long block, bool dirty,
+                       victim_t *victim) {
+    unsigned long set = block & (cache->S - 1);
+    int way = find_invalid(cache, set);
+    if (way < 0) {
+        way = find_victim(cache, set);
+    }
+    uint64_t bit = 1ULL << (way % WORD_WAYS);
+    unsigned long word = (unsigned long)way / WORD_WAYS;
+    victim->valid = (set_valid(cache, set)[word] & bit) != 0;
+    victim->dirty = victim->valid && (set_dirty(cache, set)[word] & bit) != 0;
+    victim->block = set_tag(cache, set)[way] << cache->s | set;
+
+    eviction_effect(cache, way, set);
+    update_bits(cache, way, set, block >> cache->s);
+    policy_fill(cache, way, set);
+    if (dirty) {
+        level_set_dirty(cache, block, way);
+    }
+}
+
+/**
+ * @brief Fill a block into level lvl and send its victim down.
+ */
+static void level_insert(int lvl, unsigned long block, bool dirty) {
+    victim_t victim;
     int i;
-    for (i = 0; i < (cache->S); i++) {
-        free(cache->set[i]); /* free cache line */
+
+    level_fill(caches[lvl], block, dirty, &victim);
+    if (!victim.valid) {
+        return;
+    }
+    if (inclusion == INCLUSION_INCLUSIVE) {
+        /* back-invalidate; dirty data above leaves with the victim */
+        bool upper_dirty = false;
+        for (i = 0; i < lvl; i++) {
+            upper_dirty |= level_invalidate(caches[i], victim.block);
+        }
+        if (upper_dirty && !victim.dirty) {
+            caches[lvl]->stats.dirty_evictions++;
+            caches[lvl]->stats.mem_write_bytes += caches[lvl]->B;
+            victim.dirty = true;
+        }
+    }
+    if (lvl + 1 == num_caches) {
+        return; /* written back to memory */
+    }
+    if (inclusion == INCLUSION_EXCLUSIVE) {
+        level_insert(lvl + 1, victim.block, victim.dirty);
+    } else if (victim.dirty) {
+        long way = level_find(caches[lvl + 1], victim.block);
+        if (way >= 0) {
+            level_set_dirty(caches[lvl + 1], victim.block, way);
+        } else {
+            level_insert(lvl + 1, victim.block, true);
+        }
+    }
+}
+
+/**
+ * @brief Run one access through the -L hierarchy.
+ * @param op operation identifier from the trace, 'L' or 'S'
+ * @param address the memory address accessed
+ */
+int hierarchy_access(char op, unsigned long address) {
+    unsigned long block = address >> caches[0]->b;
+    bool dirty = op == 'S';
+    int lvl, i;
+    long way = -1;
+
+    if (op != 'L' && op != 'S') {
+        return 0;
+    }
+    for (lvl = 0; lvl < num_caches; lvl++) {
+        Cache *cache = caches[lvl];
+        way = level_find(cache, block);
+        if (way >= 0) {
+            cache->stats.hits++;
+            policy_hit(cache, (int)way, block & (cache->S - 1));
+            break;
+        }
+        cache->stats.misses++;
+        cache->stats.mem_read_bytes += cache->B; /* from the level below */
+    }
+
+    if (lvl == 0) {
+        if (dirty) {
+            level_set_dirty(caches[0], block, way);
+        }
+    } else if (inclusion == INCLUSION_EXCLUSIVE) {
+        /* the block moves up to L1, taking its dirty state along */
+        if (lvl < num_caches && level_invalidate(caches[lvl], block)) {
+            dirty = true;
+        }
+        level_insert(0, block, dirty);
+    } else {
+        /* fill the levels that missed, from the bottom up */
+        for (i = lvl - 1; i >= 0; i--) {
+            level_insert(i, block, i == 0 && dirty);
+        }
+    }
+    return 0;
+}
+
+/*
+ * Stack-distance mode (-m)
+ *
+ * For LRU the contents of an E-way set are always the E most recently used
+ * blocks of that set, so one pass that records each access's stack
+ * distance (the number of distinct blocks of the same set used since the
+ * last access to this block) gives the result for every associativity:
+ * the access hits in an E-way cache iff its distance is below E.
+ *
+ * Following Bennett-Kruskal and Olken, each set keeps a treap of its
+ * blocks keyed by their last access time, with subtree sizes. The distance
+ * of an access is the number of keys above the block's previous time,
+ * which is an O(log n) walk, after which the block is re-keyed with the
+ * current time. A hash table maps each block to its last time.
+ *
+ * Dirty state is tracked with one value per block, dirty_depth: the
+ * smallest associativity minus one in which the block is currently dirty
+ * (stack.emax if it is clean in all of them). A store makes it 0 and every
+ * access raises it to at least its distance, since a distance of d means
+ * the block was evicted and refilled clean in every cache with E <= d.
+ * Every store to a clean copy is later a dirty eviction unless the line
+ * is still in the cache at the end, which gives the dirty evictions.
+ */
+
+/* one block: a treap node keyed by last access time, and its table entry */
+typedef struct {
+    uint64_t time;        /* time of the last access to the block */
+    unsigned long block;  /* block number, address >> b */
+    uint32_t left, right; /* treap children, 0 for none */
+    uint32_t size;        /* nodes in this subtree */
+    uint32_t prio;        /* treap heap priority */
+    uint32_t dirty_depth; /* dirty in every cache with E > dirty_depth */
+} stack_node_t;
+
+struct {
+    int s, b;
+    uint32_t emax;          /* largest associativity reported */
+    uint64_t time;          /* accesses so far */
+    uint64_t rng;           /* treap priority generator */
+    stack_node_t *node;     /* node pool; node 0 is the empty tree */
+    uint32_t num_nodes;     /* nodes in use, including node 0 */
+    uint32_t cap_nodes;     /* nodes allocated */
+    uint32_t *root;         /* treap root of each set */
+    uint32_t *table;        /* open-addressing block -> node index */
+    unsigned long table_mask;
+    unsigned long *hist;    /* hist[d]: accesses at distance d < emax */
+    unsigned long far;      /* accesses at distance >= emax, or cold */
+    long *dirty_store_diff; /* stores to clean lines, differenced over E */
+} stack;
+
+/**
+ * @brief Set up stack-distance mode for sets of 2^s and blocks of 2^b.
+ * @param emax report associativities 1..emax
+ */
+int stack_init(int s, int b, int emax) {
+    stack.s = s;
+    stack.b = b;
+    stack.emax = (uint32_t)emax;
+    stack.rng = 0x9e3779b97f4a7c15ULL;
+    stack.cap_nodes = 1024;
+    stack.num_nodes = 1;
+    stack.node = (stack_node_t *)calloc(stack.cap_nodes, sizeof(stack_node_t));
+    stack.root = (uint32_t *)calloc(1UL << s, sizeof(uint32_t));
+    stack.table_mask = 2047;
+    stack.table = (uint32_t *)calloc(stack.table_mask + 1, sizeof(uint32_t));
+    stack.hist = (unsigned long *)calloc((size_t)emax, sizeof(unsigned long));
+    stack.dirty_store_diff = (long *)calloc((size_t)emax + 2, sizeof(long));
+    if (stack.node == NULL || stack.root == NULL || stack.table == NULL ||
+        stack.hist == NULL || stack.dirty_store_diff == NULL) {
+        printf("failed to allocate the stack-distance tables\n");
+        exit(1);
+    }
+    return 0;
+}
+
+/** @brief Hash slot of a block number. */
+static unsigned long stack_slot(unsigned long block) {
+    return (unsigned long)((block * 0x9e3779b97f4a7c15ULL) >> 20) &
+           stack.table_mask;
+}
+
+/** @brief Find a block's node, or the empty slot it would go in. */
+static uint32_t *stack_lookup(unsigned long block) {
+    unsigned long i = stack_slot(block);
+    while (stack.table[i] != 0 && stack.node[stack.table[i]].block != block) {
+        i = (i + 1) & stack.table_mask;
+    }
+    return &stack.table[i];
+}
+
+/** @brief Double the block table once it is half full. */
+static void stack_grow_table(void) {
+    uint32_t *old = stack.table;
+    unsigned long n = stack.table_mask + 1;
+    unsigned long i;
+    stack.table_mask = 2 * n - 1;
+    stack.table = (uint32_t *)calloc(2 * n, sizeof(uint32_t));
+    if (stack.table == NULL) {
+        printf("failed to grow the stack-distance table\n");
+        exit(1);
+    }
+    for (i = 0; i < n; i++) {
+        if (old[i] != 0) {
+            *stack_lookup(stack.node[old[i]].block) = old[i];
+        }
+    }
+    free(old);
+}
+
+static uint32_t tree_size(uint32_t t) {
+    return t == 0 ? 0 : stack.node[t].size;
+}
+
+static void tree_update(uint32_t t) {
+    stack.node[t].size =
+        1 + tree_size(stack.node[t].left) + tree_size(stack.node[t].right);
+}
+
+/** @brief Join two treaps where every key in a is below every key in c. */
+static uint32_t tree_merge(uint32_t a, uint32_t c) {
+    if (a == 0) {
+        return c;
+    }
+    if (c == 0) {
+        return a;
+    }
+    if (stack.node[a].prio > stack.node[c].prio) {
+        stack.node[a].right = tree_merge(stack.node[a].right, c);
+        tree_update(a);
+        return a;
+    }
+    stack.node[c].left = tree_merge(a, stack.node[c].left);
+    tree_update(c);
+    return c;
+}
+
+/** @brief Split a treap into keys below time (*lo) and the rest (*hi). */
+static void tree_split(uint32_t t, uint64_t time, uint32_t *lo, uint32_t *hi) {
+    if (t == 0) {
+        *lo = *hi = 0;
+    } else if (stack.node[t].time < time) {
+        tree_split(stack.node[t].right, time, &stack.node[t].right, hi);
+        tree_update(t);
+        *lo = t;
+    } else {
+        tree_split(stack.node[t].left, time, lo, &stack.node[t].left);
+        tree_update(t);
+        *hi = t;
+    }
+}
+
+/** @brief Count the keys above time. */
+static uint32_t tree_count_after(uint32_t t, uint64_t time) {
+    uint32_t count = 0;
+    while (t != 0) {
+        if (stack.node[t].time > time) {
+            count += 1 + tree_size(stack.node[t].right);
+            t = stack.node[t].left;
+        } else {
+            t = stack.node[t].right;
+        }
+    }
+    return count;
+}
+
+/**
+ * @brief Record one access in stack-distance mode.
+ * @param op operation identifier from the trace, 'L' or 'S'
+ * @param address the memory address accessed
+ */
+int stack_access(char op, unsigned long address) {
+    if (op != 'L' && op != 'S') {
+        return 0;
+    }
+    unsigned long block = address >> stack.b;
+    unsigned long set = stack.s == 0 ? 0 : block & ((1UL << stack.s) - 1);
+    uint32_t *root = &stack.root[set];
+    uint32_t *slot = stack_lookup(block);
+    uint32_t n = *slot;
+    uint32_t dist = stack.emax; /* cold accesses miss at every E */
+
+    if (n != 0) {
+        stack_node_t *x = &stack.node[n];
+        uint32_t d = tree_count_after(*root, x->time);
+        if (d < dist) {
+            dist = d;
+        }
+        /* take the node out; it goes back in below with the new time */
+        uint32_t lo, mid, hi;
+        tree_split(*root, x->time, &lo, &mid);
+        tree_split(mid, x->time + 1, &mid, &hi);
+        *root = tree_merge(lo, hi);
+    } else {
+        if (stack.num_nodes == stack.cap_nodes) {
+            stack.cap_nodes *= 2;
+            stack.node = (stack_node_t *)realloc(
+                stack.node, stack.cap_nodes * sizeof(stack_node_t));
+            if (stack.node == NULL) {
+                printf("failed to grow the stack-distance tree\n");
+                exit(1);
+            }
+        }
+        n = stack.num_nodes++;
+        *slot = n;
+        stack.node[n].block = block;
+        stack.node[n].dirty_depth = stack.emax;
+        stack.rng ^= stack.rng >> 12;
+        stack.rng ^= stack.rng << 25;
+        stack.rng ^= stack.rng >> 27;
+        stack.node[n].prio =
+            (uint32_t)((stack.rng * 0x2545f4914f6cdd1dULL) >> 32);
+        if (2 * (unsigned long)stack.num_nodes > stack.table_mask) {
+            stack_grow_table();
+        }
+    }
+
+    stack_node_t *x = &stack.node[n];
+    if (dist < stack.emax) {
+        stack.hist[dist]++;
+    } else {
+        stack.far++;
+    }
+    if (x->dirty_depth < dist) {
+        x->dirty_depth = dist;
+    }
+    /* a store dirties the block in every E it was clean in; each of
+     * those ends in a dirty eviction unless the block is still there
+     * at the end */
+    if (op == 'S') {
+        stack.dirty_store_diff[1]++;
+        stack.dirty_store_diff[x->dirty_depth + 1]--;
+        x->dirty_depth = 0;
+    }
+
+    /* the block is now the most recently used: the largest key */
+    x->time = stack.time++;
+    x->left = x->right = 0;
+    x->size = 1;
+    *root = tree_merge(*root, n);
+    return 0;
+}
+
+/**
+ * Description:
+ *     Turn the stack-distance histograms into the statistics of every
+ *     associativity 1..emax and print them, one row per E.
+ */
+int stack_report(void) {
+    uint32_t emax = stack.emax;
+    unsigned long B = 1UL << stack.b;
+    unsigned long S = 1UL << stack.s;
+    unsigned long *full = (unsigned long *)calloc(emax + 1, sizeof(long));
+    long *dirty_diff = (long *)calloc(emax + 2, sizeof(long));
+    csim_stats_t *stats = (csim_stats_t *)calloc(emax, sizeof(csim_stats_t));
+    char(*label_buf)[64] = calloc(emax, sizeof(*label_buf));
+    const char **labels = (const char **)calloc(emax, sizeof(char *));
+    unsigned long set;
+    uint32_t n, e;
+
+    if (full == NULL || dirty_diff == NULL || stats == NULL ||
+        label_buf == NULL || labels == NULL) {
+        printf("failed to allocate the stack-distance report\n");
+        exit(1);
+    }
+
+    /* full[k]: sets that saw k distinct blocks (k capped at emax) */
+    for (set = 0; set < S; set++) {
+        uint32_t k = tree_size(stack.root[set]);
+        full[k < emax ? k : emax]++;
+    }
+
+    /* a block is resident and dirty at the end in every cache with E
+     * above both its final stack depth and its dirty depth */
+    for (n = 1; n < stack.num_nodes; n++) {
+        stack_node_t *x = &stack.node[n];
+        unsigned long xset =
+            stack.s == 0 ? 0 : x->block & ((1UL << stack.s) - 1);
+        uint32_t depth = tree_count_after(stack.root[xset], x->time);
+        if (depth < x->dirty_depth) {
+            depth = x->dirty_depth;
+        }
+        if (depth < emax) {
+            dirty_diff[depth + 1]++;
+        }
+    }
+
+    unsigned long total = stack.far;
+    for (e = 0; e < emax; e++) {
+        total += stack.hist[e];
+    }
+
+    unsigned long hits = 0;
+    long dirty_stores = 0;
+    long dirty_lines = 0;
+    for (e = 1; e <= emax; e++) {
+        hits += stack.hist[e - 1];
+        dirty_stores += stack.dirty_store_diff[e];
+        dirty_lines += dirty_diff[e];
+
+        /* misses that found a free line: min(k, E) per set */
+        unsigned long fills = 0;
+        uint32_t k;
+        for (k = 1; k <= emax; k++) {
+            fills += full[k] * (k < e ? k : e);
+        }
+
+        csim_stats_t *st = &stats[e - 1];
+        st->hits = hits;
+        st->misses = total - hits;
+        st->evictions = st->misses - fills;
+        st->dirty_bytes = B * (unsigned long)dirty_lines;
+        st->dirty_evictions = B * (unsigned long)(dirty_stores - dirty_lines);
+        snprintf(label_buf[e - 1], sizeof(label_buf[e - 1]), "s:%d E:%u b:%d",
+                 stack.s, e, stack.b);
+        labels[e - 1] = label_buf[e - 1];
+    }
+
+    printSummaries(stats, labels, emax);
+
+    free(full);
+    free(dirty_diff);
+    free(stats);
+    free(label_buf);
+    free(labels);
+    free(stack.node);
+    free(stack.root);
+    free(stack.table);
+    free(stack.hist);
+    free(stack.dirty_store_diff);
+    return 0;
+}
+
+/*
+ * Checkpoints (-C, -R)
+ *
+ * A checkpoint holds everything a run needs to carry on where another
+ * stopped: the trace position, and for each cache its geometry and
+ * policy, counters, random state and every page of sets the trace has
+ * touched. Pages are written whole, so restoring one is a single read,
+ * and the untouched sets of a large cache cost nothing.
+ *
+ * The file is a checkpoint_header_t, then for each cache a
+ * checkpoint_cache_t followed by its pages, each a 64-bit page number and
+ * the page's arrays. It is written in the machine's own byte order and
+ * layout, so it is only meant to be read back by the same build.
+ *
+ * The trace offset alone cannot tell an appended trace from a different
+ * one, so the checkpoint also keeps a hash of up to CHECKPOINT_TAIL bytes
+ * before it, checked when a run resumes.
+ *
+ * With -C a text trace is only read up to its last '\n'. A line still
+ * being written when the run ends is left for the run that resumes.
+ */
+
+#define CHECKPOINT_MAGIC "CLCK"
+#define CHECKPOINT_VERSION 2
+#define CHECKPOINT_TAIL 4096
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t num_caches;
+    int32_t binary;      /* trace_pos.binary */
+    uint64_t offset;     /* trace_pos.offset */
+    trace_coder_t coder; /* trace_pos.coder */
+    uint64_t tail_hash;  /* trace_tail_hash() at offset, 0 if unknown */
+} checkpoint_header_t;
+
+typedef struct {
+    int32_t s, E, b;
+    int32_t policy;
+    int32_t write_through, no_write_allocate;
+    int32_t page_shift;
+    int32_t pad;
+    uint64_t rng_state;
+    uint64_t pages; /* pages that follow */
+    csim_stats_t stats;
+} checkpoint_cache_t;
+
+/**
+ * @brief FNV-1a hash of the bytes of fd just before pos, or 0 if fd
+ *        cannot be read at an offset (a pipe). The header of a binary
+ *        trace is left out, as its record count changes when the trace
+ *        grows.
+ */
+uint64_t trace_tail_hash(int fd, const trace_pos_t *pos) {
+    unsigned char buf[CHECKPOINT_TAIL];
+    uint64_t first = pos->binary > 0 ? TRACE_HEADER_SIZE : 0;
+    if (pos->offset > first + CHECKPOINT_TAIL) {
+        first = pos->offset - CHECKPOINT_TAIL;
+    }
+    size_t len = pos->offset > first ? (size_t)(pos->offset - first) : 0;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    size_t i;
+    if (pread(fd, buf, len, (off_t)first) != (ssize_t)len) {
+        return 0;
+    }
+    for (i = 0; i < len; i++) {
+        hash = (hash ^ buf[i]) * 0x100000001b3ULL;
+    }
+    return hash | 1; /* never 0 */
+}
+
+/**
+ * Description:
+ *     Save the caches and the trace position to path. The file is
+ *     written next to path and renamed over it, so an interrupted run
+ *     leaves the old checkpoint intact. Must run after stop_workers()
+ *     and before the dirty counts are turned into bytes.
+ */
+int write_checkpoint(const char *path) {
+    size_t tmp_size = strlen(path) + 5;
+    char *tmp = (char *)malloc(tmp_size);
+    int c;
+    if (tmp == NULL) {
+        printf("failed to allocate the checkpoint path\n");
+        exit(1);
+    }
+    snprintf(tmp, tmp_size, "%s.tmp", path);
+    FILE *out = fopen(tmp, "wb");
+    if (out == NULL) {
+        printf("failed to open \"%s\"\n", tmp);
+        exit(1);
+    }
+    checkpoint_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CHECKPOINT_MAGIC, 4);
+    header.version = CHECKPOINT_VERSION;
+    header.num_caches = (uint32_t)num_caches;
+    header.binary = trace_pos.binary;
+    header.offset = trace_pos.offset;
+    header.coder = trace_pos.coder;
+    header.tail_hash = trace_tail;
+    bool ok = fwrite(&header, sizeof(header), 1, out) == 1;
+    for (c = 0; ok && c < num_caches; c++) {
+        Cache *cache = caches[c];
+        unsigned long i;
+        checkpoint_cache_t rec;
+        memset(&rec, 0, sizeof(rec));
+        rec.s = cache->s;
+        rec.E = (int32_t)cache->E;
+        rec.b = cache->b;
+        rec.policy = cache->policy;
+        rec.write_through = cache->write_through;
+        rec.no_write_allocate = cache->no_write_allocate;
+        rec.page_shift = cache->page_shift;
+        rec.rng_state = cache->rng_state;
+        rec.stats = cache->stats;
+        for (i = 0; i < cache->S >> cache->page_shift; i++) {
+            rec.pages += cache->pages[i] != NULL;
+        }
+        ok = fwrite(&rec, sizeof(rec), 1, out) == 1;
+        for (i = 0; ok && i < cache->S >> cache->page_shift; i++) {
+            uint64_t index = i;
+            if (cache->pages[i] == NULL) {
+                continue;
+            }
+            ok = fwrite(&index, sizeof(index), 1, out) == 1 &&
+                 fwrite(cache->pages[i]->tag, page_data_size(cache), 1, out) ==
+                     1;
+        }
+    }
+    if (fclose(out) != 0 || !ok || rename(tmp, path) != 0) {
+        printf("failed to write \"%s\"\n", path);
+        exit(1);
+    }
+    free(tmp);
+    return 0;
+}
+
+/**
+ * Description:
+ *     Restore the caches and the trace position from a checkpoint made
+ *     with the same geometries and policies. Must run after the caches
+ *     are made and before start_workers().
+ */
+int read_checkpoint(const char *path) {
+    FILE *in = fopen(path, "rb");
+    int c;
+    if (in == NULL) {
+        printf("failed to open \"%s\"\n", path);
+        exit(1);
+    }
+    checkpoint_header_t header;
+    if (fread(&header, sizeof(header), 1, in) != 1 ||
+        memcmp(header.magic, CHECKPOINT_MAGIC, 4) != 0 ||
+        header.version != CHECKPOINT_VERSION) {
+        printf("\"%s\" is not a checkpoint\n", path);
+        exit(1);
+    }
+    if (header.num_caches != (uint32_t)num_caches) {
+        printf("the checkpoint has %u caches, not %d\n", header.num_caches,
+               num_caches);
+        exit(1);
+    }
+    trace_pos.binary = header.binary;
+    trace_pos.offset = header.offset;
+    trace_pos.coder = header.coder;
+    trace_tail = header.tail_hash;
+    for (c = 0; c < num_caches; c++) {
+        Cache *cache = caches[c];
+        checkpoint_cache_t rec;
+        uint64_t i;
+        if (fread(&rec, sizeof(rec), 1, in) != 1) {
+            printf("\"%s\" is truncated\n", path);
+            exit(1);
+        }
+        if (rec.s != cache->s || rec.E != (int32_t)cache->E ||
+            rec.b != cache->b || rec.policy != (int32_t)cache->policy ||
+            rec.write_through != cache->write_through ||
+            rec.no_write_allocate != cache->no_write_allocate ||
+            rec.page_shift > cache->s) {
+            printf("the checkpoint was made with another geometry, policy "
+                   "or write policy\n");
+            exit(1);
+        }
+        /* pages are restored whole, so take the checkpoint's page size */
+        if (rec.page_shift != cache->page_shift) {
+            free(cache->pages);
+            cache->page_shift = rec.page_shift;
+            cache->page_sets = 1UL << rec.page_shift;
+            cache->pages = (set_page_t **)calloc(
+                cache->S >> cache->page_shift, sizeof(set_page_t *));
+            if (cache->pages == NULL) {
+                printf("failed to allocate the cache page directory\n");
+                exit(1);
+            }
+        }
+        cache->rng_state = rec.rng_state;
+        cache->stats = rec.stats;
+        last_snapshot[c] = rec.stats;
+        for (i = 0; i < rec.pages; i++) {
+            uint64_t index;
+            if (fread(&index, sizeof(index), 1, in) != 1 ||
+                index >= cache->S >> cache->page_shift ||
+                cache->pages[index] != NULL) {
+                printf("\"%s\" is truncated or corrupt\n", path);
+                exit(1);
+            }
+            set_page_t *page = alloc_page(cache, (unsigned long)index);
+            if (fread(page->tag, page_data_size(cache), 1, in) != 1) {
+                printf("\"%s\" is truncated\n", path);
+                exit(1);
+            }
+        }
+    }
+    fclose(in);
+    total_accesses = caches[0]->stats.hits + caches[0]->stats.misses;
+    return 0;
+}
+
+/*
+ * libcsim (csim.h)
+ *
+ * A csim_t is one cache plus its own batch of pending records. It runs
+ * the same kernels and generic path as the command line, but everything
+ * they read is in the Cache, set up here: the command line's globals are
+ * neither read nor written, so simulations are independent of each other
+ * and of main().
+ *
+ * Nothing here exits. A cache that cannot be allocated makes csim_create()
+ * return NULL, and a page of sets that cannot be allocated later is
+ * replaced by the cache's spare page, and reported by the functions that
+ * return a bool.
+ */
+struct csim {
+    Cache *cache;
+    int len;                      /* records waiting in pending */
+    access_t pending[BATCH_SIZE]; /* accesses not yet simulated */
+    run_t runs[BATCH_SIZE];       /* the runs found in pending */
+};
+
+/**
+ * @brief Simulate and empty the pending records of a simulation.
+ */
+static void csim_flush(csim_t *sim) {
+    simulate_records(sim->cache, sim->pending, sim->len, sim->runs);
+    sim->len = 0;
+}
+
+/**
+ * @brief Create an empty cache; NULL for a geometry or policy csim -s,
+ *        -E, -b and -r would reject.
+ */
+csim_t *csim_create(int s, int E, int b, const char *policy_name) {
+    policy_t repl = POLICY_LRU;
+    unsigned long i;
+    if (s < 0 || b < 0 || E < 1 || s + b >= MACHINEBITS ||
+        (unsigned long)E >= LRU_NIL) {
+        return NULL;
+    }
+    if (policy_name != NULL) {
+        for (i = 0; i < NUM_POLICIES; i++) {
+            if (strcmp(policy_name, policies[i].name) == 0) {
+                break;
+            }
+        }
+        if (i == NUM_POLICIES) {
+            return NULL;
+        }
+        repl = (policy_t)i;
+    }
+    if (policies[repl].tree && (E & (E - 1)) != 0) {
+        return NULL;
+    }
+
+    csim_t *sim = (csim_t *)malloc(sizeof(csim_t));
+    if (sim == NULL) {
+        return NULL;
+    }
+    sim->cache = malloc_cache(s, E, b, repl, 1);
+    if (sim->cache == NULL) {
+        free(sim);
+        return NULL;
+    }
+    sim->cache->spare = new_page(sim->cache);
+    if (sim->cache->spare == NULL) {
+        csim_destroy(sim);
+        return NULL;
+    }
+    sim->len = 0;
+    return sim;
+}
+
+/**
+ * @brief Queue one access, simulating the queue once it is full.
+ */
+bool csim_access(csim_t *sim, char op, unsigned long address,
+                 unsigned int size) {
+    sim->pending[sim->len].address = address;
+    sim->pending[sim->len].size = size;
+    sim->pending[sim->len].op = op;
+    if (++sim->len == BATCH_SIZE) {
+        csim_flush(sim);
+    }
+    return !sim->cache->out_of_memory;
+}
+
+/* passes a decoded record to csim_access() */
+static void csim_record(void *ctx, char op, unsigned long address,
+                        unsigned int size) {
+    csim_access((csim_t *)ctx, op, address, size);
+}
+
+/**
+ * @brief Simulate a whole trace read from fd.
+ */
+bool csim_simulate_fd(csim_t *sim, int fd) {
+    trace_pos_t pos = {.binary = -1};
+    bool ok = feed_trace(fd, &pos, false, csim_record, sim) == TRACE_OK;
+    csim_flush(sim);
+    return ok && !sim->cache->out_of_memory;
+}
+
+/**
+ * @brief Simulate a whole trace file.
+ */
+bool csim_simulate_file(csim_t *sim, const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = csim_simulate_fd(sim, fd);
+    close(fd);
+    return ok;
+}
+
+/**
+ * @brief Finish the queued accesses and report the statistics in bytes,
+ *        as main() does.
+ */
+bool csim_get_stats(csim_t *sim, csim_stats_t *stats) {
+    csim_flush(sim);
+    *stats = sim->cache->stats;
+    stats->dirty_bytes *= sim->cache->B;
+    stats->dirty_evictions *= sim->cache->B;
+    return !sim->cache->out_of_memory;
+}
+
+/**
+ * @brief Free a simulation and its cache.
+ */
+void csim_destroy(csim_t *sim) {
+    free_cache(sim->cache);
+    free(sim);
+}
+
+/**
+ * Description:
+ *     free the cache storage and the cache descriptor
+ *     created by malloc_cache().
+ */
+int free_cache(Cache *cache) {
+    unsigned long i;
+    if (cache->shadow != NULL) {
+        shadow_free(cache->shadow);
+    }
+    if (cache->wcbuf != NULL) {
+        wcbuf_free(cache->wcbuf);
+    }
+    if (cache->pf != NULL) {
+        prefetcher_free(cache->pf);
+    }
+    if (cache->sample != NULL) {
+        sample_free(cache->sample);
+    }
+    for (i = 0; i < cache->S >> cache->page_shift; i++) {
+        free(cache->pages[i]); /* free tags, bitmaps and policy state */
     }
-    free(cache->set); /* free cache set */
-    free(cache);      /* free whole cache */
+    free(cache->pages);
+    free(cache->spare);
+    free(cache); /* free whole cache */
     return 0;
 }
 
@@ -380,13 +4255,56 @@ int free_cache(void) {
  *     print help when entering command in the cli.
  */
 int print_help() {
-    printf("Format: ./csim [-hv] -s <num> -E <num> -b <num> -t <file>\n");
+    printf("Format: ./csim [-hvmcn] [-r <policy>] [-G s,E,b]... [-j <num>]\n");
+    printf("               [-L s,E,b]... [-I <inclusion>] [-i <num>]\n");
+    printf("               [-o <file>] [-f json|csv] [-w back|through]\n");
+    printf("               [-W <num>] [-p <prefetcher>] [-P <num>]\n");
+    printf("               [-S <num>] [-T warm,detail,period]\n");
+    printf("               [-C <file>] [-R <file>]\n");
+    printf("               -s <num> -E <num> -b <num> -t <file>\n");
     printf("Options:\n");
     printf("-s <num>   Number of set index bits.\n");
     printf("-E <num>   Number of lines per set.\n");
     printf("-b <num>   Number of block offset bits.\n");
-    printf("-t <file>  Trace file path name.\n\n");
+    printf("-t <file>  Trace file path name, or - for stdin.\n\n");
     printf("-h         OPTIONAL: Print help.\n");
     printf("-v         OPTIONAL: verbose flag.\n");
+    printf("-r <name>  OPTIONAL: replacement policy: lru (default), fifo,\n");
+    printf("           random, plru, srrip, brrip or lfu.\n");
+    printf("-G s,E,b   OPTIONAL: simulate one more geometry in the same\n");
+    printf("           pass; may be repeated.\n");
+    printf("-j <num>   OPTIONAL: spread the geometries, or the sets of a\n");
+    printf("           single cache, over num threads.\n");
+    printf("-L s,E,b   OPTIONAL: add a cache level below the previous one;\n");
+    printf("           may be repeated.\n");
+    printf("-I <name>  OPTIONAL: inclusion policy between -L levels: nine\n");
+    printf("           (default), inclusive or exclusive.\n");
+    printf("-c         OPTIONAL: classify the misses as compulsory,\n");
+    printf("           capacity or conflict misses.\n");
+    printf("-i <num>   OPTIONAL: also record statistics for every num\n");
+    printf("           accesses.\n");
+    printf("-o <file>  OPTIONAL: write the statistics and intervals to file\n");
+    printf("           (- for stdout), as JSON or with -f csv as CSV.\n");
+    printf("-f <fmt>   OPTIONAL: format of -o, json (default) or csv.\n");
+    printf("-w <name>  OPTIONAL: write policy: back (default) or through.\n");
+    printf("-n         OPTIONAL: no write-allocate; store misses go to\n");
+    printf("           memory without filling a line.\n");
+    printf("-W <num>   OPTIONAL: combine the stores sent to memory in a\n");
+    printf("           write buffer of num blocks.\n");
+    printf("-p <name>  OPTIONAL: prefetcher: none (default), next, stride\n");
+    printf("           or stream.\n");
+    printf("-P <num>   OPTIONAL: blocks fetched per prefetch (default 1,\n");
+    printf("           4 for stream).\n");
+    printf("-S <num>   OPTIONAL: simulate 1 in num sets (a power of two)\n");
+    printf("           and estimate the totals, with 95%% confidence.\n");
+    printf("-T w,d,p   OPTIONAL: of every p accesses, simulate only the\n");
+    printf("           last w + d and measure the last d, and estimate\n");
+    printf("           the totals, with 95%% confidence.\n");
+    printf("-C <file>  OPTIONAL: save the caches and trace position to\n");
+    printf("           file at the end.\n");
+    printf("-R <file>  OPTIONAL: resume from a -C file, simulating only\n");
+    printf("           what has been added to the trace since.\n");
+    printf("-m         OPTIONAL: LRU stack-distance mode; report every\n");
+    printf("           associativity from 1 to -E in one pass.\n");
     return 0;
 }
@@ -0,0 +1,72 @@
+/**
+ * @file csim.h
+ * @brief libcsim: the cache simulator of csim.c as a library
+ *
+ * A simulation is one cache, created with csim_create() and fed either
+ * single accesses or whole traces. Every setting of a simulation is given
+ * to csim_create() and kept with its cache, never in csim's command-line
+ * globals, so a program can run any number of them, each in one thread at
+ * a time, and read their statistics directly instead of running csim and
+ * loading .csim_results.
+ *
+ * The library never exits. If memory runs out, csim_create() returns NULL,
+ * or the simulation carries on without the sets it could not allocate and
+ * the functions below that return a bool return false.
+ *
+ * The library is csim.c compiled with -DCSIM_LIB, which leaves out the
+ * command line's main(); see csim-lib.o in the Makefile.
+ */
+
+#ifndef CSIM_H
+#define CSIM_H
+
+#include <stdbool.h>
+
+#include "cachelab.h"
+
+/** @brief One simulated cache. */
+typedef struct csim csim_t;
+
+/**
+ * @brief Create an empty cache of 2^s sets of E lines of 2^b bytes.
+ *
+ * @param policy replacement policy name as for csim -r, NULL for lru
+ * @return the simulation, or NULL if the geometry or policy is invalid or
+ *         memory ran out
+ */
+csim_t *csim_create(int s, int E, int b, const char *policy);
+
+/**
+ * @brief Simulate one access of size bytes; op is 'L' or 'S', anything
+ *        else is ignored.
+ *
+ * @return false if the simulation has run out of memory
+ */
+bool csim_access(csim_t *sim, char op, unsigned long address,
+                 unsigned int size);
+
+/**
+ * @brief Simulate every record of a text or binary trace read from fd,
+ *        up to end of file. fd is not closed.
+ *
+ * @return false if the trace could not be read or is corrupt, or the
+ *         simulation has run out of memory
+ */
+bool csim_simulate_fd(csim_t *sim, int fd);
+
+/** @brief Simulate the trace file at path. */
+bool csim_simulate_file(csim_t *sim, const char *path);
+
+/**
+ * @brief The statistics so far, as csim prints them: dirty_bytes and
+ *        dirty_evictions count bytes, not lines.
+ *
+ * @return false if the simulation has run out of memory, so the
+ *         statistics are not those of the whole trace
+ */
+bool csim_get_stats(csim_t *sim, csim_stats_t *stats);
+
+/** @brief Free a simulation. */
+void csim_destroy(csim_t *sim);
+
+#endif /* CSIM_H */
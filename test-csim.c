@@ -5,10 +5,19 @@
  * This program checks the correctness of a student's test cache simulator
  * (csim) by comparing its output to a reference simulator provided by the
  * instructors (csim-ref).
+ *
+ * The student's simulator is run twice on each trace: as the csim
+ * program, whose results are read back from .csim_results, and through
+ * libcsim (csim.h) in this process. Both must agree. The reference
+ * simulator only exists as a program, so it is run with its summary line
+ * read back from its output.
  */
 
+#define _POSIX_C_SOURCE 200809L /* popen */
+
 #include <errno.h>
 #include <getopt.h>
+#include <glob.h>
 #include <limits.h>
 #include <signal.h>
 #include <stdbool.h>
@@ -20,6 +29,7 @@
 #include <unistd.h>
 
 #include "cachelab.h"
+#include "csim.h"
 
 #define MAX_STR 1024 /* Max string size */
 
@@ -79,7 +89,51 @@ static void sigalrm_handler(int signum) {
 }
 
 /**
- * @brief Runs a cache simulation and collects the resulting statistics.
+ * @brief Runs the reference simulator and collects the resulting statistics.
+ *
+ * @param[in]  cmd    The command used to invoke csim-ref
+ * @param[out] stats  The statistics collected from this simulation run
+ *
+ * @return false if any problems, true if OK.
+ */
+static bool run_reference(const char *cmd, csim_stats_t *stats) {
+    FILE *out = popen(cmd, "r");
+    if (out == NULL) {
+        fprintf(stderr, "Error invoking csim-ref: %s\n", strerror(errno));
+        return false;
+    }
+
+    /* The summary line printSummary() prints */
+    int fields = fscanf(out,
+                        "hits:%lu misses:%lu evictions:%lu "
+                        "dirty_bytes_in_cache:%lu dirty_bytes_evicted:%lu",
+                        &stats->hits, &stats->misses, &stats->evictions,
+                        &stats->dirty_bytes, &stats->dirty_evictions);
+    while (fgetc(out) != EOF) {
+        /* let it finish writing */
+    }
+
+    int status = pclose(out);
+    (void)unlink(".csim_results"); /* csim-ref still writes it */
+    if (status < 0) {
+        fprintf(stderr, "Error invoking csim-ref: %s\n", strerror(errno));
+        return false;
+    }
+    if (WIFEXITED(status) && WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "Error running csim-ref: Status %d\n",
+                WEXITSTATUS(status));
+        return false;
+    }
+    if (fields != 5) {
+        fprintf(stderr, "Error: Results for csim-ref not found\n");
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Runs the student's csim program and collects the resulting
+ *        statistics.
  *
  * @param[in]  cmd    The command used to invoke csim
  * @param[out] stats  The statistics collected from this simulation run
@@ -120,6 +174,33 @@ static bool run_csim(const char *cmd, csim_stats_t *stats) {
     return success;
 }
 
+/**
+ * @brief Runs the student's simulator through libcsim.
+ *
+ * @param[in]  info   Information about the trace to run
+ * @param[out] stats  The statistics collected from this simulation run
+ *
+ * @return false if any problems, true if OK.
+ */
+static bool run_libcsim(const trace_info_t *info, csim_stats_t *stats) {
+    csim_t *sim = csim_create(info->s, info->E, info->b, NULL);
+    if (sim == NULL) {
+        fprintf(stderr, "Error: csim_create() could not create the cache\n");
+        return false;
+    }
+
+    bool success = csim_simulate_file(sim, info->filename);
+    success = csim_get_stats(sim, stats) && success;
+    if (!success) {
+        fprintf(stderr, "Error: libcsim failed to simulate %s\n",
+                info->filename);
+    }
+    csim_destroy(sim);
+    return success;
+}
+
+static int count_matches(const csim_stats_t *a, const csim_stats_t *b);
+
 /*
  * @brief Collects run results for a particular trace
  *
@@ -137,9 +218,9 @@ static bool runtrace(const trace_info_t *info, csim_stats_t *ref_stats,
     char cmd[MAX_STR];
 
     /* Run the reference simulator */
-    sprintf(cmd, "./csim-ref -s %d -E %d -b %d -t %s > /dev/null", info->s,
-            info->E, info->b, info->filename);
-    if (!run_csim(cmd, ref_stats)) {
+    sprintf(cmd, "./csim-ref -s %d -E %d -b %d -t %s", info->s, info->E,
+            info->b, info->filename);
+    if (!run_reference(cmd, ref_stats)) {
         fprintf(stderr, "Running reference simulator failed: '%s'\n", cmd);
         fprintf(stderr, "\n");
         return false;
@@ -175,6 +256,25 @@ static bool runtrace(const trace_info_t *info, csim_stats_t *ref_stats,
         return false;
     }
 
+    /* The same simulator through libcsim must agree with it */
+    csim_stats_t lib_stats;
+    if (!run_libcsim(info, &lib_stats)) {
+        fprintf(stderr, "Running libcsim failed: (%d,%d,%d) %s\n", info->s,
+                info->E, info->b, info->filename);
+        fprintf(stderr, "\n");
+        return false;
+    }
+    if (count_matches(&lib_stats, test_stats) != 5) {
+        fprintf(stderr,
+                "Error: libcsim and '%s' disagree: hits:%lu misses:%lu "
+                "evictions:%lu dirty_bytes_in_cache:%lu "
+                "dirty_bytes_evicted:%lu\n",
+                cmd, lib_stats.hits, lib_stats.misses, lib_stats.evictions,
+                lib_stats.dirty_bytes, lib_stats.dirty_evictions);
+        fprintf(stderr, "\n");
+        return false;
+    }
+
     return true;
 }
 
@@ -257,6 +357,856 @@ static void test_csim(void) {
     printf("\nTEST_CSIM_RESULTS=%d\n", total_points);
 }
 
+/**
+ * @brief Checks that the prefetchers leave the demand counters alone.
+ *
+ * A line that a prefetch fill evicts counts in prefetch_evictions only,
+ * so with any -p prefetcher every eviction must still be caused by a
+ * miss.
+ *
+ * @return false if any trace breaks this, true if OK.
+ */
+static bool check_prefetch(void) {
+    static const char *const prefetchers[] = {"next", "stride", "stream"};
+    char cmd[MAX_STR];
+    bool ok = true;
+
+    for (int i = 0; i < N; i++) {
+        const trace_info_t *info = &TRACE_INFO[i];
+        for (size_t p = 0; p < sizeof(prefetchers) / sizeof(prefetchers[0]);
+             p++) {
+            csim_stats_t stats;
+            sprintf(cmd, "./csim -s %d -E %d -b %d -p %s -t %s > /dev/null",
+                    info->s, info->E, info->b, prefetchers[p],
+                    info->filename);
+            if (!run_csim(cmd, &stats)) {
+                fprintf(stderr, "Running test simulator failed: '%s'\n", cmd);
+                ok = false;
+            } else if (stats.evictions > stats.misses) {
+                fprintf(stderr,
+                        "Error: '%s' reports %lu evictions for %lu misses\n",
+                        cmd, stats.evictions, stats.misses);
+                ok = false;
+            }
+        }
+    }
+    return ok;
+}
+
+/**
+ * @brief Checks -m against a separate run for every associativity.
+ *
+ * One -m pass reports an LRU cache of every E from 1 to -E, and each of
+ * its lines must match what libcsim counts for that E on its own.
+ *
+ * @return false if any line differs, true if OK.
+ */
+static bool check_stack_distance(void) {
+    static const int max_E = 8;
+    char cmd[MAX_STR];
+    bool ok = true;
+
+    for (int i = 0; i < N; i++) {
+        const trace_info_t *info = &TRACE_INFO[i];
+        sprintf(cmd, "./csim -m -s %d -E %d -b %d -t %s", info->s, max_E,
+                info->b, info->filename);
+        FILE *out = popen(cmd, "r");
+        if (out == NULL) {
+            fprintf(stderr, "Error invoking csim: %s\n", strerror(errno));
+            return false;
+        }
+
+        int lines = 0;
+        for (int E = 1; E <= max_E; E++) {
+            int s, line_E, b;
+            csim_stats_t stats, single;
+            if (fscanf(out,
+                       " s:%d E:%d b:%d hits:%lu misses:%lu evictions:%lu "
+                       "dirty_bytes_in_cache:%lu dirty_bytes_evicted:%lu",
+                       &s, &line_E, &b, &stats.hits, &stats.misses,
+                       &stats.evictions, &stats.dirty_bytes,
+                       &stats.dirty_evictions) != 8 ||
+                s != info->s || line_E != E || b != info->b) {
+                break;
+            }
+            lines++;
+
+            trace_info_t one = *info;
+            one.E = E;
+            if (!run_libcsim(&one, &single) ||
+                count_matches(&stats, &single) != 5) {
+                fprintf(stderr,
+                        "Error: '%s' differs from a run with -E %d on "
+                        "its own\n",
+                        cmd, E);
+                ok = false;
+            }
+        }
+        while (fgetc(out) != EOF) {
+            /* let it finish writing */
+        }
+        int status = pclose(out);
+        if (status != 0 || lines != max_E) {
+            fprintf(stderr, "Error: '%s' did not report -E 1 to %d\n", cmd,
+                    max_E);
+            ok = false;
+        }
+    }
+    (void)unlink(".csim_results");
+    return ok;
+}
+
+/**
+ * @brief Checks the -L hierarchy under every -I policy against counts
+ *        worked out by hand.
+ *
+ * levels.trace loads A B, stores A, then loads C A B. L1 has two direct
+ * mapped sets, so A and C share a set and B has the other. L2 is one set
+ * of two LRU lines with the same 1-byte blocks.
+ * - nine: C evicts A from L2, and L1 then writes dirty A back into L2,
+ *   which evicts B. A hits in L2 and B still hits in L1.
+ * - inclusive: C evicts A from L2, which invalidates dirty A in L1 and
+ *   writes it to memory. A then evicts B from L2, which invalidates B in
+ *   L1, so B misses everywhere.
+ * - exclusive: dirty A moves down into the empty L2 when C fills L1. A
+ *   later moves back up, still dirty, and C takes its place in L2.
+ *
+ * @return false if any count differs, true if OK.
+ */
+static bool check_hierarchy(void) {
+    static const char *const inclusions[] = {"nine", "inclusive",
+                                             "exclusive"};
+    /* hits, misses, evictions, dirty bytes, dirty bytes evicted */
+    static const unsigned long expected[3][2][5] = {
+        {{2, 4, 2, 0, 1}, {1, 3, 2, 1, 0}},
+        {{1, 5, 1, 0, 0}, {0, 5, 3, 0, 1}},
+        {{2, 4, 2, 1, 1}, {1, 3, 0, 0, 0}},
+    };
+    char cmd[MAX_STR];
+    bool ok = true;
+
+    for (int i = 0; i < 3; i++) {
+        sprintf(cmd, "./csim -s 1 -E 1 -b 0 -L 0,2,0 -I %s -t %s",
+                inclusions[i], TRACES_DIR "levels.trace");
+        FILE *out = popen(cmd, "r");
+        if (out == NULL) {
+            fprintf(stderr, "Error invoking csim: %s\n", strerror(errno));
+            return false;
+        }
+
+        for (int lvl = 0; lvl < 2; lvl++) {
+            int level, s, E, b;
+            unsigned long got[5];
+            if (fscanf(out,
+                       " L%d s:%d E:%d b:%d hits:%lu misses:%lu "
+                       "evictions:%lu dirty_bytes_in_cache:%lu "
+                       "dirty_bytes_evicted:%lu",
+                       &level, &s, &E, &b, &got[0], &got[1], &got[2],
+                       &got[3], &got[4]) != 9 ||
+                level != lvl + 1) {
+                fprintf(stderr, "Error: '%s' did not report L%d\n", cmd,
+                        lvl + 1);
+                ok = false;
+                break;
+            }
+            if (memcmp(got, expected[i][lvl], sizeof(got)) != 0) {
+                fprintf(stderr,
+                        "Error: '%s' reports L%d hits:%lu misses:%lu "
+                        "evictions:%lu dirty:%lu dirty_evicted:%lu\n",
+                        cmd, level, got[0], got[1], got[2], got[3], got[4]);
+                ok = false;
+            }
+        }
+        while (fgetc(out) != EOF) {
+            /* let it finish writing */
+        }
+        if (pclose(out) != 0) {
+            fprintf(stderr, "Error running csim: '%s'\n", cmd);
+            ok = false;
+        }
+    }
+    (void)unlink(".csim_results");
+    return ok;
+}
+
+/**
+ * @brief Checks the -c miss classes on a trace built to have each kind.
+ *
+ * 3c.trace runs through two direct-mapped lines, so its shadow is one
+ * fully associative set of two lines. Blocks 0 and 2 share a set:
+ * - 0 2 are compulsory, and 0 2 again are conflict misses, since the
+ *   shadow still holds both.
+ * - 1 3 are compulsory and leave only 1 and 3 in the shadow, so the
+ *   next 0 2 are capacity misses.
+ * - The final 2 hits.
+ *
+ * @return false if any count differs, true if OK.
+ */
+static bool check_miss_classes(void) {
+    const char *cmd = "./csim -c -s 1 -E 1 -b 0 -t " TRACES_DIR "3c.trace";
+    FILE *out = popen(cmd, "r");
+    if (out == NULL) {
+        fprintf(stderr, "Error invoking csim: %s\n", strerror(errno));
+        return false;
+    }
+
+    csim_stats_t stats;
+    unsigned long compulsory, capacity, conflict;
+    int fields = fscanf(out,
+                        "hits:%lu misses:%lu evictions:%lu "
+                        "dirty_bytes_in_cache:%lu dirty_bytes_evicted:%lu "
+                        "compulsory:%lu capacity:%lu conflict:%lu",
+                        &stats.hits, &stats.misses, &stats.evictions,
+                        &stats.dirty_bytes, &stats.dirty_evictions,
+                        &compulsory, &capacity, &conflict);
+    while (fgetc(out) != EOF) {
+        /* let it finish writing */
+    }
+    int status = pclose(out);
+    (void)unlink(".csim_results");
+
+    if (status != 0 || fields != 8) {
+        fprintf(stderr, "Error: '%s' did not report the miss classes\n",
+                cmd);
+        return false;
+    }
+    if (stats.hits != 1 || stats.misses != 8 || compulsory != 4 ||
+        capacity != 2 || conflict != 2) {
+        fprintf(stderr,
+                "Error: '%s' reports hits:%lu misses:%lu compulsory:%lu "
+                "capacity:%lu conflict:%lu, expected hits:1 misses:8 "
+                "compulsory:4 capacity:2 conflict:2\n",
+                cmd, stats.hits, stats.misses, compulsory, capacity,
+                conflict);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Runs csim and keeps the start of what it prints.
+ *
+ * @param[in]  cmd    The command used to invoke csim
+ * @param[out] out    Where to store the output, NUL-terminated
+ * @param[in]  size   The size of out
+ *
+ * @return false if csim could not be run or failed, true if OK.
+ */
+static bool read_csim_output(const char *cmd, char *out, size_t size) {
+    FILE *pipe = popen(cmd, "r");
+    if (pipe == NULL) {
+        fprintf(stderr, "Error invoking csim: %s\n", strerror(errno));
+        return false;
+    }
+    size_t len = fread(out, 1, size - 1, pipe);
+    out[len] = '\0';
+    while (fgetc(pipe) != EOF) {
+        /* let it finish writing */
+    }
+    int status = pclose(pipe);
+    (void)unlink(".csim_results");
+    if (status != 0) {
+        fprintf(stderr, "Error running csim: '%s'\n", cmd);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Checks that -S and -T are repeatable and close to the full run.
+ *
+ * Neither mode draws random numbers. -S picks its sets with a fixed
+ * hash, and -T its windows by position, so two runs must print the same
+ * thing. On long.trace with 256 sets of 2 lines, both estimate the
+ * misses within 1% of the full run, and -T estimates the hits within
+ * 1% as well. The -S hits are not checked: most of the trace's hits
+ * fall in a few stack sets that a quarter of the sets can miss.
+ *
+ * @return false if a run differs or misses its bound, true if OK.
+ */
+static bool check_sampling(void) {
+    static const char *const modes[] = {"-S 4", "-T 1000,1000,8000"};
+    const char *geometry = "-s 8 -E 2 -b 5 -t " TRACES_DIR "long.trace";
+    char cmd[MAX_STR], first[MAX_STR], second[MAX_STR];
+    csim_stats_t full, est;
+
+    sprintf(cmd, "./csim %s", geometry);
+    if (!read_csim_output(cmd, first, sizeof(first)) ||
+        sscanf(first, "hits:%lu misses:%lu", &full.hits, &full.misses) !=
+            2) {
+        fprintf(stderr, "Error: No results from '%s'\n", cmd);
+        return false;
+    }
+
+    bool ok = true;
+    for (int i = 0; i < 2; i++) {
+        sprintf(cmd, "./csim %s %s", modes[i], geometry);
+        if (!read_csim_output(cmd, first, sizeof(first)) ||
+            !read_csim_output(cmd, second, sizeof(second)) ||
+            sscanf(first, "hits:%lu misses:%lu", &est.hits, &est.misses) !=
+                2) {
+            fprintf(stderr, "Error: No results from '%s'\n", cmd);
+            ok = false;
+            continue;
+        }
+        if (strcmp(first, second) != 0) {
+            fprintf(stderr, "Error: '%s' differs between runs\n", cmd);
+            ok = false;
+        }
+        double miss_error = ((double)est.misses - (double)full.misses) /
+                            (double)full.misses;
+        double hit_error =
+            ((double)est.hits - (double)full.hits) / (double)full.hits;
+        if (miss_error > 0.01 || miss_error < -0.01 ||
+            (i == 1 && (hit_error > 0.01 || hit_error < -0.01))) {
+            fprintf(stderr,
+                    "Error: '%s' estimates hits:%lu misses:%lu, the full "
+                    "run counts hits:%lu misses:%lu\n",
+                    cmd, est.hits, est.misses, full.hits, full.misses);
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+/**
+ * @brief Checks -w through, -n and -W against counts worked out by hand.
+ *
+ * write.trace stores two halves of block 0, loads block 1, stores the
+ * same byte of block 2 twice and loads block 0 again, all through one
+ * line of 4 bytes:
+ * - through: every store byte reaches memory (2 + 2 + 1 + 1), and each
+ *   of the four misses fills a line.
+ * - -n: no store fills a line, so all six accesses miss and only the
+ *   two loads read memory.
+ * - -n -W 1: block 0 leaves the buffer whole when block 2's store needs
+ *   the entry, and the repeated byte of block 2 is written once.
+ * - through -W 2: the second load of block 0 writes out its buffered
+ *   bytes before the fill, and block 2's byte leaves at the end.
+ *
+ * @return false if any count differs, true if OK.
+ */
+static bool check_write_policies(void) {
+    static const struct {
+        const char *options;
+        unsigned long hits;
+        unsigned long misses;
+        unsigned long evictions;
+        unsigned long mem_read_bytes;
+        unsigned long mem_write_bytes;
+    } expected[] = {
+        {"-w through", 2, 4, 3, 16, 6},
+        {"-n", 0, 6, 1, 8, 6},
+        {"-n -W 1", 0, 6, 1, 8, 5},
+        {"-w through -W 2", 2, 4, 3, 16, 5},
+    };
+    char cmd[MAX_STR], out[MAX_STR];
+    bool ok = true;
+
+    for (size_t i = 0; i < sizeof(expected) / sizeof(expected[0]); i++) {
+        csim_stats_t stats;
+        sprintf(cmd, "./csim -s 0 -E 1 -b 2 %s -t %s", expected[i].options,
+                TRACES_DIR "write.trace");
+        if (!read_csim_output(cmd, out, sizeof(out)) ||
+            sscanf(out,
+                   "hits:%lu misses:%lu evictions:%lu "
+                   "dirty_bytes_in_cache:%lu dirty_bytes_evicted:%lu "
+                   "memory_bytes_read:%lu memory_bytes_written:%lu",
+                   &stats.hits, &stats.misses, &stats.evictions,
+                   &stats.dirty_bytes, &stats.dirty_evictions,
+                   &stats.mem_read_bytes, &stats.mem_write_bytes) != 7) {
+            fprintf(stderr, "Error: No results from '%s'\n", cmd);
+            ok = false;
+        } else if (stats.hits != expected[i].hits ||
+                   stats.misses != expected[i].misses ||
+                   stats.evictions != expected[i].evictions ||
+                   stats.dirty_bytes != 0 || stats.dirty_evictions != 0 ||
+                   stats.mem_read_bytes != expected[i].mem_read_bytes ||
+                   stats.mem_write_bytes != expected[i].mem_write_bytes) {
+            fprintf(stderr, "Error: '%s' reports %s", cmd, out);
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+/**
+ * @brief Checks every prefetch counter of -p stride and -p stream against
+ *        counts worked out by hand.
+ *
+ * Both traces run through one set of four 16-byte lines. The first three
+ * loads step one way (64 bytes for stride, one block for stream), which
+ * trains the prefetcher to fetch the next block. The fourth load uses
+ * that block at once, so it is late and counts as a miss, and it
+ * prefetches one more block over the oldest line, block 0. 25 hits to
+ * the fourth block then pass PREFETCH_LATENCY, so the next step finds
+ * its prefetch useful and prefetches again over the second line. The
+ * final load of block 0 misses because of the first prefetch, which makes
+ * that prefetch polluting, and it is the only demand eviction.
+ *
+ * @return false if any count differs, true if OK.
+ */
+static bool check_prefetch_counts(void) {
+    static const char *const cmds[] = {
+        "./csim -s 0 -E 4 -b 4 -p stride -t " TRACES_DIR "stride.trace",
+        "./csim -s 0 -E 4 -b 4 -p stream -P 1 -t " TRACES_DIR "stream.trace",
+    };
+    char out[MAX_STR];
+    bool ok = true;
+
+    for (size_t i = 0; i < sizeof(cmds) / sizeof(cmds[0]); i++) {
+        csim_stats_t stats;
+        if (!read_csim_output(cmds[i], out, sizeof(out)) ||
+            sscanf(out,
+                   "hits:%lu misses:%lu evictions:%lu "
+                   "dirty_bytes_in_cache:%lu dirty_bytes_evicted:%lu "
+                   "prefetch_issued:%lu prefetch_useful:%lu "
+                   "prefetch_late:%lu prefetch_polluting:%lu "
+                   "prefetch_evictions:%lu",
+                   &stats.hits, &stats.misses, &stats.evictions,
+                   &stats.dirty_bytes, &stats.dirty_evictions,
+                   &stats.pf_issued, &stats.pf_useful, &stats.pf_late,
+                   &stats.pf_polluting, &stats.pf_evictions) != 10) {
+            fprintf(stderr, "Error: No results from '%s'\n", cmds[i]);
+            ok = false;
+        } else if (stats.hits != 26 || stats.misses != 5 ||
+                   stats.evictions != 1 || stats.pf_issued != 3 ||
+                   stats.pf_useful != 1 || stats.pf_late != 1 ||
+                   stats.pf_polluting != 1 || stats.pf_evictions != 2) {
+            fprintf(stderr, "Error: '%s' reports %s", cmds[i], out);
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+/* columns of an interval: start, accesses, then the csim_stats_t fields */
+#define INTERVAL_FIELDS 14
+#define MAX_INTERVALS 64
+
+/**
+ * @brief Checks that a series of intervals adds up to its total.
+ *
+ * The intervals must tile the trace from its first access, their counts
+ * must sum to the total's, and the dirty bytes left at the end of the
+ * last one are the total's.
+ *
+ * @return false if they do not, true if OK.
+ */
+static bool check_interval_sums(const char *what,
+                                unsigned long rows[][INTERVAL_FIELDS],
+                                int n, const unsigned long *total) {
+    unsigned long sum[INTERVAL_FIELDS] = {0};
+    if (n == 0) {
+        fprintf(stderr, "Error: %s has no intervals\n", what);
+        return false;
+    }
+    for (int i = 0; i < n; i++) {
+        if (rows[i][0] != sum[1]) {
+            fprintf(stderr, "Error: %s interval %d starts at %lu, not %lu\n",
+                    what, i, rows[i][0], sum[1]);
+            return false;
+        }
+        for (int f = 1; f < INTERVAL_FIELDS; f++) {
+            sum[f] += rows[i][f];
+        }
+    }
+    sum[0] = total[0];
+    sum[5] = rows[n - 1][5]; /* dirty bytes in cache */
+    for (int f = 0; f < INTERVAL_FIELDS; f++) {
+        if (sum[f] != total[f]) {
+            fprintf(stderr,
+                    "Error: %s intervals add up to %lu in column %d, the "
+                    "total is %lu\n",
+                    what, sum[f], f, total[f]);
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Checks the -i intervals that -o writes, as JSON and as CSV.
+ *
+ * Both files are parsed back, and the intervals of each must add up to
+ * its total, which must in turn match the summary csim prints. The run
+ * uses -p next so the prefetch columns are not all zero.
+ *
+ * @return false if anything differs, true if OK.
+ */
+static bool check_intervals(void) {
+    static const char *const out_file = ".test-csim.out";
+    const char *run = "./csim -s 2 -E 1 -b 3 -p next -i 50 -o .test-csim.out";
+    const char *trace = TRACES_DIR "trans.trace";
+    char cmd[MAX_STR], summary[MAX_STR];
+    unsigned long rows[MAX_INTERVALS][INTERVAL_FIELDS];
+    unsigned long total[INTERVAL_FIELDS];
+    csim_stats_t stats;
+    bool ok = true;
+
+    /* JSON: one object per interval after the cache's total */
+    sprintf(cmd, "%s -t %s", run, trace);
+    FILE *in = NULL;
+    static char text[1 << 14];
+    size_t len = 0;
+    if (read_csim_output(cmd, summary, sizeof(summary)) &&
+        (in = fopen(out_file, "r")) != NULL) {
+        len = fread(text, 1, sizeof(text) - 1, in);
+        fclose(in);
+    }
+    text[len] = '\0';
+
+    const char *p = strstr(text, "\"total\": {");
+    int n = 0;
+    total[0] = 0;
+    if (p == NULL ||
+        sscanf(p,
+               "\"total\": {\"hits\": %lu, \"misses\": %lu, "
+               "\"evictions\": %lu, \"dirty_bytes_in_cache\": %lu, "
+               "\"dirty_bytes_evicted\": %lu, \"memory_bytes_read\": %lu, "
+               "\"memory_bytes_written\": %lu, \"prefetch_issued\": %lu, "
+               "\"prefetch_useful\": %lu, \"prefetch_late\": %lu, "
+               "\"prefetch_polluting\": %lu, \"prefetch_evictions\": %lu}",
+               &total[2], &total[3], &total[4], &total[5], &total[6],
+               &total[7], &total[8], &total[9], &total[10], &total[11],
+               &total[12], &total[13]) != 12) {
+        fprintf(stderr, "Error: No JSON total from '%s'\n", cmd);
+        ok = false;
+    } else {
+        while (n < MAX_INTERVALS &&
+               (p = strstr(p, "{\"start\": ")) != NULL) {
+            unsigned long *r = rows[n];
+            if (sscanf(p,
+                       "{\"start\": %lu, \"accesses\": %lu, \"hits\": %lu, "
+                       "\"misses\": %lu, \"evictions\": %lu, "
+                       "\"dirty_bytes_in_cache\": %lu, "
+                       "\"dirty_bytes_evicted\": %lu, "
+                       "\"memory_bytes_read\": %lu, "
+                       "\"memory_bytes_written\": %lu, "
+                       "\"prefetch_issued\": %lu, \"prefetch_useful\": %lu, "
+                       "\"prefetch_late\": %lu, "
+                       "\"prefetch_polluting\": %lu, "
+                       "\"prefetch_evictions\": %lu}",
+                       &r[0], &r[1], &r[2], &r[3], &r[4], &r[5], &r[6],
+                       &r[7], &r[8], &r[9], &r[10], &r[11], &r[12],
+                       &r[13]) != INTERVAL_FIELDS) {
+                fprintf(stderr, "Error: Bad JSON interval from '%s'\n", cmd);
+                ok = false;
+                break;
+            }
+            n++;
+            p++;
+        }
+        /* the JSON total has no access count to check */
+        total[1] = 0;
+        for (int i = 0; i < n; i++) {
+            total[1] += rows[i][1];
+        }
+        ok = ok && check_interval_sums("JSON", rows, n, total);
+    }
+
+    /* The totals are the summary printed on stdout */
+    if (sscanf(summary,
+               "hits:%lu misses:%lu evictions:%lu dirty_bytes_in_cache:%lu "
+               "dirty_bytes_evicted:%lu",
+               &stats.hits, &stats.misses, &stats.evictions,
+               &stats.dirty_bytes, &stats.dirty_evictions) != 5 ||
+        stats.hits != total[2] || stats.misses != total[3] ||
+        stats.evictions != total[4] || stats.dirty_bytes != total[5] ||
+        stats.dirty_evictions != total[6]) {
+        fprintf(stderr, "Error: '%s' prints a summary unlike its JSON\n",
+                cmd);
+        ok = false;
+    }
+
+    /* CSV: one row per interval, then the total */
+    sprintf(cmd, "%s -f csv -t %s", run, trace);
+    n = 0;
+    bool have_total = false;
+    if (read_csim_output(cmd, summary, sizeof(summary)) &&
+        (in = fopen(out_file, "r")) != NULL) {
+        char line[MAX_STR], interval[16];
+        unsigned long r[INTERVAL_FIELDS];
+        while (fgets(line, sizeof(line), in) != NULL) {
+            if (sscanf(line,
+                       "\"%*[^\"]\",%15[^,],%lu,%lu,%lu,%lu,%lu,%lu,%lu,"
+                       "%lu,%lu,%lu,%lu,%lu,%lu,%lu",
+                       interval, &r[0], &r[1], &r[2], &r[3], &r[4], &r[5],
+                       &r[6], &r[7], &r[8], &r[9], &r[10], &r[11], &r[12],
+                       &r[13]) != 1 + INTERVAL_FIELDS) {
+                continue; /* the header */
+            }
+            if (strcmp(interval, "total") == 0) {
+                memcpy(total, r, sizeof(total));
+                have_total = true;
+            } else if (n < MAX_INTERVALS) {
+                memcpy(rows[n++], r, sizeof(r));
+            }
+        }
+        fclose(in);
+    }
+    if (!have_total) {
+        fprintf(stderr, "Error: No CSV total from '%s'\n", cmd);
+        ok = false;
+    } else {
+        ok = check_interval_sums("CSV", rows, n, total) && ok;
+    }
+
+    (void)unlink(out_file);
+    return ok;
+}
+
+/**
+ * @brief Writes len bytes of text to path, replacing the file.
+ *
+ * @return false if any problems, true if OK.
+ */
+static bool write_file(const char *path, const char *text, size_t len) {
+    FILE *out = fopen(path, "w");
+    if (out == NULL) {
+        return false;
+    }
+    bool ok = fwrite(text, 1, len, out) == len;
+    return fclose(out) == 0 && ok;
+}
+
+/**
+ * @brief Checks that a run resumed with -R from a -C checkpoint counts
+ *        what a single run over the whole trace does.
+ *
+ * The first run sees trans.trace cut off in the middle of an address, as
+ * a trace still being written would be. The resumed run sees the whole
+ * trace, so it must pick the cut line up again from its start.
+ *
+ * @return false if the counts differ, true if OK.
+ */
+static bool check_checkpoint(void) {
+    static const char *const part = ".test-csim.trace";
+    static const char *const ckpt = ".test-csim.ckpt";
+    static const size_t cut = 1500; /* inside "L 00600a3c,4" */
+    const char *trace = TRACES_DIR "trans.trace";
+    char cmd[MAX_STR], text[1 << 12];
+    csim_stats_t full, resumed;
+
+    FILE *in = fopen(trace, "r");
+    if (in == NULL) {
+        fprintf(stderr, "Error: Could not read %s\n", trace);
+        return false;
+    }
+    size_t len = fread(text, 1, sizeof(text), in);
+    fclose(in);
+
+    bool ok = len > cut && write_file(part, text, cut);
+    sprintf(cmd, "./csim -s 2 -E 1 -b 3 -C %s -t %s > /dev/null", ckpt, part);
+    ok = ok && run_csim(cmd, &resumed) && write_file(part, text, len);
+    sprintf(cmd, "./csim -s 2 -E 1 -b 3 -R %s -t %s > /dev/null", ckpt, part);
+    ok = ok && run_csim(cmd, &resumed);
+    sprintf(cmd, "./csim -s 2 -E 1 -b 3 -t %s > /dev/null", trace);
+    ok = ok && run_csim(cmd, &full);
+    (void)unlink(part);
+    (void)unlink(ckpt);
+
+    if (!ok) {
+        fprintf(stderr, "Error: -C and -R could not resume %s\n", trace);
+        return false;
+    }
+    if (count_matches(&full, &resumed) != 5) {
+        fprintf(stderr,
+                "Error: -C then -R counts hits:%lu misses:%lu "
+                "evictions:%lu, a full run hits:%lu misses:%lu "
+                "evictions:%lu\n",
+                resumed.hits, resumed.misses, resumed.evictions, full.hits,
+                full.misses, full.evictions);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Checks every -r policy against counts worked out by hand.
+ *
+ * policy.trace runs A B C D C A E B D through one set of four lines, so
+ * A to D fill the set and E evicts one of them:
+ * - lru evicts B, then D for B, then C for D.
+ * - fifo evicts A, the first line filled, and B and D hit.
+ * - random draws way 2 from its fixed seed, evicting C.
+ * - plru follows the tree away from C and A to D, then B hits and D
+ *   evicts C.
+ * - srrip ages B and D to distant, evicts B, then D for B and E for D.
+ * - brrip inserts at distant, so E evicts B, B evicts E and D hits.
+ * - lfu evicts B, the lowest way used once, then E for B, and D hits.
+ *
+ * @return false if any policy differs, true if OK.
+ */
+static bool check_policies(void) {
+    static const struct {
+        const char *policy;
+        unsigned long hits;
+        unsigned long misses;
+        unsigned long evictions;
+    } expected[] = {
+        {"lru", 2, 7, 3},   {"fifo", 4, 5, 1},  {"random", 4, 5, 1},
+        {"plru", 3, 6, 2},  {"srrip", 2, 7, 3}, {"brrip", 3, 6, 2},
+        {"lfu", 3, 6, 2},
+    };
+    char cmd[MAX_STR];
+    bool ok = true;
+
+    for (size_t i = 0; i < sizeof(expected) / sizeof(expected[0]); i++) {
+        csim_stats_t stats;
+        sprintf(cmd, "./csim -s 0 -E 4 -b 0 -r %s -t %s > /dev/null",
+                expected[i].policy, TRACES_DIR "policy.trace");
+        if (!run_csim(cmd, &stats)) {
+            fprintf(stderr, "Running test simulator failed: '%s'\n", cmd);
+            ok = false;
+        } else if (stats.hits != expected[i].hits ||
+                   stats.misses != expected[i].misses ||
+                   stats.evictions != expected[i].evictions) {
+            fprintf(stderr,
+                    "Error: '%s' reports hits:%lu misses:%lu evictions:%lu, "
+                    "expected hits:%lu misses:%lu evictions:%lu\n",
+                    cmd, stats.hits, stats.misses, stats.evictions,
+                    expected[i].hits, expected[i].misses,
+                    expected[i].evictions);
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+/**
+ * @brief Parses every record of a text trace.
+ *
+ * @param[in]  in       The text trace, read from its current position
+ * @param[out] records  A malloc'd array of the records, for the caller to free
+ *
+ * @return The number of records, or -1 if the trace could not be parsed.
+ */
+static long read_text_records(FILE *in, trace_record_t **records) {
+    size_t cap = 1 << 12, len = 0, got;
+    char *text = malloc(cap);
+    while (text != NULL && (got = fread(text + len, 1, cap - len, in)) > 0) {
+        len += got;
+        if (len == cap) {
+            char *grown = realloc(text, cap *= 2);
+            if (grown == NULL) {
+                free(text);
+            }
+            text = grown;
+        }
+    }
+    /* Every record takes at least four bytes of text */
+    *records = malloc((len / 4 + 1) * sizeof(trace_record_t));
+    if (text == NULL || *records == NULL) {
+        free(text);
+        free(*records);
+        return -1;
+    }
+
+    long n = 0, used;
+    size_t pos = 0;
+    while ((used = parseTraceRecord(text + pos, text + len, true,
+                                    &(*records)[n])) > 0) {
+        pos += (size_t)used;
+        n++;
+    }
+    free(text);
+    if (used < 0) {
+        free(*records);
+        return -1;
+    }
+    return n;
+}
+
+/**
+ * @brief Checks that every trace in traces/ survives the binary format.
+ *
+ * Each trace is encoded with convertTraceToBinary() and decoded again
+ * with convertTraceToText(), and the records must come back unchanged.
+ * The binary trace must also simulate to the same statistics as the text.
+ *
+ * @return false if any trace breaks this, true if OK.
+ */
+static bool check_binary_roundtrip(void) {
+    static const char *const btrace = ".test-csim.btrace";
+    glob_t traces;
+    if (glob("traces/*/*.trace", 0, NULL, &traces) != 0) {
+        fprintf(stderr, "Error: No traces found in traces/\n");
+        return false;
+    }
+
+    bool ok = true;
+    for (size_t i = 0; i < traces.gl_pathc; i++) {
+        const char *path = traces.gl_pathv[i];
+        FILE *text = fopen(path, "r");
+        FILE *binary = fopen(btrace, "w+b");
+        FILE *decoded = tmpfile();
+        trace_record_t *expected = NULL, *actual = NULL;
+        long n_expected = -1, n_actual = -1;
+        uint64_t count;
+
+        if (text != NULL && binary != NULL && decoded != NULL &&
+            convertTraceToBinary(text, binary, &count) &&
+            fflush(binary) == 0) {
+            rewind(binary);
+            rewind(text);
+            if (convertTraceToText(binary, decoded, &count)) {
+                rewind(decoded);
+                n_expected = read_text_records(text, &expected);
+                n_actual = read_text_records(decoded, &actual);
+            }
+        }
+        if (text != NULL) {
+            fclose(text);
+        }
+        if (binary != NULL) {
+            fclose(binary);
+        }
+        if (decoded != NULL) {
+            fclose(decoded);
+        }
+
+        if (n_expected < 0 || n_actual < 0) {
+            fprintf(stderr, "Error: Could not convert %s\n", path);
+            ok = false;
+        } else if (n_actual != n_expected || (uint64_t)n_expected != count) {
+            fprintf(stderr, "Error: %s has %ld records, %ld after decoding\n",
+                    path, n_expected, n_actual);
+            ok = false;
+        } else {
+            for (long r = 0; r < n_expected; r++) {
+                if (actual[r].op != expected[r].op ||
+                    actual[r].address != expected[r].address ||
+                    actual[r].size != expected[r].size) {
+                    fprintf(stderr, "Error: %s record %ld decodes wrongly\n",
+                            path, r + 1);
+                    ok = false;
+                    break;
+                }
+            }
+        }
+        free(expected);
+        free(actual);
+
+        /* The same simulation from either format */
+        csim_stats_t text_stats, binary_stats;
+        trace_info_t text_info = {.s = 5, .E = 1, .b = 5, .filename = path};
+        trace_info_t binary_info = text_info;
+        binary_info.filename = btrace;
+        if (n_expected >= 0 && (!run_libcsim(&text_info, &text_stats) ||
+                                !run_libcsim(&binary_info, &binary_stats) ||
+                                count_matches(&text_stats, &binary_stats) !=
+                                    5)) {
+            fprintf(stderr, "Error: %s simulates differently in binary\n",
+                    path);
+            ok = false;
+        }
+    }
+    (void)unlink(btrace);
+    globfree(&traces);
+    return ok;
+}
+
 /**
  * @brief Main routine
  */
@@ -287,5 +1237,55 @@ int main(int argc, char *argv[]) {
     /* Evaluate the student's cache simulator for correctness */
     test_csim();
 
+    /* And check the prefetchers' accounting */
+    if (!check_prefetch() || !check_prefetch_counts()) {
+        exit(1);
+    }
+
+    /* And the replacement policies */
+    if (!check_policies()) {
+        exit(1);
+    }
+
+    /* And the stack-distance mode */
+    if (!check_stack_distance()) {
+        exit(1);
+    }
+
+    /* And the -L hierarchy */
+    if (!check_hierarchy()) {
+        exit(1);
+    }
+
+    /* And the 3C miss classes */
+    if (!check_miss_classes()) {
+        exit(1);
+    }
+
+    /* And the sampled estimates */
+    if (!check_sampling()) {
+        exit(1);
+    }
+
+    /* And the write policies */
+    if (!check_write_policies()) {
+        exit(1);
+    }
+
+    /* And the interval output */
+    if (!check_intervals()) {
+        exit(1);
+    }
+
+    /* And checkpoints */
+    if (!check_checkpoint()) {
+        exit(1);
+    }
+
+    /* And the binary trace format */
+    if (!check_binary_roundtrip()) {
+        exit(1);
+    }
+
     exit(0);
 }
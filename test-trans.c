@@ -7,8 +7,11 @@
  * official submitted version as well.
  */
 
+#define _POSIX_C_SOURCE 200809L /* popen */
+
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <limits.h> // for LONG_MAX
 #include <signal.h>
@@ -21,6 +24,7 @@
 #include <unistd.h>
 
 #include "cachelab.h"
+#include "csim.h"
 
 #define CMD_BUFSIZE 334
 #define FILENAME_BUFSIZE 255
@@ -29,12 +33,21 @@
 static size_t M = 0;
 static size_t N = 0;
 
+/* Generate binary trace files instead of streaming text traces */
+static bool binary_traces = false;
+
+/* Also check the multithreaded transpose of trans-par.c */
+static bool check_parallel_trans = false;
+
 /** @brief Results of testing the submitted transpose function */
 static struct {
     int funcid;
     bool correct;
     csim_stats_t stats;
-} results = {-1, false, {LONG_MAX, LONG_MAX, LONG_MAX, LONG_MAX, LONG_MAX}};
+} results = {-1,
+             false,
+             {LONG_MAX, LONG_MAX, LONG_MAX, LONG_MAX, LONG_MAX, 0, 0, 0, 0, 0,
+              0, 0}};
 
 /**
  * @brief Calculates the number of clock cycles for the trace
@@ -45,20 +58,28 @@ static unsigned long get_clock_cycles(unsigned long hits,
 }
 
 /**
- * @brief Generates a trace file for a specific transpose function.
+ * @brief Build the tracegen-ct command for a transpose function.
  *
- * @param[in] file_name File name where the trace should be stored
- * @param[in] i         Index of the transpose function to use
- *
- * @return True if the function succeeded, and false otherwise
+ * @param[out] cmd       Buffer of CMD_BUFSIZE bytes for the command
+ * @param[in]  file_name File name where the trace should be written
+ * @param[in]  i         Index of the transpose function to use
  */
-static bool generate_trace(const char *file_name, int i) {
-    char cmd[CMD_BUFSIZE];
-    snprintf(cmd, sizeof(cmd),
+static void trace_command(char *cmd, const char *file_name, int i) {
+    snprintf(cmd, CMD_BUFSIZE,
              "CONTECH_TRACE=%s ./tracegen-ct -M %ld -N %ld -F %d", file_name, M,
              N, i);
+}
 
-    int status = system(cmd);
+/**
+ * @brief Check how a tracegen-ct run ended.
+ *
+ * @param[in] cmd    Command that was run
+ * @param[in] status Exit status from system()
+ * @param[in] i      Index of the transpose function used
+ *
+ * @return True if tracegen-ct succeeded, and false otherwise
+ */
+static bool trace_status(const char *cmd, int status, int i) {
     if (status < 0) {
         printf("Failed to run tracegen-ct: %s\n", strerror(errno));
         return false;
@@ -84,23 +105,69 @@ static bool generate_trace(const char *file_name, int i) {
 }
 
 /**
- * @brief Compute statistics for a trace using the reference simulator.
+ * @brief Generates a trace file for a specific transpose function.
  *
- * @param[in]  file_name File name where the trace is be stored
- * @param[in]  s         log2 of the number of sets
- * @param[in]  E         associativity
- * @param[in]  b         log2 of the block size
- * @param[out] stats     Statistics computed from the trace file
+ * @param[in] file_name File name where the trace should be stored
+ * @param[in] i         Index of the transpose function to use
  *
  * @return True if the function succeeded, and false otherwise
  */
-static bool compute_stats(const char *file_name, unsigned int s, unsigned int E,
-                          unsigned int b, csim_stats_t *stats) {
+static bool generate_trace(const char *file_name, int i) {
     char cmd[CMD_BUFSIZE];
-    snprintf(cmd, sizeof(cmd), "./csim-ref -s %u -E %u -b %u -t %s > /dev/null",
-             s, E, b, file_name);
+    trace_command(cmd, file_name, i);
+    return trace_status(cmd, system(cmd), i);
+}
 
-    int status = system(cmd);
+/**
+ * @brief Generates a binary trace file for a specific transpose function.
+ *
+ * tracegen-ct only writes text, so its trace goes through a pipe into
+ * traceconv, which encodes the records as they arrive. The text is never
+ * stored.
+ *
+ * @param[in] file_name File name where the binary trace should be stored
+ * @param[in] i         Index of the transpose function to use
+ *
+ * @return True if the function succeeded, and false otherwise
+ */
+static bool generate_binary_trace(const char *file_name, int i) {
+    char cmd[CMD_BUFSIZE];
+    snprintf(cmd, sizeof(cmd), "./traceconv - %s 2>/dev/null", file_name);
+    FILE *conv_in = popen(cmd, "w");
+    if (conv_in == NULL) {
+        printf("Failed to run traceconv: %s\n", strerror(errno));
+        return false;
+    }
+
+    /* Let tracegen-ct inherit the write end of the pipe */
+    int fd = fileno(conv_in);
+    (void)fcntl(fd, F_SETFD, 0);
+    char pipe_name[FILENAME_BUFSIZE];
+    snprintf(pipe_name, sizeof(pipe_name), "/dev/fd/%d", fd);
+
+    bool traced = generate_trace(pipe_name, i);
+    int status = pclose(conv_in);
+    if (!traced) {
+        return false;
+    }
+    if (status < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        printf("Failed to encode the trace of function %d into %s. Run "
+               "make traceconv first.\n",
+               i, file_name);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Check how a csim-ref run ended and load the statistics it stored.
+ *
+ * @param[in]  status Exit status from pclose()
+ * @param[out] stats  Statistics computed by csim-ref
+ *
+ * @return True if csim-ref succeeded, and false otherwise
+ */
+static bool collect_stats(int status, csim_stats_t *stats) {
     if (status < 0) {
         printf("Failed to run csim-ref: %s\n", strerror(errno));
         return false;
@@ -116,6 +183,7 @@ static bool compute_stats(const char *file_name, unsigned int s, unsigned int E,
 
     /* Collect results from the reference simulator */
     bool success = loadSummary(stats);
+    (void)remove(".csim_results");
     if (!success) {
         printf("Cache simulator error.  Simulator generated invalid "
                "results\n");
@@ -125,6 +193,157 @@ static bool compute_stats(const char *file_name, unsigned int s, unsigned int E,
     return true;
 }
 
+/**
+ * @brief Start the reference simulator on a text trace written to the
+ *        returned stream.
+ */
+static FILE *start_reference(unsigned int s, unsigned int E, unsigned int b) {
+    char cmd[CMD_BUFSIZE];
+    snprintf(cmd, sizeof(cmd),
+             "./csim-ref -s %u -E %u -b %u -t /dev/stdin > /dev/null", s, E,
+             b);
+    FILE *ref_in = popen(cmd, "w");
+    if (ref_in == NULL) {
+        printf("Failed to run csim-ref: %s\n", strerror(errno));
+    }
+    return ref_in;
+}
+
+/**
+ * @brief Compute statistics for a binary trace file using the reference
+ *        simulator, which only reads text, so the trace is converted into
+ *        its input.
+ *
+ * @return True if the function succeeded, and false otherwise
+ */
+static bool reference_stats(const char *file_name, unsigned int s,
+                            unsigned int E, unsigned int b,
+                            csim_stats_t *stats) {
+    FILE *in = fopen(file_name, "rb");
+    if (in == NULL) {
+        printf("Failed to open %s: %s\n", file_name, strerror(errno));
+        return false;
+    }
+    FILE *ref_in = start_reference(s, E, b);
+    if (ref_in == NULL) {
+        fclose(in);
+        return false;
+    }
+    bool converted = convertTraceToText(in, ref_in, NULL);
+    fclose(in);
+    int status = pclose(ref_in);
+    if (!converted) {
+        printf("Failed to convert %s for csim-ref\n", file_name);
+        return false;
+    }
+    return collect_stats(status, stats);
+}
+
+/**
+ * @brief Compute statistics for a trace file with libcsim.
+ *
+ * @return True if the function succeeded, and false otherwise
+ */
+static bool libcsim_stats(const char *file_name, unsigned int s,
+                          unsigned int E, unsigned int b,
+                          csim_stats_t *stats) {
+    csim_t *sim = csim_create((int)s, (int)E, (int)b, NULL);
+    if (sim == NULL) {
+        printf("Cache simulator error.  Could not create a cache (s=%u, "
+               "E=%u, b=%u)\n",
+               s, E, b);
+        return false;
+    }
+
+    bool success = csim_simulate_file(sim, file_name);
+    success = csim_get_stats(sim, stats) && success;
+    csim_destroy(sim);
+    if (!success) {
+        printf("Cache simulator error.  Could not simulate %s\n", file_name);
+    }
+    return success;
+}
+
+/**
+ * @brief Compute statistics for a binary trace file.
+ *
+ * csim-ref is the simulator that grades, but it has to be fed the trace
+ * as text, while libcsim reads the binary trace directly and much faster.
+ * So the first trace of a run is simulated by both, and libcsim goes on to
+ * simulate the rest only if it agreed with csim-ref; otherwise csim-ref
+ * does.
+ *
+ * @param[in]  file_name File name where the trace is be stored
+ * @param[in]  s         log2 of the number of sets
+ * @param[in]  E         associativity
+ * @param[in]  b         log2 of the block size
+ * @param[out] stats     Statistics computed from the trace file
+ *
+ * @return True if the function succeeded, and false otherwise
+ */
+static bool compute_stats(const char *file_name, unsigned int s, unsigned int E,
+                          unsigned int b, csim_stats_t *stats) {
+    static bool checked = false;
+    static bool use_libcsim = false;
+
+    if (checked) {
+        return use_libcsim ? libcsim_stats(file_name, s, E, b, stats)
+                           : reference_stats(file_name, s, E, b, stats);
+    }
+
+    if (!reference_stats(file_name, s, E, b, stats)) {
+        return false;
+    }
+    csim_stats_t lib;
+    checked = true;
+    use_libcsim = libcsim_stats(file_name, s, E, b, &lib) &&
+                  lib.hits == stats->hits && lib.misses == stats->misses &&
+                  lib.evictions == stats->evictions;
+    if (!use_libcsim) {
+        printf("Warning: libcsim (csim.c) disagrees with csim-ref on %s; "
+               "using csim-ref for every trace\n",
+               file_name);
+    }
+    return true;
+}
+
+/**
+ * @brief Generate and simulate a trace in one go, without a trace file.
+ *
+ * The reference simulator is started reading its stdin, and tracegen-ct
+ * writes the trace straight into that pipe, so the simulator consumes
+ * records as they are generated. Closing our end of the pipe after
+ * tracegen-ct exits ends the simulator's input even if tracegen-ct failed.
+ *
+ * @param[in]  i     Index of the transpose function to use
+ * @param[in]  s     log2 of the number of sets
+ * @param[in]  E     associativity
+ * @param[in]  b     log2 of the block size
+ * @param[out] stats Statistics computed from the trace
+ *
+ * @return True if the function succeeded, and false otherwise
+ */
+static bool stream_stats(int i, unsigned int s, unsigned int E,
+                         unsigned int b, csim_stats_t *stats) {
+    FILE *ref_in = start_reference(s, E, b);
+    if (ref_in == NULL) {
+        return false;
+    }
+
+    /* Let tracegen-ct inherit the write end of the pipe */
+    int fd = fileno(ref_in);
+    (void)fcntl(fd, F_SETFD, 0);
+    char file_name[FILENAME_BUFSIZE];
+    snprintf(file_name, sizeof(file_name), "/dev/fd/%d", fd);
+
+    bool traced = generate_trace(file_name, i);
+    int status = pclose(ref_in);
+    if (!traced) {
+        return false;
+    }
+    return collect_stats(status, stats);
+}
+
 /**
  * @brief Evaluate the performance of the registered transpose functions
  */
@@ -145,28 +364,36 @@ static void eval_perf(unsigned int s, unsigned int E, unsigned int b,
             continue;
         }
 
-        /* Run and generate a trace file */
-        char file_name[FILENAME_BUFSIZE];
-        sprintf(file_name, "trace.f%d", i);
-
         printf("\nFunction %d out of %d (%s)\n", i, func_counter,
                func_list[i].description);
-        printf("Step 1: Validating and generating memory traces\n");
-
-        if (!generate_trace(file_name, i)) {
-            continue;
-        }
-
-        /* Run the reference simulator */
         csim_stats_t stats;
 
-        printf("Step 2: Evaluating performance (s=%d, E=%d, b=%d)\n", s, E, b);
-        if (!compute_stats(file_name, s, E, b, &stats)) {
-            continue;
+        if (binary_traces) {
+            /* Run and generate a trace file */
+            char file_name[FILENAME_BUFSIZE];
+            sprintf(file_name, "trace.f%d", i);
+
+            printf("Step 1: Validating and generating memory traces\n");
+            if (!generate_binary_trace(file_name, i)) {
+                continue;
+            }
+
+            /* Run the simulator on it */
+            printf("Step 2: Evaluating performance (s=%d, E=%d, b=%d)\n", s, E,
+                   b);
+            if (!compute_stats(file_name, s, E, b, &stats)) {
+                continue;
+            }
+        } else {
+            /* Pipe the trace straight into the reference simulator */
+            printf("Validating and evaluating performance (s=%d, E=%d, "
+                   "b=%d)\n",
+                   s, E, b);
+            if (!stream_stats(i, s, E, b, &stats)) {
+                continue;
+            }
         }
 
-        (void)remove(".csim_results");
-
         /* Mark this function as correct */
         printf("Results for func %d (%s): hits:%ld, misses:%ld, evictions:%ld, "
                "clock_cycles:%ld\n",
@@ -181,15 +408,67 @@ static void eval_perf(unsigned int s, unsigned int E, unsigned int b,
     }
 }
 
+/**
+ * @brief Check the multithreaded transpose natively with 1 to 4 threads
+ *
+ * Its worker threads are not traced, so it is run on the real machine and
+ * only its results are checked. Each thread count gets a fresh pool and
+ * two calls: the first keeps to the static split, the second steals.
+ *
+ * @return True if every call produced the transpose of A
+ */
+static bool check_parallel(void) {
+    int i = func_counter;
+    registerParallelFunctions();
+
+    double(*A)[M] = malloc(M * N * sizeof(double));
+    double(*B)[N] = malloc(M * N * sizeof(double));
+    double(*target)[N] = malloc(M * N * sizeof(double));
+    static double tmp[TMPCOUNT];
+    if (A == NULL || B == NULL || target == NULL) {
+        printf("Error: out of memory\n");
+        exit(1);
+    }
+    initMatrix(M, N, A, target);
+    correctTrans(M, N, A, target);
+
+    printf("\nFunction %d out of %d (%s)\n", i, func_counter,
+           func_list[i].description);
+    bool correct = true;
+    for (int threads = 1; threads <= 4; threads++) {
+        setTransThreads(threads);
+        for (int call = 0; call < 2; call++) {
+            memset(B, 0, M * N * sizeof(double));
+            (*func_list[i].func_ptr)(M, N, A, B, tmp);
+            if (memcmp(B, target, M * N * sizeof(double)) != 0) {
+                printf("Error: incorrect result with %d threads, call %d\n",
+                       threads, call + 1);
+                correct = false;
+            }
+        }
+    }
+    setTransThreads(0);
+    printf("Results for func %d (%s): correctness=%d\n", i,
+           func_list[i].description, correct);
+
+    free(A);
+    free(B);
+    free(target);
+    return correct;
+}
+
 /**
  * @brief Print usage info
  */
 static void usage(char *argv[]) {
-    printf("Usage: %s [-h] [-s] -M <rows> -N <cols>\n", argv[0]);
+    printf("Usage: %s [-h] [-s] [-l] [-B] [-P] -M <rows> -N <cols>\n",
+           argv[0]);
     printf("Options:\n");
     printf("  -h          Print this help message.\n");
     printf("  -s          Check official submission only.\n");
     printf("  -l          Simulate large (Haswell L1) cache\n");
+    printf("  -B          Use binary trace files\n");
+    printf("  -P          Also check the multithreaded transpose natively\n");
     printf("  -M <rows>   Number of destination matrix rows (max %d)\n", MAXN);
     printf("  -N <cols>   Number of destination matrix columns (max %d)\n",
            MAXN);
@@ -222,13 +501,13 @@ static void sigalrm_handler(int signum) {
  * @brief Main routine
  */
 int main(int argc, char *argv[]) {
-    int status;
+    int status = 0;
     int c;
 
     bool submission_only = false;
     bool use_large_cache = false;
 
-    while ((c = getopt(argc, argv, "hcslM:N:")) != -1) {
+    while ((c = getopt(argc, argv, "hcslBPM:N:")) != -1) {
         switch (c) {
         case 'M':
             M = (size_t)atoi(optarg);
@@ -242,6 +521,12 @@ int main(int argc, char *argv[]) {
         case 'l':
             use_large_cache = true;
             break;
+        case 'B':
+            binary_traces = true;
+            break;
+        case 'P':
+            check_parallel_trans = true;
+            break;
         case 'h':
             usage(argv);
             exit(0);
@@ -287,6 +572,8 @@ int main(int argc, char *argv[]) {
         eval_perf(TEST_LOG_SET, TEST_ASSOC, TEST_LOG_BLOCK, submission_only);
     }
 
+    bool parallel_correct = !check_parallel_trans || check_parallel();
+
     /* Emit the results for this particular test */
     if (results.funcid == -1) {
         printf("\nError: We could not find your transpose_submit() function\n");
@@ -304,6 +591,10 @@ int main(int argc, char *argv[]) {
                get_clock_cycles(results.stats.hits, results.stats.misses));
     }
 
+    if (!parallel_correct) {
+        status = 1;
+    }
+
     /* Remove hidden trace files */
     for (int i = 0; i < MAX_TRANS_FUNCS; i++) {
         char traceFile[FILENAME_BUFSIZE];
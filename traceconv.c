@@ -0,0 +1,86 @@
+/**
+ * @file traceconv.c
+ * @brief Converts memory traces between the text and binary formats
+ *
+ * The text format has one "op address,size" record per line. The binary
+ * format, described in cachelab.h, stores the same records with
+ * delta-encoded addresses in a few bytes each. csim reads either format.
+ */
+
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cachelab.h"
+
+/**
+ * @brief Print usage info
+ */
+static void usage(char *argv[]) {
+    printf("Usage: %s [-h] [-d] <input> <output>\n", argv[0]);
+    printf("Options:\n");
+    printf("  -h    Print this help message.\n");
+    printf("  -d    Decode a binary trace back to text.\n");
+    printf("Use - for <input> or <output> to read stdin or write stdout.\n");
+    printf("Example: %s traces/csim/long.trace long.btrace\n", argv[0]);
+}
+
+/**
+ * @brief Main routine
+ */
+int main(int argc, char *argv[]) {
+    bool decode = false;
+    int c;
+
+    while ((c = getopt(argc, argv, "hd")) != -1) {
+        switch (c) {
+        case 'd':
+            decode = true;
+            break;
+        case 'h':
+            usage(argv);
+            exit(0);
+        default:
+            usage(argv);
+            exit(1);
+        }
+    }
+
+    if (argc - optind != 2) {
+        printf("Error: Missing required argument\n");
+        usage(argv);
+        exit(1);
+    }
+
+    const char *in_path = argv[optind];
+    const char *out_path = argv[optind + 1];
+    FILE *in = strcmp(in_path, "-") == 0 ? stdin : fopen(in_path, "rb");
+    if (in == NULL) {
+        perror(in_path);
+        exit(1);
+    }
+    FILE *out = strcmp(out_path, "-") == 0 ? stdout : fopen(out_path, "wb");
+    if (out == NULL) {
+        perror(out_path);
+        exit(1);
+    }
+
+    uint64_t count;
+    bool ok = decode ? convertTraceToText(in, out, &count)
+                     : convertTraceToBinary(in, out, &count);
+    if (in != stdin) {
+        fclose(in);
+    }
+    if (out != stdout && fclose(out) != 0) {
+        ok = false;
+    }
+    if (!ok) {
+        fprintf(stderr, "Error: failed to convert %s\n", in_path);
+        exit(1);
+    }
+    fprintf(stderr, "%lu records\n", (unsigned long)count);
+    return 0;
+}
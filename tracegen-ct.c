@@ -79,10 +79,11 @@ bool validate(int fn, double A[N][M], double Acopy[N][M], double B[M][N],
 }
 
 static void usage(char *cmd) {
-    fprintf(stderr, "Usage: %s [-h] [-M M] [-N N] [-F ID]\n", cmd);
+    fprintf(stderr, "Usage: %s [-h] [-T] [-M M] [-N N] [-F ID]\n", cmd);
     fprintf(stderr, "  -N N    Set number of rows of A / cols of B\n");
     fprintf(stderr, "  -M M    Set number of cols of A / rows of B\n");
     fprintf(stderr, "  -F ID   Run function number ID\n");
+    fprintf(stderr, "  -T      Run the autotuner's candidate functions\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "The generated trace file is written to default.trace "
                     "by default, but a\n");
@@ -111,7 +112,8 @@ int entry(int argc, char *argv[]) {
 
     int c;
     int selectedFunc = -1;
-    while ((c = getopt(argc, argv, "hvM:N:F:")) != -1) {
+    bool tuning = false;
+    while ((c = getopt(argc, argv, "hvTM:N:F:")) != -1) {
         switch (c) {
         case 'M':
             M = (size_t)atoi(optarg);
@@ -124,6 +126,9 @@ int entry(int argc, char *argv[]) {
             break;
         case 'v':
             break;
+        case 'T':
+            tuning = true;
+            break;
         case 'h':
         default:
             usage(argv[0]);
@@ -147,7 +152,11 @@ int entry(int argc, char *argv[]) {
     alarm(360);
 
     /*  Register transpose functions */
-    registerFunctions();
+    if (tuning) {
+        registerTuningFunctions();
+    } else {
+        registerFunctions();
+    }
 
     /* Clear out matrices */
     memset(bigA, 0, sizeof(bigA));
@@ -0,0 +1,240 @@
+/**
+ * @file trans-par.c
+ * @brief A multithreaded tiled transpose for large matrices
+ *
+ * trans_parallel() splits the grid of PAR_TILE by PAR_TILE tiles of A
+ * across a pool of threads that lives from the first call to the end of
+ * the program. The calling thread takes share 0 and the workers the rest,
+ * handed over with a pair of barriers as in csim.c's -j.
+ *
+ * The tiles are numbered down the columns of A, that is along the rows of
+ * B, and each thread owns the same contiguous run of them on every call.
+ * Its share of B is therefore one stretch of memory that it writes itself.
+ *
+ * A thread that finishes its run steals tiles from the runs of the others,
+ * since ragged edge tiles, rectangular shapes and descheduled threads
+ * would otherwise leave the rest waiting at the barrier. The first call
+ * after the pool starts does not steal, so each thread writes exactly its
+ * own run. When B is freshly mapped, that call touches every page of it
+ * from the thread that owns it, and the kernel places each page on that
+ * thread's NUMA node. bench-trans restarts the pool with setTransThreads()
+ * before each fresh B for this reason.
+ *
+ * The pool keeps state between calls, which trans.c may not, so it lives
+ * here and registerParallelFunctions() registers it. bench-trans times it
+ * and test-trans -P checks its results natively; the pool is not handed
+ * in, traced or scored.
+ */
+
+#define _POSIX_C_SOURCE 200809L /* pthread_barrier_t, sysconf */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "cachelab.h"
+
+/** @brief Rows and columns of A in one unit of work */
+#define PAR_TILE 64
+
+/** @brief Rows and columns of the cache-blocked walk within a unit */
+#define PAR_BLOCK 8
+
+/** @brief Most threads the pool will start */
+#define PAR_MAX_THREADS 64
+
+/** @brief One thread's run of tiles, alone on its cache line */
+typedef struct {
+    size_t next; /* next tile to take, advanced by owner and thieves */
+    size_t end;  /* one past the run's last tile */
+} __attribute__((aligned(64))) share_t;
+
+/* The transpose the pool is working on */
+static struct {
+    size_t M;
+    size_t N;
+    double *A;
+    double *B;
+    size_t rows; /* tiles down A */
+    size_t cols; /* tiles across A */
+    bool steal;  /* take tiles from other runs once ours is done */
+} job;
+
+static share_t shares[PAR_MAX_THREADS];
+
+/* Threads requested with setTransThreads(), and threads running */
+static int requested_threads = 0;
+static int pool_threads = 0;
+
+static pthread_t workers[PAR_MAX_THREADS];
+static pthread_barrier_t job_ready;
+static pthread_barrier_t job_done;
+static bool pool_done = false;
+
+/* Set when the pool starts; the next job keeps to the static split */
+static bool first_job = false;
+
+/**
+ * @brief Transposes tile k of the current job.
+ */
+static void run_tile(size_t k) {
+    size_t M = job.M;
+    size_t N = job.N;
+    double(*A)[M] = (double(*)[M])job.A;
+    double(*B)[N] = (double(*)[N])job.B;
+
+    size_t i0 = k % job.rows * PAR_TILE;
+    size_t j0 = k / job.rows * PAR_TILE;
+    size_t i1 = i0 + PAR_TILE < N ? i0 + PAR_TILE : N;
+    size_t j1 = j0 + PAR_TILE < M ? j0 + PAR_TILE : M;
+    for (size_t bi = i0; bi < i1; bi += PAR_BLOCK) {
+        size_t bi1 = bi + PAR_BLOCK < i1 ? bi + PAR_BLOCK : i1;
+        for (size_t bj = j0; bj < j1; bj += PAR_BLOCK) {
+            size_t bj1 = bj + PAR_BLOCK < j1 ? bj + PAR_BLOCK : j1;
+            for (size_t i = bi; i < bi1; i++) {
+                for (size_t j = bj; j < bj1; j++) {
+                    B[j][i] = A[i][j];
+                }
+            }
+        }
+    }
+}
+
+/**
+ * @brief Runs thread id's share of the job, then steals from the others
+ *        unless the job forbids it.
+ */
+static void run_share(int id) {
+    int victims = job.steal ? pool_threads : 1;
+    for (int v = 0; v < victims; v++) {
+        share_t *share = &shares[(id + v) % pool_threads];
+        for (;;) {
+            size_t k = __atomic_fetch_add(&share->next, 1, __ATOMIC_RELAXED);
+            if (k >= share->end) {
+                break;
+            }
+            run_tile(k);
+        }
+    }
+}
+
+/**
+ * @brief Worker thread: run a share of each job the caller publishes.
+ */
+static void *worker_main(void *arg) {
+    int id = (int)(long)arg;
+    for (;;) {
+        pthread_barrier_wait(&job_ready);
+        if (pool_done) {
+            return NULL;
+        }
+        run_share(id);
+        pthread_barrier_wait(&job_done);
+    }
+}
+
+/**
+ * @brief Stop the worker threads and wait for them.
+ */
+static void stop_pool(void) {
+    if (pool_threads <= 1) {
+        pool_threads = 0;
+        return;
+    }
+    pool_done = true;
+    pthread_barrier_wait(&job_ready);
+    for (int i = 1; i < pool_threads; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    pthread_barrier_destroy(&job_ready);
+    pthread_barrier_destroy(&job_done);
+    pool_done = false;
+    pool_threads = 0;
+}
+
+/**
+ * @brief Start the requested number of threads, or one per online CPU.
+ */
+static void start_pool(void) {
+    long threads = requested_threads;
+    if (threads <= 0) {
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (threads < 1) {
+        threads = 1;
+    }
+    if (threads > PAR_MAX_THREADS) {
+        threads = PAR_MAX_THREADS;
+    }
+    pool_threads = (int)threads;
+    first_job = true;
+    if (pool_threads == 1) {
+        return;
+    }
+
+    pthread_barrier_init(&job_ready, NULL, (unsigned)pool_threads);
+    pthread_barrier_init(&job_done, NULL, (unsigned)pool_threads);
+    for (long i = 1; i < pool_threads; i++) {
+        if (pthread_create(&workers[i], NULL, worker_main, (void *)i) != 0) {
+            fprintf(stderr, "failed to start transpose thread\n");
+            exit(1);
+        }
+    }
+}
+
+/**
+ * @brief Sets how many threads trans_parallel() uses from its next call
+ *        on; 0, the default, means one per online CPU. That next call
+ *        starts a new pool and so keeps to the static split.
+ */
+void setTransThreads(int threads) {
+    requested_threads = threads;
+    stop_pool();
+}
+
+/**
+ * @brief Transposes A into B with the thread pool.
+ *
+ * Jobs with fewer tiles than threads are not worth waking the pool for
+ * and run on the calling thread alone. The first call after the pool
+ * starts runs without stealing; see the file comment.
+ */
+static void trans_parallel(size_t M, size_t N, double A[N][M], double B[M][N],
+                           double tmp[TMPCOUNT]) {
+    if (pool_threads == 0) {
+        start_pool();
+    }
+
+    job.M = M;
+    job.N = N;
+    job.A = &A[0][0];
+    job.B = &B[0][0];
+    job.rows = (N + PAR_TILE - 1) / PAR_TILE;
+    job.cols = (M + PAR_TILE - 1) / PAR_TILE;
+    size_t tiles = job.rows * job.cols;
+    job.steal = !first_job;
+    first_job = false;
+
+    if (pool_threads == 1 || tiles < (size_t)pool_threads) {
+        for (size_t k = 0; k < tiles; k++) {
+            run_tile(k);
+        }
+        return;
+    }
+
+    for (int t = 0; t < pool_threads; t++) {
+        shares[t].next = tiles * (size_t)t / (size_t)pool_threads;
+        shares[t].end = tiles * (size_t)(t + 1) / (size_t)pool_threads;
+    }
+    pthread_barrier_wait(&job_ready);
+    run_share(0);
+    pthread_barrier_wait(&job_done);
+}
+
+/**
+ * @brief Registers the multithreaded transpose.
+ */
+void registerParallelFunctions(void) {
+    registerTransFunction(trans_parallel, "Multithreaded tiled transpose");
+}
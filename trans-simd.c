@@ -0,0 +1,162 @@
+/**
+ * @file trans-simd.c
+ * @brief Transposes built from SSE2 and AVX2 in-register micro-kernels
+ *
+ * Each micro-kernel loads a small square of A into vector registers,
+ * transposes it there with unpack and permute instructions, and stores the
+ * result to B, so every load and store moves two or four doubles at once.
+ * The transposes tile the matrix with one micro-kernel and finish the
+ * ragged right and bottom edges with transposeRange() from trans.c, so a
+ * tall or wide edge is still walked a cache line at a time.
+ *
+ * They hold doubles in registers, which trans.c may not do, so they live
+ * here and are registered by registerSimdFunctions(), which trans.c's
+ * registerFunctions() calls. tracegen-ct traces them like trans.c, with
+ * each vector load or store recorded as one access.
+ */
+
+#include "cachelab.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TRANS_X86 1
+#endif
+
+#ifdef TRANS_X86
+/**
+ * @brief Transposes the parts of A that no tile covered: columns cols..M
+ *        of every row, and rows rows..N of the first cols columns.
+ */
+static void trans_edges(size_t M, size_t N, double A[N][M], double B[M][N],
+                        double tmp[TMPCOUNT], size_t rows, size_t cols) {
+    transposeRange(M, N, A, B, tmp, 0, N, cols, M);
+    transposeRange(M, N, A, B, tmp, rows, N, 0, cols);
+}
+
+/**
+ * @brief SSE2 micro-kernel: transposes the 4x4 square at A[i][j].
+ *
+ * Each 2x2 quarter is two row vectors of A; unpacking their low and high
+ * halves gives the two row vectors of B.
+ */
+static inline void kernel_sse2_4x4(size_t M, size_t N, double A[N][M],
+                                   double B[M][N], size_t i, size_t j) {
+    for (size_t r = 0; r < 4; r += 2) {
+        for (size_t c = 0; c < 4; c += 2) {
+            __m128d x0 = _mm_loadu_pd(&A[i + r][j + c]);
+            __m128d x1 = _mm_loadu_pd(&A[i + r + 1][j + c]);
+            _mm_storeu_pd(&B[j + c][i + r], _mm_unpacklo_pd(x0, x1));
+            _mm_storeu_pd(&B[j + c + 1][i + r], _mm_unpackhi_pd(x0, x1));
+        }
+    }
+}
+
+/**
+ * @brief AVX2 micro-kernel: transposes the 4x4 square at A[i][j].
+ *
+ * Unpacking pairs of rows interleaves their elements within each 128-bit
+ * lane; swapping lanes between the two pairs then completes the columns.
+ */
+__attribute__((target("avx2"))) static inline void
+kernel_avx2_4x4(size_t M, size_t N, double A[N][M], double B[M][N], size_t i,
+                size_t j) {
+    __m256d r0 = _mm256_loadu_pd(&A[i][j]);
+    __m256d r1 = _mm256_loadu_pd(&A[i + 1][j]);
+    __m256d r2 = _mm256_loadu_pd(&A[i + 2][j]);
+    __m256d r3 = _mm256_loadu_pd(&A[i + 3][j]);
+
+    /* t0 = a00 a10 a02 a12, t1 = a01 a11 a03 a13, likewise rows 2, 3 */
+    __m256d t0 = _mm256_unpacklo_pd(r0, r1);
+    __m256d t1 = _mm256_unpackhi_pd(r0, r1);
+    __m256d t2 = _mm256_unpacklo_pd(r2, r3);
+    __m256d t3 = _mm256_unpackhi_pd(r2, r3);
+
+    _mm256_storeu_pd(&B[j][i], _mm256_permute2f128_pd(t0, t2, 0x20));
+    _mm256_storeu_pd(&B[j + 1][i], _mm256_permute2f128_pd(t1, t3, 0x20));
+    _mm256_storeu_pd(&B[j + 2][i], _mm256_permute2f128_pd(t0, t2, 0x31));
+    _mm256_storeu_pd(&B[j + 3][i], _mm256_permute2f128_pd(t1, t3, 0x31));
+}
+
+/** @brief Transposes A in 4x4 tiles with the SSE2 micro-kernel. */
+static void trans_sse2_4x4(size_t M, size_t N, double A[N][M], double B[M][N],
+                           double tmp[TMPCOUNT]) {
+    size_t rows = N / 4 * 4;
+    size_t cols = M / 4 * 4;
+    for (size_t i = 0; i < rows; i += 4) {
+        for (size_t j = 0; j < cols; j += 4) {
+            kernel_sse2_4x4(M, N, A, B, i, j);
+        }
+    }
+    trans_edges(M, N, A, B, tmp, rows, cols);
+}
+
+/**
+ * @brief Transposes A in 8x8 tiles, a cache line of doubles on a side,
+ *        as four SSE2 4x4 micro-kernels each.
+ */
+static void trans_sse2_8x8(size_t M, size_t N, double A[N][M], double B[M][N],
+                           double tmp[TMPCOUNT]) {
+    size_t rows = N / 8 * 8;
+    size_t cols = M / 8 * 8;
+    for (size_t i = 0; i < rows; i += 8) {
+        for (size_t j = 0; j < cols; j += 8) {
+            kernel_sse2_4x4(M, N, A, B, i, j);
+            kernel_sse2_4x4(M, N, A, B, i, j + 4);
+            kernel_sse2_4x4(M, N, A, B, i + 4, j);
+            kernel_sse2_4x4(M, N, A, B, i + 4, j + 4);
+        }
+    }
+    trans_edges(M, N, A, B, tmp, rows, cols);
+}
+
+/** @brief Transposes A in 4x4 tiles with the AVX2 micro-kernel. */
+__attribute__((target("avx2"))) static void
+trans_avx2_4x4(size_t M, size_t N, double A[N][M], double B[M][N],
+               double tmp[TMPCOUNT]) {
+    size_t rows = N / 4 * 4;
+    size_t cols = M / 4 * 4;
+    for (size_t i = 0; i < rows; i += 4) {
+        for (size_t j = 0; j < cols; j += 4) {
+            kernel_avx2_4x4(M, N, A, B, i, j);
+        }
+    }
+    trans_edges(M, N, A, B, tmp, rows, cols);
+}
+
+/**
+ * @brief Transposes A in 8x8 tiles as four AVX2 4x4 micro-kernels each.
+ */
+__attribute__((target("avx2"))) static void
+trans_avx2_8x8(size_t M, size_t N, double A[N][M], double B[M][N],
+               double tmp[TMPCOUNT]) {
+    size_t rows = N / 8 * 8;
+    size_t cols = M / 8 * 8;
+    for (size_t i = 0; i < rows; i += 8) {
+        for (size_t j = 0; j < cols; j += 8) {
+            kernel_avx2_4x4(M, N, A, B, i, j);
+            kernel_avx2_4x4(M, N, A, B, i, j + 4);
+            kernel_avx2_4x4(M, N, A, B, i + 4, j);
+            kernel_avx2_4x4(M, N, A, B, i + 4, j + 4);
+        }
+    }
+    trans_edges(M, N, A, B, tmp, rows, cols);
+}
+#endif
+
+/**
+ * @brief Registers the transposes the CPU supports: the SSE2 ones on any
+ *        x86-64, the AVX2 ones where the CPU has AVX2, none elsewhere.
+ */
+void registerSimdFunctions(void) {
+#ifdef TRANS_X86
+    registerTransFunction(trans_sse2_4x4, "SSE2 4x4 micro-kernel transpose");
+    registerTransFunction(trans_sse2_8x8, "SSE2 8x8 micro-kernel transpose");
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        registerTransFunction(trans_avx2_4x4,
+                              "AVX2 4x4 micro-kernel transpose");
+        registerTransFunction(trans_avx2_8x8,
+                              "AVX2 8x8 micro-kernel transpose");
+    }
+#endif
+}
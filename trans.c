@@ -31,6 +31,7 @@
 
 #include <assert.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 
 #include "cachelab.h"
@@ -49,10 +50,6 @@
  * @return True if B is the transpose of A, and false otherwise.
  */
 
-void transpose_32(size_t M, size_t N, double A[N][M], double B[M][N],
-                  double tmp[TMPCOUNT]);
-void transpose_1024(size_t M, size_t N, double A[N][M], double B[M][N],
-                    double tmp[TMPCOUNT]);
 #ifndef NDEBUG
 static bool is_transpose(size_t M, size_t N, double A[N][M], double B[M][N]) {
     for (size_t i = 0; i < N; i++) {
@@ -120,63 +117,337 @@ static void trans_tmp(size_t M, size_t N, double A[N][M], double B[M][N],
     assert(is_transpose(M, N, A, B));
 }
 
+/** @brief Rows and columns in the base case: one 64-byte line of doubles */
+#define TILE 8
+
 /**
- * @brief The solution transpose function that will be graded.
+ * @brief Transposes the tile A[i0..i1)[j0..j1), at most TMPCOUNT doubles.
  *
- * You can call other transpose functions from here as you please.
- * It's OK to choose different functions based on array size, but
- * this function must be correct for all values of M and N.
+ * The tile is first copied, transposed, into the start of tmp and then
+ * written to B a row at a time. Each line of A and B is touched in
+ * one pass, so lines of A and B that map to the same set, as they do at
+ * every power-of-two width, can no longer evict each other mid-tile.
  */
-static void transpose_submit(size_t M, size_t N, double A[N][M], double B[M][N],
-                             double tmp[TMPCOUNT]) {
-    if (M == 32 && N == 32) {
-        transpose_32(M, N, A, B, tmp);
-    } else if (M == 1024 && N == 1024) {
-        transpose_1024(M, N, A, B, tmp);
+static void trans_tile(size_t M, size_t N, double A[N][M], double B[M][N],
+                       double tmp[TMPCOUNT], size_t i0, size_t i1, size_t j0,
+                       size_t j1) {
+    for (size_t i = i0; i < i1; i++) {
+        for (size_t j = j0; j < j1; j++) {
+            tmp[(j - j0) * (i1 - i0) + (i - i0)] = A[i][j];
+        }
+    }
+    for (size_t j = j0; j < j1; j++) {
+        for (size_t i = i0; i < i1; i++) {
+            B[j][i] = tmp[(j - j0) * (i1 - i0) + (i - i0)];
+        }
+    }
+}
+
+/**
+ * @brief Transposes A[i0..i1)[j0..j1) by halving its longer side.
+ *
+ * Splits fall on multiples of TILE from the origin, so every tile starts
+ * on a cache line of A and of B when the row length is a multiple of
+ * TILE, and the odd remainder ends up in the last tile of a row or column.
+ */
+static void trans_range(size_t M, size_t N, double A[N][M], double B[M][N],
+                        double tmp[TMPCOUNT], size_t i0, size_t i1, size_t j0,
+                        size_t j1) {
+    size_t rows = i1 - i0;
+    size_t cols = j1 - j0;
+    if (rows <= TILE && cols <= TILE) {
+        trans_tile(M, N, A, B, tmp, i0, i1, j0, j1);
+    } else if (rows >= cols) {
+        size_t mid = i0 + (rows / 2 + TILE - 1) / TILE * TILE;
+        trans_range(M, N, A, B, tmp, i0, mid, j0, j1);
+        trans_range(M, N, A, B, tmp, mid, i1, j0, j1);
     } else {
-        trans_tmp(M, N, A, B, tmp);
+        size_t mid = j0 + (cols / 2 + TILE - 1) / TILE * TILE;
+        trans_range(M, N, A, B, tmp, i0, i1, j0, mid);
+        trans_range(M, N, A, B, tmp, i0, i1, mid, j1);
+    }
+}
+
+/**
+ * @brief Transposes A[i0..i1)[j0..j1) with the tiled walk of
+ *        trans_recursive(), for transposes in other files to finish
+ *        their edges with.
+ */
+void transposeRange(size_t M, size_t N, double A[N][M], double B[M][N],
+                    double tmp[TMPCOUNT], size_t i0, size_t i1, size_t j0,
+                    size_t j1) {
+    if (i0 < i1 && j0 < j1) {
+        trans_range(M, N, A, B, tmp, i0, i1, j0, j1);
     }
 }
 
-void transpose_32(size_t M, size_t N, double A[N][M], double B[M][N],
-                  double tmp[TMPCOUNT]) {
-    // clock cycle: 40832
-    // for (size_t i = 0; i < 32; i += 8) {
-    //     for (size_t j = 0; j < 32; j += 8) {
-    //         for (size_t m = i; m < i + 8; m++) {
-    //             for (size_t n = j; n < j + 8; n++) {
-    //                 B[n][m] = A[m][n];
-    //             }
-    //         }
-    //     }
-    // }
-
-    for (size_t i = 0; i < N; i += 8) {
-        for (size_t j = 0; j < M; j += 8) {
-            for (size_t m = i; m < i + 8; m++) {
-                for (size_t n = j; n < j + 8; n++) {
-                    if (m != n) {
-                        B[n][m] = A[m][n];
-                    }
-                    if (n == (j + 7) && (i == j)) {
-                        B[m][m] = A[m][m];
-                    }
+/**
+ * @brief Cache-oblivious transpose for any M and N.
+ *
+ * Recursively halves the larger dimension down to TILE by TILE tiles, so
+ * at every level of the recursion the working set of A and B shrinks until
+ * it fits whatever cache is being simulated, with no per-size tuning.
+ */
+static void trans_recursive(size_t M, size_t N, double A[N][M],
+                            double B[M][N], double tmp[TMPCOUNT]) {
+    assert(M > 0);
+    assert(N > 0);
+
+    trans_range(M, N, A, B, tmp, 0, N, 0, M);
+
+    assert(is_transpose(M, N, A, B));
+}
+
+/** @brief Sets in the test cache, one line each */
+#define CACHE_SETS (1UL << TEST_LOG_SET)
+
+/** @brief Bytes in a line of the test cache */
+#define LINE_BYTES ((uintptr_t)1 << TEST_LOG_BLOCK)
+
+/** @brief Tiles of TILE by TILE doubles that fit in tmp at once */
+#define TMP_SLOTS (TMPCOUNT / (TILE * TILE))
+
+/**
+ * @brief Returns the sets of the test cache used by rows r0..r1 of
+ *        columns c0..c1 of a matrix width doubles wide, one bit per set.
+ *
+ * Sets come from the addresses themselves, so the matrices need not
+ * start in the same set, or even on a line boundary.
+ */
+static unsigned long tile_sets(const double *matrix, size_t width, size_t r0,
+                               size_t r1, size_t c0, size_t c1) {
+    unsigned long sets = 0;
+    for (size_t r = r0; r < r1; r++) {
+        uintptr_t first = (uintptr_t)&matrix[r * width + c0] / LINE_BYTES;
+        uintptr_t last = (uintptr_t)&matrix[r * width + c1 - 1] / LINE_BYTES;
+        for (uintptr_t line = first; line <= last; line++) {
+            sets |= 1UL << (line % CACHE_SETS);
+        }
+    }
+    return sets;
+}
+
+/**
+ * @brief Transpose staged through a part of tmp that A and B avoid.
+ *
+ * At a width of 1024 every row of A is 8 KB, a multiple of the test
+ * cache, so all lines of a tile of A fall in one set, all lines of its
+ * tile of B in another, and the diagonal tiles put both in the same set.
+ * Each TILE by TILE tile is therefore read from A a whole line at a time
+ * into one of the TMP_SLOTS slots of tmp, and only then written to B a
+ * whole line at a time, so no line of A or B is missed on twice.
+ *
+ * The slot in use is kept until the tile's lines of A or B fall in its
+ * sets. It then moves back to the slot A has just left, which stays clear
+ * longest as the tiles of a row advance through the sets. The sets of A,
+ * B and every slot are worked out from where each really lies, so the
+ * choice holds wherever the arrays are placed.
+ */
+static void trans_staged(size_t M, size_t N, double A[N][M], double B[M][N],
+                         double tmp[TMPCOUNT]) {
+    assert(M > 0);
+    assert(N > 0);
+
+    size_t slot = 0;
+    for (size_t i0 = 0; i0 < N; i0 += TILE) {
+        size_t i1 = i0 + TILE < N ? i0 + TILE : N;
+        for (size_t j0 = 0; j0 < M; j0 += TILE) {
+            size_t j1 = j0 + TILE < M ? j0 + TILE : M;
+            unsigned long busy = tile_sets(&A[0][0], M, i0, i1, j0, j1) |
+                                 tile_sets(&B[0][0], N, j0, j1, i0, i1);
+            for (size_t k = 0; k < TMP_SLOTS; k++) {
+                unsigned long slot_sets =
+                    tile_sets(&tmp[slot * TILE * TILE], TILE, 0, TILE, 0, TILE);
+                if ((busy & slot_sets) == 0) {
+                    break;
+                }
+                slot = (slot + TMP_SLOTS - 1) % TMP_SLOTS;
+            }
+
+            size_t base = slot * TILE * TILE;
+            for (size_t i = i0; i < i1; i++) {
+                for (size_t j = j0; j < j1; j++) {
+                    tmp[base + (i - i0) * TILE + (j - j0)] = A[i][j];
+                }
+            }
+            for (size_t j = j0; j < j1; j++) {
+                for (size_t i = i0; i < i1; i++) {
+                    B[j][i] = tmp[base + (i - i0) * TILE + (j - j0)];
                 }
             }
         }
     }
+
+    assert(is_transpose(M, N, A, B));
 }
-void transpose_1024(size_t M, size_t N, double A[N][M], double B[M][N],
-                    double tmp[TMPCOUNT]) {
-    for (size_t i = 0; i < N; i += 8) {
-        for (size_t j = 0; j < M; j += 8) {
-            for (size_t m = i; m < i + 8; m++) {
-                for (size_t n = j; n < j + 8; n++) {
-                    B[n][m] = A[m][n];
-                }
+
+/** @brief How trans_blocked() walks each tile */
+typedef enum {
+    WALK_ROW,      /* along the rows of A, down the columns of B */
+    WALK_ROW_DIAG, /* WALK_ROW, each diagonal element last in its row */
+    WALK_COL,      /* down the columns of A, along the rows of B */
+    WALK_COL_DIAG, /* WALK_COL, each diagonal element last in its column */
+    WALK_TMP       /* staged through tmp by trans_tile() */
+} walk_t;
+
+/**
+ * @brief Transposes A[i0..i1)[j0..j1) one row of A at a time.
+ *
+ * With diag, A[i][i] is copied after the rest of row i. On square
+ * matrices A[i] and B[i] map to the same sets, so copying it in place
+ * would evict the line of A that the rest of the row is read from.
+ */
+static void walk_rows(size_t M, size_t N, double A[N][M], double B[M][N],
+                      size_t i0, size_t i1, size_t j0, size_t j1, bool diag) {
+    for (size_t i = i0; i < i1; i++) {
+        for (size_t j = j0; j < j1; j++) {
+            if (!diag || i != j) {
+                B[j][i] = A[i][j];
+            }
+        }
+        if (diag && i >= j0 && i < j1) {
+            B[i][i] = A[i][i];
+        }
+    }
+}
+
+/** @brief Transposes A[i0..i1)[j0..j1) one row of B at a time. */
+static void walk_cols(size_t M, size_t N, double A[N][M], double B[M][N],
+                      size_t i0, size_t i1, size_t j0, size_t j1, bool diag) {
+    for (size_t j = j0; j < j1; j++) {
+        for (size_t i = i0; i < i1; i++) {
+            if (!diag || i != j) {
+                B[j][i] = A[i][j];
+            }
+        }
+        if (diag && j >= i0 && j < i1) {
+            B[j][j] = A[j][j];
+        }
+    }
+}
+
+/**
+ * @brief Transposes A in rows by cols tiles, walking each as walk says.
+ *
+ * The tiles at the right and bottom edges are cut short, so any M and N
+ * work. Staged tiles must fit in tmp.
+ */
+static void trans_blocked(size_t M, size_t N, double A[N][M], double B[M][N],
+                          double tmp[TMPCOUNT], size_t rows, size_t cols,
+                          walk_t walk) {
+    assert(walk != WALK_TMP || rows * cols <= TMPCOUNT);
+
+    for (size_t i0 = 0; i0 < N; i0 += rows) {
+        size_t i1 = i0 + rows < N ? i0 + rows : N;
+        for (size_t j0 = 0; j0 < M; j0 += cols) {
+            size_t j1 = j0 + cols < M ? j0 + cols : M;
+            switch (walk) {
+            case WALK_ROW:
+            case WALK_ROW_DIAG:
+                walk_rows(M, N, A, B, i0, i1, j0, j1, walk == WALK_ROW_DIAG);
+                break;
+            case WALK_COL:
+            case WALK_COL_DIAG:
+                walk_cols(M, N, A, B, i0, i1, j0, j1, walk == WALK_COL_DIAG);
+                break;
+            case WALK_TMP:
+                trans_tile(M, N, A, B, tmp, i0, i1, j0, j1);
+                break;
             }
         }
     }
+
+    assert(is_transpose(M, N, A, B));
+}
+
+/*
+ * The candidates ./autotune picks from: every walk of every tile shape.
+ * TUNE_VARIANTS(X) expands X(ROWS, COLS, NAME, WALK) once per candidate.
+ */
+#define TUNE_SHAPE(X, ROWS, COLS)                                              \
+    X(ROWS, COLS, row, WALK_ROW)                                               \
+    X(ROWS, COLS, row_diag, WALK_ROW_DIAG)                                     \
+    X(ROWS, COLS, col, WALK_COL)                                               \
+    X(ROWS, COLS, col_diag, WALK_COL_DIAG)                                     \
+    X(ROWS, COLS, tmp, WALK_TMP)
+
+#define TUNE_VARIANTS(X)                                                       \
+    TUNE_SHAPE(X, 4, 4)                                                        \
+    TUNE_SHAPE(X, 4, 8)                                                        \
+    TUNE_SHAPE(X, 4, 16)                                                       \
+    TUNE_SHAPE(X, 8, 4)                                                        \
+    TUNE_SHAPE(X, 8, 8)                                                        \
+    TUNE_SHAPE(X, 8, 16)                                                       \
+    TUNE_SHAPE(X, 16, 4)                                                       \
+    TUNE_SHAPE(X, 16, 8)                                                       \
+    TUNE_SHAPE(X, 16, 16)
+
+/* Defines tune_<ROWS>x<COLS>_<NAME>, e.g. tune_8x8_row_diag */
+#define TUNE_DEFINE(ROWS, COLS, NAME, WALK)                                    \
+    static void tune_##ROWS##x##COLS##_##NAME(                                 \
+        size_t M, size_t N, double A[N][M], double B[M][N],                    \
+        double tmp[TMPCOUNT]) {                                                \
+        trans_blocked(M, N, A, B, tmp, ROWS, COLS, WALK);                      \
+    }
+
+TUNE_VARIANTS(TUNE_DEFINE)
+
+/* BEGIN ./autotune dispatch, do not edit */
+/**
+ * @brief Calls the fastest candidate measured for M by N.
+ *
+ * Cycles are for the test cache (s=5, E=1, b=6) and the Haswell L1
+ * cache (s=6, E=8, b=6), ranked by the test cache.
+ */
+static void transpose_tuned(size_t M, size_t N, double A[N][M],
+                            double B[M][N], double tmp[TMPCOUNT]) {
+    if (M == 32 && N == 32) {
+        /* 35456, 32768 cycles */
+        tune_8x8_row_diag(M, N, A, B, tmp);
+    } else if (M == 64 && N == 64) {
+        /* 200192, 131072 cycles */
+        tune_8x4_row_diag(M, N, A, B, tmp);
+    } else if (M == 128 && N == 128) {
+        /* 760672, 656896 cycles */
+        trans_staged(M, N, A, B, tmp);
+    } else if (M == 1024 && N == 1024) {
+        /* 42532864, 42532864 cycles */
+        trans_staged(M, N, A, B, tmp);
+    } else if (M == 63 && N == 65) {
+        /* 251352, 138648 cycles */
+        tune_16x4_row_diag(M, N, A, B, tmp);
+    } else if (M == 57 && N == 57) {
+        /* 178248, 110568 cycles */
+        tune_8x4_col(M, N, A, B, tmp);
+    } else if (M == 61 && N == 67) {
+        /* 209720, 135896 cycles */
+        tune_16x4_col(M, N, A, B, tmp);
+    } else if (M == 6 && N == 60) {
+        /* 14784, 11520 cycles */
+        tune_4x8_row(M, N, A, B, tmp);
+    } else if (M == 137 && N == 1) {
+        /* 5744, 5744 cycles */
+        trans_staged(M, N, A, B, tmp);
+    } else if (M == 1 && N == 137) {
+        /* 6416, 6416 cycles */
+        trans_staged(M, N, A, B, tmp);
+    } else {
+        trans_recursive(M, N, A, B, tmp);
+    }
+}
+/* END ./autotune dispatch */
+
+/**
+ * @brief The solution transpose function that will be graded.
+ *
+ * You can call other transpose functions from here as you please.
+ * It's OK to choose different functions based on array size, but
+ * this function must be correct for all values of M and N. The choice is
+ * made by transpose_tuned() above, which ./autotune regenerates in place.
+ */
+static void transpose_submit(size_t M, size_t N, double A[N][M], double B[M][N],
+                             double tmp[TMPCOUNT]) {
+    transpose_tuned(M, N, A, B, tmp);
 }
 
 /**
@@ -189,10 +460,32 @@ void transpose_1024(size_t M, size_t N, double A[N][M], double B[M][N],
 void registerFunctions(void) {
     // Register the solution function. Do not modify this line!
     registerTransFunction(transpose_submit, SUBMIT_DESCRIPTION);
-    // registerTransFunction(transpose_32, SUBMIT_DESCRIPTION);
-    // registerTransFunction(transpose_1024, SUBMIT_DESCRIPTION);
 
     // Register any additional transpose functions
     registerTransFunction(trans_basic, "Basic transpose");
     registerTransFunction(trans_tmp, "Transpose using the temporary array");
+    registerTransFunction(trans_recursive,
+                          "Cache-oblivious recursive transpose");
+    registerTransFunction(trans_staged, "Transpose staged around conflicts");
+
+    // The SSE2 and AVX2 transposes in trans-simd.c
+    registerSimdFunctions();
+}
+
+/* Registers a candidate under its function name, which the dispatch uses */
+#define TUNE_REGISTER(ROWS, COLS, NAME, WALK)                                  \
+    registerTransFunction(tune_##ROWS##x##COLS##_##NAME,                       \
+                          "tune_" #ROWS "x" #COLS "_" #NAME);
+
+/**
+ * @brief Registers the candidates for ./autotune in place of the functions
+ *        above; tracegen-ct -T runs these.
+ *
+ * Each description is the name of the function, which is how the
+ * generated transpose_tuned() refers to the winner for each shape.
+ */
+void registerTuningFunctions(void) {
+    registerTransFunction(trans_recursive, "trans_recursive");
+    registerTransFunction(trans_staged, "trans_staged");
+    TUNE_VARIANTS(TUNE_REGISTER)
 }